@@ -0,0 +1,463 @@
+#ifndef BTREEBUCKET_H
+#define BTREEBUCKET_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "IPvX.h"
+
+namespace regban {
+
+// IPTable bucket keeping its elements in a B+tree with nodes of a few cache lines, so inserting and removing
+// stays logarithmic in the bucket size; as in many database B-trees, nodes are not merged when they underflow
+// on removal, but freed once empty
+template<typename Element>
+class BTreeBucket {
+  public:
+    static constexpr std::size_t LEAF_SIZE = 16;   // elements per leaf
+    static constexpr std::size_t INNER_SIZE = 16;  // children per inner node
+
+  private:
+    struct Node {
+        bool leaf;
+        std::size_t count;  // number of elements or children
+    };
+
+    struct Leaf : public Node {
+        Leaf* prev = nullptr;
+        Leaf* next = nullptr;
+        std::array<Element, LEAF_SIZE> elements;
+        Leaf() : Node{true, 0} {}
+    };
+
+    struct Inner : public Node {
+        std::array<IPvX, INNER_SIZE - 1> keys;  // keys[i] is not larger than any ip in children[i + 1] and larger than any in children[i]
+        std::array<Node*, INNER_SIZE> children;
+        Inner() : Node{false, 0} {}
+    };
+
+    struct Split {
+        IPvX key;
+        Node* right;  // nullptr if node has not been split
+    };
+
+    Node* root = nullptr;
+    Leaf* first = nullptr;
+    std::size_t size_m = 0;
+
+    static std::size_t child_index(const Inner* inner, IPvX ip) {
+        std::size_t i = 0;
+        while (i + 1 < inner->count && inner->keys[i] <= ip) {
+            ++i;
+        }
+        return i;
+    }
+
+    static void destroy(Node* node) {
+        if (node->leaf) {
+            delete static_cast<Leaf*>(node);
+        } else {
+            auto* inner = static_cast<Inner*>(node);
+            for (std::size_t i = 0; i < inner->count; ++i) {
+                destroy(inner->children[i]);
+            }
+            delete inner;
+        }
+    }
+
+    Split insert(Leaf* leaf, IPvX ip, std::pair<bool, Element*>& res) {
+        std::size_t i = 0;
+        while (i < leaf->count && leaf->elements[i].ip < ip) {
+            ++i;
+        }
+        if (i < leaf->count && leaf->elements[i].ip == ip) {
+            res = {true, &leaf->elements[i]};
+            return {0, nullptr};
+        }
+        Split split{0, nullptr};
+        if (leaf->count == LEAF_SIZE) {
+            auto* right = new Leaf;
+            constexpr auto half = LEAF_SIZE / 2;
+            std::move(std::begin(leaf->elements) + half, std::end(leaf->elements), std::begin(right->elements));
+            right->count = LEAF_SIZE - half;
+            leaf->count = half;
+            right->prev = leaf;
+            right->next = leaf->next;
+            if (leaf->next != nullptr) {
+                leaf->next->prev = right;
+            }
+            leaf->next = right;
+            split = {right->elements[0].ip, right};
+            if (i > half) {
+                leaf = right;
+                i -= half;
+            }
+        }
+        std::move_backward(std::begin(leaf->elements) + i, std::begin(leaf->elements) + leaf->count, std::begin(leaf->elements) + leaf->count + 1);
+        leaf->elements[i] = Element{ip, {}};
+        ++leaf->count;
+        res = {false, &leaf->elements[i]};
+        return split;
+    }
+
+    Split insert(Node* node, IPvX ip, std::pair<bool, Element*>& res) {
+        if (node->leaf) {
+            return insert(static_cast<Leaf*>(node), ip, res);
+        }
+        auto* inner = static_cast<Inner*>(node);
+        const auto c = child_index(inner, ip);
+        const auto child_split = insert(inner->children[c], ip, res);
+        if (child_split.right == nullptr) {
+            return {0, nullptr};
+        }
+        std::array<IPvX, INNER_SIZE> keys;
+        std::array<Node*, INNER_SIZE + 1> children;
+        const auto n = inner->count + 1;
+        std::copy(std::begin(inner->keys), std::begin(inner->keys) + c, std::begin(keys));
+        keys[c] = child_split.key;
+        std::copy(std::begin(inner->keys) + c, std::begin(inner->keys) + inner->count - 1, std::begin(keys) + c + 1);
+        std::copy(std::begin(inner->children), std::begin(inner->children) + c + 1, std::begin(children));
+        children[c + 1] = child_split.right;
+        std::copy(std::begin(inner->children) + c + 1, std::begin(inner->children) + inner->count, std::begin(children) + c + 2);
+        if (n <= INNER_SIZE) {
+            std::copy(std::begin(keys), std::begin(keys) + n - 1, std::begin(inner->keys));
+            std::copy(std::begin(children), std::begin(children) + n, std::begin(inner->children));
+            inner->count = n;
+            return {0, nullptr};
+        }
+        auto* right = new Inner;
+        constexpr auto half = (INNER_SIZE + 1) / 2;
+        std::copy(std::begin(keys), std::begin(keys) + half - 1, std::begin(inner->keys));
+        std::copy(std::begin(children), std::begin(children) + half, std::begin(inner->children));
+        inner->count = half;
+        std::copy(std::begin(keys) + half, std::end(keys), std::begin(right->keys));
+        std::copy(std::begin(children) + half, std::end(children), std::begin(right->children));
+        right->count = INNER_SIZE + 1 - half;
+        return {keys[half - 1], right};
+    }
+
+    static void destroy_inner(Node* node) {
+        if (!node->leaf) {
+            auto* inner = static_cast<Inner*>(node);
+            for (std::size_t i = 0; i < inner->count; ++i) {
+                destroy_inner(inner->children[i]);
+            }
+            delete inner;
+        }
+    }
+
+    // builds inner nodes above nodes of one level, min_ips[i] being the smallest ip below nodes[i]
+    void build_inner(std::vector<Node*>& nodes, std::vector<IPvX>& min_ips) {
+        while (nodes.size() > 1) {
+            std::size_t parents = 0;
+            for (std::size_t i = 0; i < nodes.size(); i += INNER_SIZE) {
+                auto* inner = new Inner;
+                inner->count = nodes.size() - i < INNER_SIZE ? nodes.size() - i : INNER_SIZE;
+                for (std::size_t j = 0; j < inner->count; ++j) {
+                    inner->children[j] = nodes[i + j];
+                    if (j > 0) {
+                        inner->keys[j - 1] = min_ips[i + j];
+                    }
+                }
+                nodes[parents] = inner;
+                min_ips[parents] = min_ips[i];
+                ++parents;
+            }
+            nodes.resize(parents);
+            min_ips.resize(parents);
+        }
+        root = nodes.empty() ? nullptr : nodes[0];
+    }
+
+    // returns true if node has become empty and has been freed
+    bool remove(Node* node, IPvX ip) {
+        if (node->leaf) {
+            auto* leaf = static_cast<Leaf*>(node);
+            std::size_t i = 0;
+            while (i < leaf->count && leaf->elements[i].ip < ip) {
+                ++i;
+            }
+            if (i == leaf->count || leaf->elements[i].ip != ip) {
+                return false;
+            }
+            std::move(std::begin(leaf->elements) + i + 1, std::begin(leaf->elements) + leaf->count, std::begin(leaf->elements) + i);
+            --leaf->count;
+            --size_m;
+            if (leaf->count > 0) {
+                leaf->elements[leaf->count] = Element{};
+                return false;
+            }
+            if (leaf->prev != nullptr) {
+                leaf->prev->next = leaf->next;
+            } else {
+                first = leaf->next;
+            }
+            if (leaf->next != nullptr) {
+                leaf->next->prev = leaf->prev;
+            }
+            delete leaf;
+            return true;
+        }
+        auto* inner = static_cast<Inner*>(node);
+        const auto c = child_index(inner, ip);
+        if (!remove(inner->children[c], ip)) {
+            return false;
+        }
+        // child c covers its range together with its left neighbour (or right neighbour for the first child) from now on
+        if (inner->count == 1) {
+            delete inner;
+            return true;
+        }
+        const auto k = c == 0 ? 0 : c - 1;
+        std::copy(std::begin(inner->keys) + k + 1, std::begin(inner->keys) + inner->count - 1, std::begin(inner->keys) + k);
+        std::copy(std::begin(inner->children) + c + 1, std::begin(inner->children) + inner->count, std::begin(inner->children) + c);
+        --inner->count;
+        return false;
+    }
+
+  public:
+    template<bool Const>
+    class Iterator {
+        friend class BTreeBucket;
+        template<bool>
+        friend class Iterator;
+
+      private:
+        using LeafPointer = typename std::conditional<Const, const Leaf*, Leaf*>::type;
+        using Value = typename std::conditional<Const, const Element, Element>::type;
+        LeafPointer leaf = nullptr;
+        std::size_t pos = 0;
+        Iterator(LeafPointer leaf_p, std::size_t pos_p) : leaf(leaf_p), pos(pos_p) {}
+
+      public:
+        Iterator() = default;
+        template<bool C = Const, typename = typename std::enable_if<C>::type>
+        Iterator(const Iterator<false>& other) : leaf(other.leaf), pos(other.pos) {}
+
+        Iterator& operator++() {
+            ++pos;
+            if (pos == leaf->count) {
+                leaf = leaf->next;
+                pos = 0;
+            }
+            return *this;
+        }
+        Value& operator*() const { return leaf->elements[pos]; }
+        Value* operator->() const { return &leaf->elements[pos]; }
+        bool operator==(const Iterator& rhs) const { return leaf == rhs.leaf && pos == rhs.pos; }
+        bool operator!=(const Iterator& rhs) const { return leaf != rhs.leaf || pos != rhs.pos; }
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    BTreeBucket() = default;
+    BTreeBucket(const BTreeBucket&) = delete;
+    BTreeBucket& operator=(const BTreeBucket&) = delete;
+    BTreeBucket(BTreeBucket&& other) noexcept : root(other.root), first(other.first), size_m(other.size_m) {
+        other.root = nullptr;
+        other.first = nullptr;
+        other.size_m = 0;
+    }
+    BTreeBucket& operator=(BTreeBucket&& other) noexcept {
+        std::swap(root, other.root);
+        std::swap(first, other.first);
+        std::swap(size_m, other.size_m);
+        return *this;
+    }
+    ~BTreeBucket() { clear(); }
+
+    iterator begin() { return {first, 0}; }
+    iterator end() { return {}; }
+    const_iterator begin() const { return {first, 0}; }
+    const_iterator end() const { return {}; }
+    std::size_t size() const { return size_m; }
+    void reserve(std::size_t) {}
+
+    void clear() {
+        if (root != nullptr) {
+            destroy(root);
+        }
+        root = nullptr;
+        first = nullptr;
+        size_m = 0;
+    }
+
+    // get largest element not larger than ip
+    const_iterator floor(IPvX ip) const {
+        if (root == nullptr) {
+            return end();
+        }
+        const Node* node = root;
+        while (!node->leaf) {
+            const auto* inner = static_cast<const Inner*>(node);
+            node = inner->children[child_index(inner, ip)];
+        }
+        const auto* leaf = static_cast<const Leaf*>(node);
+        std::size_t i = 0;
+        while (i < leaf->count && leaf->elements[i].ip <= ip) {
+            ++i;
+        }
+        if (i == 0) {
+            // all elements of leaf are larger, previous leaf holds the result
+            leaf = leaf->prev;
+            if (leaf == nullptr) {
+                return end();
+            }
+            i = leaf->count;
+        }
+        return {leaf, i - 1};
+    }
+
+    // get largest element not larger than ip
+    iterator floor(IPvX ip) {
+        const auto res = static_cast<const BTreeBucket*>(this)->floor(ip);
+        return {const_cast<Leaf*>(res.leaf), res.pos};
+    }
+
+    std::pair<bool, Element&> find_or_insert(IPvX ip) {
+        if (root == nullptr) {
+            first = new Leaf;
+            root = first;
+        }
+        std::pair<bool, Element*> res;
+        const auto split = insert(root, ip, res);
+        if (split.right != nullptr) {
+            auto* new_root = new Inner;
+            new_root->keys[0] = split.key;
+            new_root->children[0] = root;
+            new_root->children[1] = split.right;
+            new_root->count = 2;
+            root = new_root;
+        }
+        if (!res.first) {
+            ++size_m;
+        }
+        return {res.first, *res.second};
+    }
+
+    // compacts leaves in a single pass and rebuilds inner nodes above them, returns number of removed elements
+    template<typename Predicate>
+    std::size_t erase_if(Predicate&& pred) {
+        if (root == nullptr) {
+            return 0;
+        }
+        const auto size_before = size_m;
+        destroy_inner(root);
+        std::vector<Node*> leaves;
+        std::vector<IPvX> min_ips;
+        Leaf* prev = nullptr;
+        for (auto* leaf = first; leaf != nullptr;) {
+            std::size_t kept = 0;
+            for (std::size_t i = 0; i < leaf->count; ++i) {
+                if (!pred(leaf->elements[i].ip, leaf->elements[i].value)) {
+                    if (i != kept) {
+                        leaf->elements[kept] = std::move(leaf->elements[i]);
+                    }
+                    ++kept;
+                }
+            }
+            for (std::size_t i = kept; i < leaf->count; ++i) {
+                leaf->elements[i] = Element{};
+            }
+            size_m -= leaf->count - kept;
+            leaf->count = kept;
+            auto* next = leaf->next;
+            if (kept == 0) {
+                delete leaf;
+            } else {
+                leaf->prev = prev;
+                if (prev == nullptr) {
+                    first = leaf;
+                } else {
+                    prev->next = leaf;
+                }
+                prev = leaf;
+                leaves.push_back(leaf);
+                min_ips.push_back(leaf->elements[0].ip);
+            }
+            leaf = next;
+        }
+        if (prev == nullptr) {
+            first = nullptr;
+        } else {
+            prev->next = nullptr;
+        }
+        build_inner(leaves, min_ips);
+        return size_before - size_m;
+    }
+
+    // merges elements sorted by ip without repetitions (moved from, replacing the values of ips already in the bucket)
+    // with all elements of the bucket in a single pass into full leaves and rebuilds inner nodes above them, returns
+    // number of new elements
+    std::size_t merge(Element* first_p, Element* last_p) {
+        std::vector<Element> merged;
+        merged.reserve(size_m + (last_p - first_p));
+        {
+            auto it = begin();
+            while (first_p != last_p) {
+                if (it != end() && it->ip < first_p->ip) {
+                    merged.emplace_back(std::move(*it));
+                    ++it;
+                } else {
+                    if (it != end() && it->ip == first_p->ip) {
+                        ++it;
+                    }
+                    merged.emplace_back(std::move(*first_p));
+                    ++first_p;
+                }
+            }
+            for (; it != end(); ++it) {
+                merged.emplace_back(std::move(*it));
+            }
+        }
+        const auto size_before = size_m;
+        clear();
+        std::vector<Node*> leaves;
+        std::vector<IPvX> min_ips;
+        Leaf* prev = nullptr;
+        for (std::size_t i = 0; i < merged.size(); i += LEAF_SIZE) {
+            auto* leaf = new Leaf;
+            leaf->count = merged.size() - i < LEAF_SIZE ? merged.size() - i : LEAF_SIZE;
+            std::move(std::begin(merged) + i, std::begin(merged) + i + leaf->count, std::begin(leaf->elements));
+            leaf->prev = prev;
+            if (prev == nullptr) {
+                first = leaf;
+            } else {
+                prev->next = leaf;
+            }
+            prev = leaf;
+            leaves.push_back(leaf);
+            min_ips.push_back(leaf->elements[0].ip);
+        }
+        size_m = merged.size();
+        build_inner(leaves, min_ips);
+        return size_m - size_before;
+    }
+
+    // returns false if ip is not in bucket
+    bool remove(IPvX ip) {
+        if (root == nullptr) {
+            return false;
+        }
+        const auto size_before = size_m;
+        if (remove(root, ip)) {
+            root = nullptr;
+            return true;
+        }
+        while (!root->leaf && root->count == 1) {
+            auto* inner = static_cast<Inner*>(root);
+            root = inner->children[0];
+            delete inner;
+        }
+        return size_m != size_before;
+    }
+};
+
+}  // namespace regban
+
+#endif
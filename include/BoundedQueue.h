@@ -0,0 +1,166 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace regban {
+
+// bounded lock-free multi-producer multi-consumer queue (D. Vyukov's array-based design),
+// blocking push()/pop() only park on a condition variable when the queue stays full/empty
+template<typename T>
+class BoundedQueue {
+  private:
+    static constexpr int SPIN_COUNT = 64;
+
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    std::size_t mask;
+    char pad0[64];
+    std::atomic<std::size_t> enqueue_pos{0};
+    char pad1[64];
+    std::atomic<std::size_t> dequeue_pos{0};
+    char pad2[64];
+    std::atomic<bool> closed{false};
+    std::atomic<unsigned int> waiting{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    bool has_space() const {
+        const auto pos = enqueue_pos.load(std::memory_order_relaxed);
+        return cells[pos & mask].sequence.load(std::memory_order_acquire) == pos;
+    }
+
+    bool has_data() const {
+        const auto pos = dequeue_pos.load(std::memory_order_relaxed);
+        return cells[pos & mask].sequence.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    template<typename Predicate>
+    void wait_until(Predicate&& ready) {
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            if (ready()) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock, ready);
+        waiting.fetch_sub(1);
+    }
+
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_all();
+        }
+    }
+
+  public:
+    explicit BoundedQueue(std::size_t capacity) {
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+            throw std::runtime_error("Queue capacity must be a power of two");
+        }
+        cells.reset(new Cell[capacity]);
+        mask = capacity - 1;
+        for (std::size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    std::size_t capacity() const { return mask + 1; }
+
+    bool try_push(T& value) {
+        Cell* cell;
+        auto pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            const auto seq = cell->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        Cell* cell;
+        auto pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            const auto seq = cell->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->data);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // blocks while full, returns false if queue has been closed
+    bool push(T value) {
+        while (!closed.load(std::memory_order_acquire)) {
+            if (try_push(value)) {
+                notify();
+                return true;
+            }
+            wait_until([this]() { return has_space() || closed.load(std::memory_order_acquire); });
+        }
+        return false;
+    }
+
+    // blocks while empty, returns false if queue has been closed and is drained
+    bool pop(T& value) {
+        while (true) {
+            if (try_pop(value)) {
+                notify();
+                return true;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                return try_pop(value);
+            }
+            wait_until([this]() { return has_data() || closed.load(std::memory_order_acquire); });
+        }
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex);
+        cv.notify_all();
+    }
+};
+
+}  // namespace regban
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef COMPACTBUCKET_H
+#define COMPACTBUCKET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "IPvX.h"
+
+namespace regban {
+
+// IPTable bucket keeping its elements sorted like SortedVectorBucket, but as a structure of arrays: the keys, which for
+// the IPv4 buckets are only the 32-bit addresses instead of a full IPvX, are kept densely in one array for the binary
+// search, the values in a parallel one; as a bucket only holds ips of one address family, only one of the key arrays is
+// used
+template<typename Element>
+class CompactBucket {
+  public:
+    using T = typename Element::value_type;
+
+    // stands in for an element, which is not stored as such
+    template<bool Const>
+    struct Reference {
+        IPvX ip;
+        typename std::conditional<Const, const T&, T&>::type value;
+
+        const Reference* operator->() const { return this; }
+    };
+
+  private:
+    std::vector<IPvX::IPv4> keys_v4;
+    std::vector<IPvX::Internal> keys_v6;
+    std::vector<T> values;
+
+    template<typename Key>
+    static std::size_t find_floor(const std::vector<Key>& keys, Key key) {
+        // number of keys not larger than key
+        return std::upper_bound(std::begin(keys), std::end(keys), key) - std::begin(keys);
+    }
+
+    // position of first key not smaller than ip
+    std::size_t position(IPvX ip) const {
+        return ip.is_ipv6() ? std::lower_bound(std::begin(keys_v6), std::end(keys_v6), static_cast<IPvX::Internal>(ip)) - std::begin(keys_v6)
+                            : std::lower_bound(std::begin(keys_v4), std::end(keys_v4), static_cast<IPvX::IPv4>(ip)) - std::begin(keys_v4);
+    }
+
+    IPvX key(std::size_t i) const { return keys_v6.empty() ? IPvX(keys_v4[i]) : IPvX(keys_v6[i]); }
+
+    template<typename Key>
+    std::size_t merge_keys(std::vector<Key>& keys, Element* first, Element* last) {
+        std::size_t added = 0;
+        {
+            auto it = std::cbegin(keys);
+            for (const auto* e = first; e != last; ++e) {
+                it = std::lower_bound(it, std::cend(keys), static_cast<Key>(e->ip));
+                if (it == std::cend(keys) || *it != static_cast<Key>(e->ip)) {
+                    ++added;
+                }
+            }
+        }
+        auto i = keys.size();
+        keys.reserve(i + added);
+        keys.resize(i + added);
+        values.reserve(i + added);
+        values.resize(i + added);
+        auto out = keys.size();
+        while (last != first) {
+            const auto k = static_cast<Key>((last - 1)->ip);
+            if (i > 0 && keys[i - 1] > k) {
+                --i;
+                --out;
+                keys[out] = keys[i];
+                values[out] = std::move(values[i]);
+            } else {
+                if (i > 0 && keys[i - 1] == k) {
+                    --i;
+                }
+                --last;
+                --out;
+                keys[out] = k;
+                values[out] = std::move(last->value);
+            }
+        }
+        return added;
+    }
+
+    template<typename Key, typename Predicate>
+    std::size_t erase_keys_if(std::vector<Key>& keys, Predicate& pred) {
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            if (!pred(IPvX(keys[i]), values[i])) {
+                if (i != kept) {
+                    keys[kept] = keys[i];
+                    values[kept] = std::move(values[i]);
+                }
+                ++kept;
+            }
+        }
+        const auto res = keys.size() - kept;
+        keys.resize(kept);
+        values.erase(std::begin(values) + kept, std::end(values));
+        return res;
+    }
+
+  public:
+    template<bool Const>
+    class Iterator {
+        friend class CompactBucket;
+        template<bool>
+        friend class Iterator;
+
+      private:
+        using BucketPointer = typename std::conditional<Const, const CompactBucket*, CompactBucket*>::type;
+        BucketPointer bucket = nullptr;
+        std::size_t pos = 0;
+        Iterator(BucketPointer bucket_p, std::size_t pos_p) : bucket(bucket_p), pos(pos_p) {}
+
+      public:
+        Iterator() = default;
+        template<bool C = Const, typename = typename std::enable_if<C>::type>
+        Iterator(const Iterator<false>& other) : bucket(other.bucket), pos(other.pos) {}
+
+        Iterator& operator++() {
+            ++pos;
+            return *this;
+        }
+        Reference<Const> operator*() const { return {bucket->key(pos), bucket->values[pos]}; }
+        Reference<Const> operator->() const { return **this; }
+        bool operator==(const Iterator& rhs) const { return bucket == rhs.bucket && pos == rhs.pos; }
+        bool operator!=(const Iterator& rhs) const { return bucket != rhs.bucket || pos != rhs.pos; }
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    iterator begin() { return {this, 0}; }
+    iterator end() { return {this, values.size()}; }
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, values.size()}; }
+    std::size_t size() const { return values.size(); }
+
+    void clear() {
+        keys_v4.clear();
+        keys_v6.clear();
+        values.clear();
+    }
+
+    // address family is not known yet, so keys are reserved on the first insertion
+    void reserve(std::size_t size_p) { values.reserve(size_p); }
+
+    // get largest element not larger than ip
+    const_iterator floor(IPvX ip) const {
+        const auto n = ip.is_ipv6() ? find_floor(keys_v6, static_cast<IPvX::Internal>(ip)) : find_floor(keys_v4, static_cast<IPvX::IPv4>(ip));
+        return n == 0 ? end() : const_iterator{this, n - 1};
+    }
+
+    // get largest element not larger than ip
+    iterator floor(IPvX ip) {
+        const auto res = static_cast<const CompactBucket*>(this)->floor(ip);
+        return {this, res.pos};
+    }
+
+    std::pair<bool, Reference<false>> find_or_insert(IPvX ip) {
+        const auto i = position(ip);
+        if (i < values.size() && key(i) == ip) {
+            return {true, {ip, values[i]}};
+        }
+        if (ip.is_ipv6()) {
+            keys_v6.reserve(values.capacity());
+            keys_v6.insert(std::begin(keys_v6) + i, static_cast<IPvX::Internal>(ip));
+        } else {
+            keys_v4.reserve(values.capacity());
+            keys_v4.insert(std::begin(keys_v4) + i, static_cast<IPvX::IPv4>(ip));
+        }
+        values.insert(std::begin(values) + i, T{});
+        return {false, {ip, values[i]}};
+    }
+
+    // returns false if ip is not in bucket
+    bool remove(IPvX ip) {
+        const auto i = position(ip);
+        if (i == values.size() || key(i) != ip) {
+            return false;
+        }
+        if (ip.is_ipv6()) {
+            keys_v6.erase(std::begin(keys_v6) + i);
+        } else {
+            keys_v4.erase(std::begin(keys_v4) + i);
+        }
+        values.erase(std::begin(values) + i);
+        return true;
+    }
+
+    // merges elements sorted by ip without repetitions (moved from, replacing the values of ips already in the bucket)
+    // from the back after growing exactly once, returns number of new elements
+    std::size_t merge(Element* first, Element* last) {
+        if (first == last) {
+            return 0;
+        }
+        return first->ip.is_ipv6() ? merge_keys(keys_v6, first, last) : merge_keys(keys_v4, first, last);
+    }
+
+    // returns number of removed elements
+    template<typename Predicate>
+    std::size_t erase_if(Predicate&& pred) {
+        return keys_v6.empty() ? erase_keys_if(keys_v4, pred) : erase_keys_if(keys_v6, pred);
+    }
+};
+
+}  // namespace regban
+
+#endif
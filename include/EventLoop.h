@@ -0,0 +1,133 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace regban {
+
+class EventLoop {
+  public:
+    using Callback = std::function<void(std::uint32_t)>;  // gets the epoll event flags
+
+  private:
+    struct Registration {
+        int fd;
+        bool active;
+        Callback callback;
+    };
+
+    int epollfd = -1;
+    std::vector<epoll_event> events;
+    std::unordered_map<int, std::unique_ptr<Registration>> registrations;
+    std::vector<std::unique_ptr<Registration>> removed;  // kept alive until the current dispatch round is over
+    std::vector<int> timers;
+
+  public:
+    explicit EventLoop(std::size_t max_events = 64) : events(max_events) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd < 0) {
+            throw std::runtime_error(std::string("Could not create epoll instance: ") + std::strerror(errno));
+        }
+    }
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        for (const auto fd : timers) {
+            close(fd);
+        }
+        if (epollfd >= 0) {
+            close(epollfd);
+        }
+    }
+
+    std::size_t size() const { return registrations.size(); }
+
+    // fd is only watched, it stays owned by the caller (which has to remove() it before closing it)
+    void add(int fd, Callback callback, std::uint32_t flags = EPOLLIN | EPOLLET) {
+        std::unique_ptr<Registration> registration(new Registration{fd, true, std::move(callback)});
+        epoll_event ev{};
+        ev.events = flags;
+        ev.data.ptr = registration.get();
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            throw std::runtime_error("Could not watch fd " + std::to_string(fd) + ": " + std::strerror(errno));
+        }
+        registrations[fd] = std::move(registration);
+    }
+
+    void remove(int fd) {
+        auto it = registrations.find(fd);
+        if (it == std::end(registrations)) {
+            return;
+        }
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);  // might already be gone if fd has been closed
+        it->second->active = false;
+        removed.emplace_back(std::move(it->second));
+        registrations.erase(it);
+    }
+
+    // periodic timer, first expiring after one interval; returns the timerfd (owned by the loop)
+    int add_timer(std::chrono::milliseconds interval, const std::function<void()>& callback) {
+        const auto fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Could not create timer: ") + std::strerror(errno));
+        }
+        timers.push_back(fd);
+        set_timer(fd, interval, interval);
+        add(fd, [fd, callback](std::uint32_t) {
+            std::uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                callback();
+            }
+        });
+        return fd;
+    }
+
+    // zero initial disarms the timer, zero interval makes it one-shot
+    static void set_timer(int fd, std::chrono::milliseconds initial, std::chrono::milliseconds interval) {
+        itimerspec spec{};
+        spec.it_value.tv_sec = initial.count() / 1000;
+        spec.it_value.tv_nsec = (initial.count() % 1000) * 1000000;
+        spec.it_interval.tv_sec = interval.count() / 1000;
+        spec.it_interval.tv_nsec = (interval.count() % 1000) * 1000000;
+        if (timerfd_settime(fd, 0, &spec, nullptr) < 0) {
+            throw std::runtime_error(std::string("Could not set timer: ") + std::strerror(errno));
+        }
+    }
+
+    // returns false if interrupted by a signal
+    bool run_once(int timeout_ms = -1) {
+        const auto n = epoll_wait(epollfd, &events[0], events.size(), timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                return false;
+            }
+            throw std::runtime_error(std::string("epoll_wait() failed: ") + std::strerror(errno));
+        }
+        for (int i = 0; i < n; ++i) {
+            auto* registration = static_cast<Registration*>(events[i].data.ptr);
+            if (registration->active) {
+                registration->callback(events[i].events);
+            }
+        }
+        removed.clear();
+        return true;
+    }
+};
+
+}  // namespace regban
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef FLATIPTABLE_H
+#define FLATIPTABLE_H
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "IPTable.h"
+#include "IPvX.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace regban {
+
+template<typename T>
+class FlatIPTable;
+
+template<typename T>
+class FlatIPTable_iterator {
+    friend class FlatIPTable<T>;
+
+  protected:
+    FlatIPTable<T>& ip_table;
+    std::size_t index;
+    FlatIPTable_iterator(FlatIPTable<T>& ip_table_p, std::size_t index_p) : ip_table(ip_table_p), index(index_p) {}
+
+  public:
+    void operator++() { index = ip_table.next_used(index + 1); }
+    const std::pair<IPvX, T&> operator*() const { return {ip_table.slots[index].ip, ip_table.slots[index].value}; }
+    std::pair<IPvX, T&> operator*() { return {ip_table.slots[index].ip, ip_table.slots[index].value}; }
+    bool operator==(const FlatIPTable_iterator& rhs) const { return index == rhs.index; }
+    bool operator!=(const FlatIPTable_iterator& rhs) const { return index != rhs.index; }
+};
+
+// open-addressing hash table for exact lookups with the interface of IPTable, but without any order:
+// Swiss table style control bytes (7 bits of the hash per slot) are compared 16 at a time to find candidate slots,
+// slots are probed linearly so that removing shifts following elements back instead of leaving tombstones
+template<typename T>
+class FlatIPTable {
+    friend class FlatIPTable_iterator<T>;
+
+  public:
+    static constexpr std::size_t GROUP_SIZE = 16;
+    static constexpr std::size_t MIN_CAPACITY = GROUP_SIZE;
+
+    using Element = IPTableElement<T>;
+    using iterator = FlatIPTable_iterator<T>;
+
+    iterator begin() { return {*this, next_used(0)}; }
+    iterator end() { return {*this, slots.size()}; }
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+  public:
+#else
+  protected:
+#endif
+    static constexpr std::uint8_t EMPTY = 0x80;
+
+    std::vector<std::uint8_t> control;  // per slot EMPTY or lower 7 bits of hash, first GROUP_SIZE - 1 repeated at the end
+    std::vector<Element> slots;
+    std::size_t mask = 0;
+    std::size_t size_m = 0;
+
+    static std::uint64_t hash(IPvX ip) {
+        const auto x = static_cast<IPvX::Internal>(static_cast<std::uint64_t>(ip >> 64) * 0x9e3779b97f4a7c15UL ^ static_cast<std::uint64_t>(ip))
+                       * 0xc2b2ae3d27d4eb4fUL;
+        return static_cast<std::uint64_t>(x) ^ static_cast<std::uint64_t>(x >> 64);
+    }
+
+    struct GroupMasks {
+        unsigned int matching;
+        unsigned int empty;
+    };
+
+    // one bit per slot of the group starting at pos
+    GroupMasks match_group(std::size_t pos, std::uint8_t h2) const {
+        const auto* c = &control[pos];
+#ifdef __SSE2__
+        const auto group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c));
+        return {static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)))), static_cast<unsigned int>(_mm_movemask_epi8(group))};
+#else
+        GroupMasks res{0, 0};
+        for (std::size_t i = 0; i < GROUP_SIZE; ++i) {
+            res.matching |= static_cast<unsigned int>(c[i] == h2) << i;
+            res.empty |= static_cast<unsigned int>(c[i] >> 7) << i;
+        }
+        return res;
+#endif
+    }
+
+    void set_control(std::size_t i, std::uint8_t c) {
+        control[i] = c;
+        if (i < GROUP_SIZE - 1) {
+            control[mask + 1 + i] = c;
+        }
+    }
+
+    std::size_t next_used(std::size_t i) const {
+        while (i < slots.size() && control[i] == EMPTY) {
+            ++i;
+        }
+        return i;
+    }
+
+    // index of slot holding ip, or of the first empty slot in its probe sequence if ip is not in the table
+    std::pair<bool, std::size_t> probe(IPvX ip) const {
+        const auto h = hash(ip);
+        const auto h2 = static_cast<std::uint8_t>(h & 0x7f);
+        auto pos = (h >> 7) & mask;
+        while (true) {
+            const auto masks = match_group(pos, h2);
+            for (auto m = masks.matching; m != 0; m &= m - 1) {
+                const auto i = (pos + __builtin_ctz(m)) & mask;
+                if (slots[i].ip == ip) {
+                    return {true, i};
+                }
+            }
+            if (masks.empty != 0) {
+                return {false, (pos + __builtin_ctz(masks.empty)) & mask};
+            }
+            pos = (pos + GROUP_SIZE) & mask;
+        }
+    }
+
+    std::size_t first_empty(std::size_t pos) const {
+        while (true) {
+            const auto empty = match_group(pos, EMPTY).empty;
+            if (empty != 0) {
+                return (pos + __builtin_ctz(empty)) & mask;
+            }
+            pos = (pos + GROUP_SIZE) & mask;
+        }
+    }
+
+    void rehash(std::size_t capacity) {
+        std::vector<Element> old_slots(capacity);
+        std::swap(slots, old_slots);
+        std::vector<std::uint8_t> old_control(capacity + GROUP_SIZE - 1, static_cast<std::uint8_t>(EMPTY));
+        std::swap(control, old_control);
+        mask = capacity - 1;
+        for (std::size_t i = 0; i < old_slots.size(); ++i) {
+            if (old_control[i] != EMPTY) {
+                const auto res = probe(old_slots[i].ip);
+                set_control(res.second, old_control[i]);
+                slots[res.second] = std::move(old_slots[i]);
+            }
+        }
+    }
+
+    static std::size_t capacity_for(std::size_t size_p) {
+        std::size_t res = MIN_CAPACITY;
+        while (res - res / 8 < size_p) {  // maximum load factor of 7/8
+            res *= 2;
+        }
+        return res;
+    }
+
+  public:
+    FlatIPTable() { clear(); }
+    explicit FlatIPTable(std::size_t size_p) { clear_and_reserve(size_p); }
+
+    std::size_t size() const { return size_m; }
+
+    void clear_and_reserve(std::size_t size_p) {
+        const auto capacity = capacity_for(size_p);
+        size_m = 0;
+        mask = capacity - 1;
+        slots.assign(capacity, Element{});
+        control.assign(capacity + GROUP_SIZE - 1, static_cast<std::uint8_t>(EMPTY));
+    }
+
+    void clear() { clear_and_reserve(0); }
+
+    // grows at once for size_p elements, e.g. before inserting the elements of another FlatIPTable, which come in
+    // the order of their hashes and would otherwise pile up in the smaller table
+    void reserve(std::size_t size_p) {
+        const auto capacity = capacity_for(size_p);
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    const T* find(IPvX ip) const {
+        const auto res = probe(ip);
+        return res.first ? &slots[res.second].value : nullptr;
+    }
+
+    T* find(IPvX ip) {
+        const auto res = probe(ip);
+        return res.first ? &slots[res.second].value : nullptr;
+    }
+
+    // returned reference is invalidated by following insertions and removals
+    std::pair<bool, T&> find_or_insert(IPvX ip) {
+        auto res = probe(ip);
+        if (res.first) {
+            return {true, slots[res.second].value};
+        }
+        if (size_m + 1 > slots.size() - slots.size() / 8) {
+            rehash(2 * slots.size());
+            res = probe(ip);
+        }
+        set_control(res.second, static_cast<std::uint8_t>(hash(ip) & 0x7f));
+        slots[res.second] = Element{ip, {}};
+        ++size_m;
+        return {false, slots[res.second].value};
+    }
+
+    void remove(IPvX ip) {
+        const auto res = probe(ip);
+        if (!res.first) {
+            return;
+        }
+        // shift following elements of the probe sequence back into the gap
+        auto gap = res.second;
+        for (auto i = (gap + 1) & mask; control[i] != EMPTY; i = (i + 1) & mask) {
+            const auto home = (hash(slots[i].ip) >> 7) & mask;
+            if (((i - home) & mask) >= ((i - gap) & mask)) {
+                set_control(gap, control[i]);
+                slots[gap] = std::move(slots[i]);
+                gap = i;
+            }
+        }
+        set_control(gap, EMPTY);
+        slots[gap] = Element{};
+        --size_m;
+    }
+
+    // CLOCK-style eviction: visits at most max_visits elements in slot order from hand on (hand is advanced and kept
+    // between calls) and removes the first one for which pred(ip, value) returns true (pred may also modify value);
+    // returns whether an element has been removed
+    template<typename Predicate>
+    bool evict(std::size_t& hand, std::size_t max_visits, Predicate&& pred) {
+        for (std::size_t visits = 0; visits < max_visits && size_m > 0; hand = (hand + 1) & mask) {
+            hand &= mask;
+            if (control[hand] == EMPTY) {
+                continue;
+            }
+            if (pred(slots[hand].ip, slots[hand].value)) {
+                remove(slots[hand].ip);  // an element shifted into this slot is visited by the next call
+                return true;
+            }
+            ++visits;
+        }
+        return false;
+    }
+
+    // removes all elements for which pred(ip, value) returns true (pred may also modify value) in a single pass,
+    // returns number of removed elements
+    template<typename Predicate>
+    std::size_t erase_if(Predicate&& pred) {
+        // no probe sequence runs across a slot that is empty beforehand
+        std::size_t start = 0;
+        while (control[start] != EMPTY) {
+            ++start;
+        }
+        std::size_t res = 0;
+        bool gap = false;  // whether a slot has been emptied since the last empty one
+        // in probe order, so that remaining elements can be moved to the first empty slot of their probe sequence
+        for (std::size_t k = 1; k < slots.size(); ++k) {
+            const auto i = (start + k) & mask;
+            if (control[i] == EMPTY) {
+                gap = false;
+                continue;
+            }
+            if (pred(slots[i].ip, slots[i].value)) {
+                set_control(i, EMPTY);
+                slots[i] = Element{};
+                ++res;
+                gap = true;
+                continue;
+            }
+            if (!gap) {
+                continue;
+            }
+            const auto home = (hash(slots[i].ip) >> 7) & mask;
+            const auto empty = first_empty(home);
+            if (((empty - home) & mask) < ((i - home) & mask)) {
+                set_control(empty, control[i]);
+                slots[empty] = std::move(slots[i]);
+                set_control(i, EMPTY);
+                slots[i] = Element{};
+            }
+        }
+        size_m -= res;
+        return res;
+    }
+};
+
+}  // namespace regban
+
+template<typename T>
+struct std::iterator_traits<typename regban::FlatIPTable_iterator<T>> {
+    using value_type = std::pair<regban::IPvX, T>;
+    using difference_type = void;
+    using pointer = void;
+    using reference = std::pair<regban::IPvX, T&>;
+    using iterator_category = std::forward_iterator_tag;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef IPRANGETABLE_H
+#define IPRANGETABLE_H
+
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "IPvX.h"
+#include "Poptrie.h"
+
+namespace regban {
+
+// ip ranges (networks) of any prefix length, which may be nested, with longest-prefix matching
+// (using a Poptrie compiled by build() once all ranges are inserted)
+template<typename T>
+class IPRangeTable {
+  public:
+    struct Range {
+        IPvX ip;  // as inserted
+        unsigned char cidr_suffix;
+        T value;
+    };
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+  public:
+#else
+  protected:
+#endif
+    std::vector<Range> ranges;
+    std::map<std::tuple<bool, IPvX, unsigned char>, std::size_t> range_index;  // (is ipv6, network, prefix length) -> index into ranges
+    bool built = true;
+    Poptrie trie;  // to index into ranges + 1
+
+  public:
+    std::size_t size() const { return ranges.size(); }
+
+    // returned reference is invalidated by following insertions, build() has to be called before following lookups
+    std::pair<bool, T&> find_or_insert(IPvX ip, unsigned char cidr_suffix) {
+        if (cidr_suffix > ip.total_bit_size()) {
+            std::ostringstream ss;
+            ss << ip;
+            throw std::runtime_error("CIDR suffix " + std::to_string(static_cast<int>(cidr_suffix)) + " for " + ss.str() + " is too large");
+        }
+        const auto res = range_index.emplace(std::make_tuple(ip.is_ipv6(), ip.network(cidr_suffix), cidr_suffix), ranges.size());
+        if (res.second) {
+            ranges.push_back(Range{ip, cidr_suffix, T{}});
+            built = false;
+        }
+        return {!res.second, ranges[res.first->second].value};
+    }
+
+    typename std::vector<Range>::const_iterator begin() const { return std::begin(ranges); }
+    typename std::vector<Range>::const_iterator end() const { return std::end(ranges); }
+
+    // prefixes of all ranges of one address family with their index into ranges + 1 as value
+    std::vector<Poptrie::Prefix> prefixes(bool ipv6) const {
+        std::vector<Poptrie::Prefix> res;
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+            const auto& range = ranges[i];
+            if (range.ip.is_ipv6() == ipv6) {
+                res.push_back(Poptrie::Prefix{Poptrie::key(range.ip.network(range.cidr_suffix), ipv6), range.cidr_suffix, static_cast<std::uint32_t>(i + 1)});
+            }
+        }
+        return res;
+    }
+
+    void build() {
+        trie.clear();
+        for (const bool ipv6 : {false, true}) {
+            trie.build(ipv6, prefixes(ipv6), [](std::uint32_t, const Poptrie::Prefix& p) { return p.value; }, [](std::uint32_t state) { return state; });
+        }
+        built = true;
+    }
+
+    // most specific range containing ip as (ip as inserted, prefix length) and its value, nullptr if there is none
+    std::pair<std::pair<IPvX, unsigned char>, const T*> find_range_for(IPvX ip) const {
+        if (!built) {
+            throw std::runtime_error("IPRangeTable needs to be built before lookups");
+        }
+        const auto entry = trie.lookup(ip);
+        if (entry == 0) {
+            return {{ip, 0}, nullptr};
+        }
+        const auto& range = ranges[entry - 1];
+        return {{range.ip, range.cidr_suffix}, &range.value};
+    }
+};
+
+}  // namespace regban
+
+#endif
@@ -7,88 +7,207 @@
 #include <cstring>
 #include <iterator>
 #include <memory>
-#include <sstream>
-#include <stdexcept>
+#include <numeric>
 #include <vector>
 
+#include "BTreeBucket.h"
+#include "CompactBucket.h"
 #include "IPvX.h"
 
 namespace regban {
 
 template<typename T>
+struct IPTableElement {
+    using value_type = T;
+    IPvX ip = 0;
+    T value;
+};
+
+// bucket keeping its elements in a sorted vector, inserting and removing is linear in the bucket size
+template<typename Element>
+class SortedVectorBucket {
+  private:
+    std::vector<Element> elements;
+
+  public:
+    using iterator = typename std::vector<Element>::iterator;
+    using const_iterator = typename std::vector<Element>::const_iterator;
+
+    iterator begin() { return std::begin(elements); }
+    iterator end() { return std::end(elements); }
+    const_iterator begin() const { return std::cbegin(elements); }
+    const_iterator end() const { return std::cend(elements); }
+    std::size_t size() const { return elements.size(); }
+    void clear() { elements.clear(); }
+    void reserve(std::size_t size_p) { elements.reserve(size_p); }
+
+    // get largest element not larger than ip
+    iterator floor(IPvX ip) {
+        const auto res = static_cast<const SortedVectorBucket*>(this)->floor(ip);
+        return begin() + (res - std::cbegin(elements));
+    }
+
+    // get largest element not larger than ip
+    const_iterator floor(IPvX ip) const {
+        std::size_t begin = 0;
+        std::size_t end = elements.size();
+
+        if (begin == end) {
+            return std::cend(elements);
+        }
+
+        if (elements[begin].ip > ip) {
+            return std::cend(elements);
+        }
+
+        while (begin + 1 < end) {
+            const auto res = (begin + end) / 2;
+            if (elements[res].ip <= ip) {
+                begin = res;
+            } else {
+                end = res;
+            }
+        }
+
+        return std::cbegin(elements) + begin;
+    }
+
+    std::pair<bool, Element&> find_or_insert(IPvX ip) {
+        const auto res = floor(ip);
+        if (res != end()) {
+            if (res->ip == ip) {
+                return {true, *res};
+            }
+            return {false, *elements.insert(res + 1, {ip, {}})};
+        }
+        return {false, *elements.insert(begin(), {ip, {}})};
+    }
+
+    // returns false if ip is not in bucket
+    bool remove(IPvX ip) {
+        const auto res = floor(ip);
+        if (res != end() && res->ip == ip) {
+            elements.erase(res);
+            return true;
+        }
+        return false;
+    }
+
+    // merges elements sorted by ip without repetitions (moved from, replacing the values of ips already in the bucket)
+    // from the back after growing exactly once, returns number of new elements
+    std::size_t merge(Element* first, Element* last) {
+        std::size_t added = 0;
+        {
+            auto it = std::cbegin(elements);
+            for (const auto* e = first; e != last; ++e) {
+                it = std::lower_bound(it, std::cend(elements), e->ip, [](const Element& a, IPvX ip) { return a.ip < ip; });
+                if (it == std::cend(elements) || it->ip != e->ip) {
+                    ++added;
+                }
+            }
+        }
+        auto i = elements.size();
+        elements.reserve(i + added);
+        elements.resize(i + added);
+        auto out = elements.size();
+        while (last != first) {
+            if (i > 0 && elements[i - 1].ip > (last - 1)->ip) {
+                elements[--out] = std::move(elements[--i]);
+            } else {
+                if (i > 0 && elements[i - 1].ip == (last - 1)->ip) {
+                    --i;
+                }
+                elements[--out] = std::move(*--last);
+            }
+        }
+        return added;
+    }
+
+    // returns number of removed elements
+    template<typename Predicate>
+    std::size_t erase_if(Predicate&& pred) {
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < elements.size(); ++i) {
+            if (!pred(elements[i].ip, elements[i].value)) {
+                if (i != kept) {
+                    elements[kept] = std::move(elements[i]);
+                }
+                ++kept;
+            }
+        }
+        const auto res = elements.size() - kept;
+        elements.erase(std::begin(elements) + kept, std::end(elements));
+        return res;
+    }
+};
+
+template<typename T, template<typename> class Bucket>
 class IPTable;
 
-template<typename T>
+template<typename T, template<typename> class Bucket>
 class IPTable_iterator {
-    friend class IPTable<T>;
+    friend class IPTable<T, Bucket>;
 
   protected:
+    using bucket_iterator = typename Bucket<IPTableElement<T>>::iterator;
+    IPTable<T, Bucket>& ip_table;
     std::size_t bucket_index;
-    std::size_t pos_in_bucket;
-    IPTable<T>& ip_table;
-    IPTable_iterator(IPTable<T>& ip_table_p, std::size_t bucket_index_p, std::size_t pos_in_bucket_p)
+    bucket_iterator pos_in_bucket;
+    IPTable_iterator(IPTable<T, Bucket>& ip_table_p, std::size_t bucket_index_p, bucket_iterator pos_in_bucket_p)
         : ip_table(ip_table_p), bucket_index(bucket_index_p), pos_in_bucket(pos_in_bucket_p) {}
 
   public:
     void operator++() {
         if (bucket_index < ip_table.buckets.size()) {
             ++pos_in_bucket;
-            if (pos_in_bucket >= ip_table.buckets[bucket_index].size()) {
-                pos_in_bucket = 0;
+            if (pos_in_bucket == std::end(ip_table.buckets[bucket_index])) {
+                pos_in_bucket = bucket_iterator{};
                 ++bucket_index;
                 for (; bucket_index < ip_table.buckets.size(); ++bucket_index) {
                     if (ip_table.buckets[bucket_index].size() > 0) {
+                        pos_in_bucket = std::begin(ip_table.buckets[bucket_index]);
                         break;
                     }
                 }
             }
         }
     }
-    const std::pair<IPvX, T&> operator*() const {
-        const auto& cur = ip_table.buckets[bucket_index][pos_in_bucket];
-        return {cur.ip, cur.value};
-    }
-    std::pair<IPvX, T&> operator*() {
-        auto& cur = ip_table.buckets[bucket_index][pos_in_bucket];
-        return {cur.ip, cur.value};
-    }
+    const std::pair<IPvX, T&> operator*() const { return {pos_in_bucket->ip, pos_in_bucket->value}; }
+    std::pair<IPvX, T&> operator*() { return {pos_in_bucket->ip, pos_in_bucket->value}; }
     bool operator==(const IPTable_iterator& rhs) const { return bucket_index == rhs.bucket_index && pos_in_bucket == rhs.pos_in_bucket; }
     bool operator!=(const IPTable_iterator& rhs) const { return bucket_index != rhs.bucket_index || pos_in_bucket != rhs.pos_in_bucket; }
 };
 
-template<typename T>
+// ips are distributed over buckets by their leading bits, Bucket selects how each bucket is organized
+// (SortedVectorBucket, BTreeBucket for buckets growing large or CompactBucket for less memory per element)
+template<typename T, template<typename> class Bucket = SortedVectorBucket>
 class IPTable {
-    friend class IPTable_iterator<T>;
+    friend class IPTable_iterator<T, Bucket>;
 
   public:
     static constexpr char INDEX_WORD_BIT_SIZE_V4 = 8;
     static constexpr char INDEX_WORD_BIT_SIZE_V6 = 12;
     static constexpr char SKIP_BITS_V6 = 6;
 
-    struct Element {
-        IPvX ip = 0;
-        T value;
-    };
-
-    using iterator = IPTable_iterator<T>;
+    using Element = IPTableElement<T>;
+    using iterator = IPTable_iterator<T, Bucket>;
 
     iterator begin() {
         for (std::size_t i = 0; i < buckets.size(); ++i) {
             if (buckets[i].size() > 0) {
-                return {*this, i, 0};
+                return {*this, i, std::begin(buckets[i])};
             }
         }
-        return {*this, buckets.size(), 0};
+        return end();
     }
-    iterator end() { return {*this, buckets.size(), 0}; }
+    iterator end() { return {*this, buckets.size(), typename Bucket<Element>::iterator{}}; }
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
   public:
 #else
   protected:
 #endif
-    using Bucket = std::vector<Element>;
-    std::array<Bucket, (1 << INDEX_WORD_BIT_SIZE_V4) + (1 << INDEX_WORD_BIT_SIZE_V6)> buckets;
+    std::array<Bucket<Element>, (1 << INDEX_WORD_BIT_SIZE_V4) + (1 << INDEX_WORD_BIT_SIZE_V6)> buckets;
     std::size_t size_m = 0;
 
     static constexpr unsigned int get_bucket_index(IPvX ip) {
@@ -101,55 +220,15 @@ class IPTable {
     }
 
     // get largest element in bucket smaller than ip
-    std::pair<Bucket&, typename Bucket::iterator> lower_bound(IPvX ip) {
+    std::pair<Bucket<Element>&, typename Bucket<Element>::iterator> lower_bound(IPvX ip) {
         auto& bucket = buckets[get_bucket_index(ip)];
-        std::size_t begin = 0;
-        std::size_t end = bucket.size();
-
-        if (begin == end) {
-            return {bucket, std::end(bucket)};
-        }
-
-        if (bucket[begin].ip > ip) {
-            return {bucket, std::end(bucket)};
-        }
-
-        while (begin + 1 < end) {
-            const auto res = (begin + end) / 2;
-            if (bucket[res].ip <= ip) {
-                begin = res;
-            } else {
-                end = res;
-            }
-        }
-
-        return {bucket, std::begin(bucket) + begin};
+        return {bucket, bucket.floor(ip)};
     }
 
     // get largest element in bucket smaller than ip
-    std::pair<const Bucket&, typename Bucket::const_iterator> lower_bound(IPvX ip) const {
+    std::pair<const Bucket<Element>&, typename Bucket<Element>::const_iterator> lower_bound(IPvX ip) const {
         const auto& bucket = buckets[get_bucket_index(ip)];
-        std::size_t begin = 0;
-        std::size_t end = bucket.size();
-
-        if (begin == end) {
-            return {bucket, std::cend(bucket)};
-        }
-
-        if (bucket[begin].ip > ip) {
-            return {bucket, std::cend(bucket)};
-        }
-
-        while (begin + 1 < end) {
-            const auto res = (begin + end) / 2;
-            if (bucket[res].ip <= ip) {
-                begin = res;
-            } else {
-                end = res;
-            }
-        }
-
-        return {bucket, std::cbegin(bucket) + begin};
+        return {bucket, bucket.floor(ip)};
     }
 
   public:
@@ -161,7 +240,7 @@ class IPTable {
     void clear_and_reserve(std::size_t size_p) {
         size_m = 0;
         const auto bucket_size = (size_p + buckets.size() - 1) / buckets.size();
-        for (int i = 0; i < buckets.size(); ++i) {
+        for (std::size_t i = 0; i < buckets.size(); ++i) {
             buckets[i].clear();
             buckets[i].reserve(bucket_size);
         }
@@ -183,74 +262,84 @@ class IPTable {
     }
 
     std::pair<bool, T&> find_or_insert(IPvX ip) {
-        auto res = lower_bound(ip);
-        if (res.second != std::end(res.first)) {
-            if (res.second->ip == ip) {
-                return {true, res.second->value};
-            }
+        auto res = buckets[get_bucket_index(ip)].find_or_insert(ip);
+        if (!res.first) {
             ++size_m;
-            return {false, res.first.insert(res.second + 1, {ip, T{}})->value};
         }
-        ++size_m;
-        return {false, res.first.insert(std::begin(res.first), {ip, T{}})->value};
+        return {res.first, res.second.value};
     }
 
     void remove(IPvX ip) {
-        auto res = lower_bound(ip);
-        if (res.second != std::end(res.first) && res.second->ip == ip) {
-            res.first.erase(res.second);
+        if (buckets[get_bucket_index(ip)].remove(ip)) {
             --size_m;
         }
     }
-};
-
-template<typename T>
-struct IPRangeValue {
-    unsigned char cidr_suffix;
-    T value;
-};
 
-template<typename T>
-class IPRangeTable : public IPTable<IPRangeValue<T>> {
-  public:
-    using IPTable<IPRangeValue<T>>::find_or_insert;
-
-    std::pair<bool, T&> find_or_insert(IPvX ip, unsigned char cidr_suffix) {
-        auto res = find_or_insert(ip);
-        if (!res.first) {
-            // was actually inserted
-            if ((ip.is_ipv6() && cidr_suffix < IPTable<IPRangeValue<T>>::SKIP_BITS_V6 + IPTable<IPRangeValue<T>>::INDEX_WORD_BIT_SIZE_V6)
-                || (!ip.is_ipv6() && cidr_suffix < IPTable<IPRangeValue<T>>::INDEX_WORD_BIT_SIZE_V4)) {
-                std::ostringstream ss;
-                ss << ip;
-                throw std::runtime_error("CIDR suffix " + std::to_string(static_cast<int>(cidr_suffix)) + " for " + ss.str() + " is too small for indexing");
+    // inserts all elements of range (the last one for ips repeated in it, replacing values of ips already in the table)
+    // by partitioning them by bucket, sorting each partition and merging it into its bucket in a single pass, so in
+    // O(N log N) rather than in O(N^2) for unsorted ips falling into a few buckets, returns number of new elements
+    template<typename Range>
+    std::size_t insert_batch(const Range& range) {
+        std::vector<std::size_t> offsets(buckets.size() + 1, 0);
+        for (const auto& e : range) {
+            ++offsets[get_bucket_index(e.ip) + 1];
+        }
+        std::partial_sum(std::begin(offsets), std::end(offsets), std::begin(offsets));
+        std::vector<Element> partitioned(offsets.back());
+        {
+            auto next = offsets;
+            for (const auto& e : range) {
+                partitioned[next[get_bucket_index(e.ip)]++] = Element{e.ip, e.value};
             }
-            res.second.cidr_suffix = cidr_suffix;
         }
-        return {res.first, res.second.value};
-    }
-
-    std::pair<std::pair<IPvX, char>, const T*> find_range_for(IPvX ip) const {
-        auto res = this->lower_bound(ip);
-        if (res.second != std::end(res.first)) {
-            char shift;
-            if (ip.is_ipv6()) {
-                shift = IPvX::TOTAL_BIT_SIZE_V6 - res.second->value.cidr_suffix;
-            } else {
-                shift = IPvX::TOTAL_BIT_SIZE_V4 - res.second->value.cidr_suffix;
+        std::size_t res = 0;
+        for (std::size_t i = 0; i < buckets.size(); ++i) {
+            if (offsets[i] == offsets[i + 1]) {
+                continue;
             }
-            if ((ip >> shift) == (res.second->ip >> shift)) {
-                return {{res.second->ip, res.second->value.cidr_suffix}, &res.second->value.value};
+            auto* first = &partitioned[offsets[i]];
+            auto* last = first + (offsets[i + 1] - offsets[i]);
+            std::stable_sort(first, last, [](const Element& a, const Element& b) { return a.ip < b.ip; });
+            auto* unique_last = first;
+            for (auto* e = first; e != last; ++e) {
+                if (e + 1 != last && (e + 1)->ip == e->ip) {
+                    continue;
+                }
+                if (unique_last != e) {
+                    *unique_last = std::move(*e);
+                }
+                ++unique_last;
             }
+            res += buckets[i].merge(first, unique_last);
         }
-        return {{ip, 0}, nullptr};
+        size_m += res;
+        return res;
+    }
+
+    // replaces all elements by those of range, see insert_batch
+    template<typename Range>
+    void bulk_load(const Range& range) {
+        clear();
+        insert_batch(range);
+    }
+
+    // removes all elements for which pred(ip, value) returns true in a single pass (pred may also modify value),
+    // returns number of removed elements
+    template<typename Predicate>
+    std::size_t erase_if(Predicate&& pred) {
+        std::size_t res = 0;
+        for (auto& bucket : buckets) {
+            res += bucket.erase_if(pred);
+        }
+        size_m -= res;
+        return res;
     }
 };
 
 }  // namespace regban
 
-template<typename T>
-struct std::iterator_traits<typename regban::IPTable_iterator<T>> {
+template<typename T, template<typename> class Bucket>
+struct std::iterator_traits<typename regban::IPTable_iterator<T, Bucket>> {
     using value_type = std::pair<regban::IPvX, T>;
     using difference_type = void;
     using pointer = void;
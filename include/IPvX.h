@@ -1,114 +1,397 @@
 #ifndef IPVX_H
 #define IPVX_H
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
-#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace regban {
 
 class IPvX {
   public:
-    using Internal = std::uint64_t;
+    // IPv4 addresses in the lower 32 bits, IPv6 addresses in all 128 bits (IPv4-mapped ones are parsed as IPv4
+    // addresses, the other ones in the reserved ::/32 are not accepted, so IPv6 addresses and their networks of at
+    // least MIN_PREFIX_LENGTH_V6 bits are never taken for IPv4 addresses)
+    __extension__ using Internal = unsigned __int128;
     using IPv4 = std::uint32_t;
-    static constexpr char TOTAL_BIT_SIZE_V4 = 32;
-    static constexpr char TOTAL_BIT_SIZE_V6 = 64;
-    static constexpr Internal IPv6_MASK = ((1UL << TOTAL_BIT_SIZE_V4) - 1) << TOTAL_BIT_SIZE_V4;
+    static constexpr unsigned char TOTAL_BIT_SIZE_V4 = 32;
+    static constexpr unsigned char TOTAL_BIT_SIZE_V6 = 128;
+    static constexpr unsigned char MIN_PREFIX_LENGTH_V6 = 32;
+    static constexpr Internal IPv6_MASK = ~((static_cast<Internal>(1) << TOTAL_BIT_SIZE_V4) - 1);
     class Formatter;
 
   private:
     Internal v;
 
+    // SWAR helpers working on 8 characters at once (character i in byte i)
+    static constexpr std::uint64_t ONES = 0x0101010101010101UL;
+    static constexpr std::uint64_t HIGH_BITS = 0x8080808080808080UL;
+
+    static std::uint64_t load64(const char* c) {
+        std::uint64_t res;
+        std::memcpy(&res, c, sizeof(res));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        res = __builtin_bswap64(res);
+#endif
+        return res;
+    }
+
+    static std::uint32_t load32(const char* c) {
+        std::uint32_t res;
+        std::memcpy(&res, c, sizeof(res));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        res = __builtin_bswap32(res);
+#endif
+        return res;
+    }
+
+    // high bit set in each byte that is zero
+    static std::uint64_t zero_bytes(std::uint64_t x) { return ~(((x & ~HIGH_BITS) + ~HIGH_BITS) | x | ~HIGH_BITS); }
+
+    static std::uint64_t equal_bytes(std::uint64_t w, char c) { return zero_bytes(w ^ (ONES * static_cast<unsigned char>(c))); }
+
+    static std::uint64_t digit_bytes(std::uint64_t w) {
+        const auto high_nibble_ok = zero_bytes((w & (ONES * 0xf0)) ^ (ONES * 0x30));
+        const auto low_nibble_ok = ~((((w & (ONES * 0x0f)) + ONES * 0x06) << 3) & HIGH_BITS);
+        return high_nibble_ok & low_nibble_ok;
+    }
+
+    static std::uint64_t hex_letter_bytes(std::uint64_t w) {
+        const auto lower = w | (ONES * 0x20);
+        const auto low_bits = lower & (ONES * 0x07);
+        return zero_bytes((lower & (ONES * 0xf8)) ^ (ONES * 0x60)) & ~zero_bytes(low_bits) & ~equal_bytes(low_bits, 0x07);
+    }
+
+    // one bit per byte with high bit set
+    static unsigned int byte_mask(std::uint64_t m) { return ((m >> 7) * 0x0102040810204080UL) >> 56; }
+
+    struct CharClasses {
+        unsigned int dots;
+        unsigned int colons;
+        unsigned int digits;
+        unsigned int hex_letters;
+    };
+
+    // one bit per character of the 16 characters in lo and hi
+    static CharClasses classify(std::uint64_t lo, std::uint64_t hi) {
+#ifdef __SSE2__
+        const auto v = _mm_set_epi64x(hi, lo);
+        const auto lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        return {
+            static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')))),
+            static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')))),
+            static_cast<unsigned int>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))))),
+            static_cast<unsigned int>(
+                _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1))))),
+        };
+#else
+        return {
+            byte_mask(equal_bytes(lo, '.')) | byte_mask(equal_bytes(hi, '.')) << 8,
+            byte_mask(equal_bytes(lo, ':')) | byte_mask(equal_bytes(hi, ':')) << 8,
+            byte_mask(digit_bytes(lo)) | byte_mask(digit_bytes(hi)) << 8,
+            byte_mask(hex_letter_bytes(lo)) | byte_mask(hex_letter_bytes(hi)) << 8,
+        };
+#endif
+    }
+
+    // converts up to 3 decimal digits given in the lower bytes of w
+    static unsigned int decimal(std::uint32_t digits, std::size_t length) {
+        // right-align digits in bytes 0..2, then multiply-add all three at once in 16-bit lanes
+        const std::uint64_t w = ((digits << (8 * (4 - length))) >> 8) & (ONES * 0x0f);
+        const auto lanes = (w & 0xff) | ((w & 0xff00) << 8) | ((w & 0xff0000) << 16);
+        return ((lanes * ((100UL << 32) | (10UL << 16) | 1)) >> 32) & 0xffff;
+    }
+
+    // converts up to 4 hex digits, c needs to be readable for 4 bytes
+    static unsigned int hexadecimal(const char* c, std::size_t length) {
+        const auto w = load32(c) << (8 * (4 - length));  // right-align, missing digits are 0
+        const auto nibbles = (w & 0x0f0f0f0f) + 9 * ((w >> 6) & 0x01010101);
+        const auto pairs = ((nibbles & 0x000f000f) << 4) | ((nibbles & 0x0f000f00) >> 8);
+        return ((pairs & 0xff) << 8) | ((pairs >> 16) & 0xff);
+    }
+
+    // returns false if invalid
+    static bool parse_v4_octets(const char* c, std::size_t length, std::uint32_t& res) {
+        if (length < 7 || length > 15) {
+            return false;
+        }
+        // load characters without reading beyond length
+        std::uint64_t lo;
+        std::uint64_t hi = 0;
+        if (length >= 8) {
+            lo = load64(c);
+            if (length > 8) {
+                hi = load64(c + length - 8) >> (8 * (16 - length));
+            }
+        } else {
+            char buf[8] = {};
+            std::memcpy(buf, c, length);
+            lo = load64(buf);
+        }
+        const auto chars = static_cast<Internal>(hi) << 64 | lo;
+        const auto classes = classify(lo, hi);
+        const auto dots = classes.dots;
+        const auto digits = classes.digits;
+        const unsigned int used = (1U << length) - 1;
+        if (((dots | digits) & used) != used) {
+            return false;
+        }
+        // exactly three dots
+        unsigned int rest = dots;
+        std::array<unsigned int, 3> dot;
+        for (auto& d : dot) {
+            if (rest == 0) {
+                return false;
+            }
+            d = __builtin_ctz(rest);
+            rest &= rest - 1;
+        }
+        if (rest != 0) {
+            return false;
+        }
+        // octets are converted independently of each other
+        const std::array<unsigned int, 4> starts = {0, dot[0] + 1, dot[1] + 1, dot[2] + 1};
+        const std::array<unsigned int, 4> lengths = {dot[0], dot[1] - dot[0] - 1, dot[2] - dot[1] - 1, static_cast<unsigned int>(length) - dot[2] - 1};
+        if ((lengths[0] - 1 > 2) | (lengths[1] - 1 > 2) | (lengths[2] - 1 > 2) | (lengths[3] - 1 > 2)) {
+            return false;  // empty or more than three digits
+        }
+        bool valid = true;
+        res = 0;
+        for (int i = 0; i < 4; ++i) {
+            const auto digits = static_cast<std::uint32_t>(chars >> (8 * starts[i]));
+            const auto octet = decimal(digits, lengths[i]);
+            valid &= octet <= 255 && (lengths[i] == 1 || (digits & 0xff) != '0');  // no leading zeros
+            res = (res << 8) | octet;
+        }
+        return valid;
+    }
+
+    static IPvX parse_v4(const char* c, std::size_t length) {
+        std::uint32_t res;
+        if (!parse_v4_octets(c, length, res)) {
+            return 0;
+        }
+        return res;
+    }
+
+    static IPvX parse_v6(const char* c, std::size_t length) {
+        constexpr std::size_t MAX_LENGTH = 45;  // with embedded IPv4
+        if (length < 2 || length > MAX_LENGTH) {
+            return 0;
+        }
+        char buf[52] = {};
+        std::memcpy(buf, c, length);
+        std::uint64_t colons = 0;
+        std::uint64_t hex = 0;
+        std::uint64_t dots = 0;
+        for (std::size_t i = 0; i < length; i += 16) {
+            const auto classes = classify(load64(buf + i), load64(buf + i + 8));
+            colons |= static_cast<std::uint64_t>(classes.colons) << i;
+            hex |= static_cast<std::uint64_t>(classes.digits | classes.hex_letters) << i;
+            dots |= static_cast<std::uint64_t>(classes.dots) << i;
+        }
+        const std::uint64_t used = (1UL << length) - 1;
+
+        std::array<std::uint16_t, 8> groups{};
+        std::size_t groups_end = length;  // end of hex groups
+        std::size_t count = 0;            // number of groups
+        if (dots != 0) {
+            // embedded IPv4 after last colon
+            groups_end = 64 - __builtin_clzl(colons);
+            if ((dots & ((1UL << groups_end) - 1)) != 0) {
+                return 0;
+            }
+            std::uint32_t v4;
+            if (!parse_v4_octets(buf + groups_end, length - groups_end, v4)) {
+                return 0;
+            }
+            groups[6] = v4 >> 16;
+            groups[7] = v4 & 0xffff;
+            count = 2;
+        }
+        const std::uint64_t groups_used = (1UL << groups_end) - 1;
+        if (((colons | hex) & groups_used) != groups_used) {
+            return 0;
+        }
+
+        std::array<std::uint16_t, 8> parsed;
+        std::size_t n = 0;
+        int gap = -1;  // position of "::"
+        std::size_t pos = 0;
+        if (buf[0] == ':') {
+            if (buf[1] != ':') {
+                return 0;
+            }
+            gap = 0;
+            pos = 2;
+        }
+        while (pos < groups_end) {
+            const auto rest = (colons & used) >> pos;
+            const std::size_t next = rest == 0 ? length : pos + __builtin_ctzl(rest);
+            const auto end = std::min(next, groups_end);
+            if (end == pos) {  // second colon of "::"
+                if (gap >= 0) {
+                    return 0;
+                }
+                gap = n;
+                ++pos;
+                continue;
+            }
+            if (end - pos > 4 || n == 8) {
+                return 0;
+            }
+            parsed[n++] = hexadecimal(buf + pos, end - pos);
+            pos = end;
+            if (pos == groups_end) {
+                if (count > 0) {
+                    return 0;  // no colon before embedded IPv4
+                }
+                break;
+            }
+            ++pos;  // colon
+            if (pos == groups_end && count == 0) {
+                return 0;  // trailing single colon
+            }
+        }
+        count += n;
+        if (gap < 0 ? count != 8 : count > 7) {
+            return 0;
+        }
+        if (gap < 0) {
+            gap = n;
+        }
+        // groups after "::" end where the embedded IPv4 (if any) starts
+        const auto tail_end = 8 - (count - n);
+        std::copy(std::begin(parsed), std::begin(parsed) + gap, std::begin(groups));
+        std::copy(std::begin(parsed) + gap, std::begin(parsed) + n, std::begin(groups) + tail_end - (n - gap));
+        Internal res = 0;
+        for (const auto group : groups) {
+            res = (res << 16) | group;
+        }
+        if ((res >> TOTAL_BIT_SIZE_V4) == 0xffff) {
+            return static_cast<IPv4>(res);  // IPv4-mapped
+        }
+        if ((res >> (TOTAL_BIT_SIZE_V6 - MIN_PREFIX_LENGTH_V6)) == 0) {
+            return 0;  // e.g. ::1 or IPv4-compatible
+        }
+        return res;
+    }
+
   public:
     constexpr IPvX() : v(0) {}
     constexpr IPvX(Internal value) : v(value) {}
-    constexpr bool is_ipv6() const { return v & IPv6_MASK; }
+    constexpr bool is_ipv6() const { return (v & IPv6_MASK) != 0; }
     constexpr operator Internal() const { return v; }
+    constexpr unsigned char total_bit_size() const { return is_ipv6() ? TOTAL_BIT_SIZE_V6 : TOTAL_BIT_SIZE_V4; }
+
+    // first address of the network with given prefix length containing this address (an IPv6 network needs at least
+    // MIN_PREFIX_LENGTH_V6 bits to stay IPv6)
+    constexpr IPvX network(unsigned char prefix_length) const {
+        const auto host_bits = total_bit_size() - prefix_length;
+        return host_bits == 0 ? v : host_bits == TOTAL_BIT_SIZE_V6 ? 0 : (v >> host_bits) << host_bits;
+    }
+
+    // first address after the network with given prefix length containing this address (wraps around to 0 for ::/0)
+    constexpr IPvX network_end(unsigned char prefix_length) const {
+        const auto host_bits = total_bit_size() - prefix_length;
+        return network(prefix_length).v + (host_bits == TOTAL_BIT_SIZE_V6 ? 0 : static_cast<Internal>(1) << host_bits);
+    }
+
+    // last address of the network with given prefix length containing this address
+    constexpr IPvX network_last(unsigned char prefix_length) const {
+        const auto host_bits = total_bit_size() - prefix_length;
+        return network(prefix_length).v | (host_bits == TOTAL_BIT_SIZE_V6 ? ~static_cast<Internal>(0) : (static_cast<Internal>(1) << host_bits) - 1);
+    }
 
     std::array<unsigned char, 4> byte_representation_v4() const {
         return {static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16), static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)};
     }
 
     std::array<unsigned char, 16> byte_representation_v6() const {
-        return {static_cast<unsigned char>(v >> 56),
-                static_cast<unsigned char>(v >> 48),
-                static_cast<unsigned char>(v >> 40),
-                static_cast<unsigned char>(v >> 32),
-                static_cast<unsigned char>(v >> 24),
-                static_cast<unsigned char>(v >> 16),
-                static_cast<unsigned char>(v >> 8),
-                static_cast<unsigned char>(v),
-                0,
-                0,
-                0,
-                0,
-                0,
-                0,
-                0,
-                0};
+        std::array<unsigned char, 16> res;
+        for (int i = 0; i < 16; ++i) {
+            res[i] = static_cast<unsigned char>(v >> (8 * (15 - i)));
+        }
+        return res;
     }
 
     template<typename Char>
     friend std::basic_ostream<Char>& operator<<(std::basic_ostream<Char>& os, const IPvX& ip) {
         if (ip.is_ipv6()) {
+            std::array<unsigned int, 8> groups;
+            for (int i = 0; i < 8; ++i) {
+                groups[i] = static_cast<unsigned int>(ip.v >> (16 * (7 - i))) & 0xffff;
+            }
+            // compress first longest run of at least two zero groups (RFC 5952)
+            int gap_begin = 8;
+            int gap_end = 8;
+            for (int i = 0; i < 8;) {
+                int j = i;
+                while (j < 8 && groups[j] == 0) {
+                    ++j;
+                }
+                if (j - i >= 2 && j - i > gap_end - gap_begin) {
+                    gap_begin = i;
+                    gap_end = j;
+                }
+                i = j == i ? i + 1 : j;
+            }
             os << std::hex;
-            os << ((ip.v >> 48) & 0xffff);
-            if ((ip.v & ((1UL << 48) - 1)) != 0) {
-                os << ':' << ((ip.v >> 32) & 0xffff);
-                if ((ip.v & ((1UL << 32) - 1)) != 0) {
-                    os << ':' << ((ip.v >> 16) & 0xffff);
-                    if ((ip.v & ((1UL << 16) - 1)) != 0) {
-                        os << ':' << (ip.v & 0xffff);
+            for (int i = 0; i < 8; ++i) {
+                if (i == gap_begin) {
+                    os << ':';
+                    if (gap_begin == 0) {
+                        os << ':';
                     }
+                    i = gap_end - 1;
+                    continue;
+                }
+                os << groups[i];
+                if (i < 7) {
+                    os << ':';
                 }
             }
-            os << ':' << ':' << std::dec;
+            os << std::dec;
         } else {
-            os << ((ip.v >> 24) & 0xff) << '.';
-            os << ((ip.v >> 16) & 0xff) << '.';
-            os << ((ip.v >> 8) & 0xff) << '.';
-            os << (ip.v & 0xff);
+            os << static_cast<unsigned int>((ip.v >> 24) & 0xff) << '.';
+            os << static_cast<unsigned int>((ip.v >> 16) & 0xff) << '.';
+            os << static_cast<unsigned int>((ip.v >> 8) & 0xff) << '.';
+            os << static_cast<unsigned int>(ip.v & 0xff);
         }
         return os;
     }
 
-    static IPvX parse(const char* c) {
-        Internal res = 0;
-        const auto* pos = c;
-        char* end;
-        auto last = *pos;
-        if (std::strchr(pos, ':') != nullptr) {
-            // should be an IPv6
-            int i;
-            for (i = 0; i < 4; ++i) {  // only parse first half
-                const auto v = std::strtoul(pos, &end, 16);
-                if (v > 0xffff) {
-                    return 0;
-                }
-                if (last == ':') {
-                    break;
-                }
-                if (*end != ':') {
-                    return 0;
-                }
-                res = (res << 16) | v;
-                last = *pos;
-                pos = end + 1;
+    // strict parser for [c, c + length), returns 0 if invalid
+    static IPvX parse(const char* c, std::size_t length) {
+        // a separator has to follow within the first group/octet
+        for (std::size_t i = 0; i < length && i < 5; ++i) {
+            if (c[i] == ':') {
+                return parse_v6(c, length);
             }
-            if (!(*pos == ':' || *pos == '\0' || (*pos >= 'a' && *pos <= 'f') || (*pos >= '0' && *pos <= '9'))) {
-                return 0;
+            if (c[i] == '.') {
+                return parse_v4(c, length);
             }
-            return res << ((4 - i) * 16);
         }
-        // should be an IPv4
-        for (int i = 0; i < 4; ++i) {
-            const auto v = std::strtoul(pos, &end, 10);
-            if (v > 255 || (i < 3 && *end != '.') || (i == 3 && *end == '.')) {
-                return 0;
+        return 0;
+    }
+
+    static IPvX parse(const char* c) { return parse(c, std::strlen(c)); }
+
+    // parses each (begin, length) pair in [first, last) into out (0 if invalid), returns number of valid addresses
+    template<typename InputIt, typename OutputIt>
+    static std::size_t parse_many(InputIt first, InputIt last, OutputIt out) {
+        std::size_t res = 0;
+        for (; first != last; ++first, ++out) {
+            *out = parse(first->first, first->second);
+            if (*out != 0) {
+                ++res;
             }
-            res = (res << 8) | v;
-            pos = end + 1;
         }
         return res;
     }
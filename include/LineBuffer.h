@@ -0,0 +1,157 @@
+#ifndef LINEBUFFER_H
+#define LINEBUFFER_H
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace regban {
+
+class LineBuffer {
+  public:
+    enum class OverlongPolicy { TRUNCATE, SKIP };
+    static constexpr std::size_t DEFAULT_MAX_LINE_LENGTH = 4096;
+    static constexpr std::size_t READ_SIZE = 1 << 16;
+
+    struct ReadResult {
+        std::size_t bytes;
+        bool eof;
+    };
+
+  private:
+    std::vector<char> data;
+    std::size_t begin_pos = 0;    // start of first incomplete line
+    std::size_t scanned_pos = 0;  // no newline in [begin_pos, scanned_pos)
+    std::size_t end_pos = 0;
+    std::size_t max_line_length;
+    OverlongPolicy policy;
+    bool discarding = false;  // within the remainder of an overlong line
+    std::size_t truncated_count = 0;
+    std::size_t skipped_count = 0;
+
+    template<typename Callback>
+    void handle_overlong(const char* begin, Callback&& callback) {
+        if (policy == OverlongPolicy::TRUNCATE) {
+            ++truncated_count;
+            callback(begin, begin + max_line_length);
+        } else {
+            ++skipped_count;
+        }
+    }
+
+  public:
+    explicit LineBuffer(std::size_t max_line_length_p = DEFAULT_MAX_LINE_LENGTH, OverlongPolicy policy_p = OverlongPolicy::SKIP)
+        : max_line_length(max_line_length_p), policy(policy_p) {
+        if (max_line_length == 0) {
+            throw std::runtime_error("Maximum line length must be positive");
+        }
+    }
+
+    static OverlongPolicy parse_policy(const std::string& name) {
+        if (name == "truncate") {
+            return OverlongPolicy::TRUNCATE;
+        }
+        if (name == "skip") {
+            return OverlongPolicy::SKIP;
+        }
+        throw std::runtime_error("Unknown overlong line policy '" + name + "', use truncate or skip");
+    }
+
+    std::size_t truncated_lines() const { return truncated_count; }
+    std::size_t skipped_lines() const { return skipped_count; }
+    std::size_t pending() const { return end_pos - begin_pos; }
+
+    // drop an incomplete line, e.g. when the data continues with another file
+    void reset() {
+        begin_pos = scanned_pos = end_pos = 0;
+        discarding = false;
+    }
+
+    // get at least min_size bytes of writable space after the pending data
+    char* prepare(std::size_t min_size) {
+        if (data.size() - end_pos < min_size) {
+            if (begin_pos > 0) {
+                std::memmove(&data[0], &data[begin_pos], end_pos - begin_pos);
+                end_pos -= begin_pos;
+                scanned_pos -= begin_pos;
+                begin_pos = 0;
+            }
+            if (data.size() - end_pos < min_size) {
+                data.resize(end_pos + min_size);
+            }
+        }
+        return &data[end_pos];
+    }
+
+    std::size_t writable() const { return data.size() - end_pos; }
+
+    // make n bytes written to prepare()'d space available and pass complete lines (without line ending) to callback(begin, end)
+    template<typename Callback>
+    void commit(std::size_t n, Callback&& callback) {
+        end_pos += n;
+        const char* const base = data.data();
+        while (scanned_pos < end_pos) {
+            const auto* newline = static_cast<const char*>(std::memchr(base + scanned_pos, '\n', end_pos - scanned_pos));
+            if (newline == nullptr) {
+                scanned_pos = end_pos;
+                break;
+            }
+            const char* begin = base + begin_pos;
+            const char* end = newline;
+            if (end > begin && *(end - 1) == '\r') {
+                --end;
+            }
+            if (discarding) {
+                discarding = false;
+            } else if (static_cast<std::size_t>(end - begin) > max_line_length) {
+                handle_overlong(begin, callback);
+            } else {
+                callback(begin, end);
+            }
+            begin_pos = scanned_pos = newline - base + 1;
+        }
+        if (end_pos - begin_pos > max_line_length) {
+            if (!discarding) {
+                handle_overlong(base + begin_pos, callback);
+                discarding = true;
+            }
+            begin_pos = scanned_pos = end_pos;
+        }
+        if (begin_pos == end_pos) {
+            begin_pos = scanned_pos = end_pos = 0;
+        }
+    }
+
+    // read from non-blocking fd until it would block or reaches end of file
+    template<typename Callback>
+    ReadResult read_from(int fd, Callback&& callback) {
+        ReadResult res{0, false};
+        while (true) {
+            auto* buf = prepare(READ_SIZE);
+            const auto nread = read(fd, buf, writable());
+            if (nread < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return res;
+                }
+                throw std::runtime_error(std::string("Could not read: ") + std::strerror(errno));
+            }
+            if (nread == 0) {
+                res.eof = true;
+                return res;
+            }
+            res.bytes += nread;
+            commit(nread, callback);
+        }
+    }
+};
+
+}  // namespace regban
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef LOGFILE_H
+#define LOGFILE_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "LineBuffer.h"
+#include "spdlog/spdlog.h"
+
+namespace regban {
+
+// follows a log file like `tail -F`, but reads it directly and is woken up by inotify
+class LogFile {
+  public:
+    static constexpr std::size_t READ_SIZE = 1 << 18;
+
+  private:
+    std::string filename;
+    std::string basename;
+    int fd = -1;
+    int inotify_fd = -1;
+    int file_watch = -1;
+    int dir_watch = -1;
+    ino_t inode = 0;
+    off_t offset = 0;
+    std::shared_ptr<spdlog::logger> logger;
+
+    void close_file() {
+        if (file_watch >= 0) {
+            inotify_rm_watch(inotify_fd, file_watch);
+            file_watch = -1;
+        }
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // returns false if file does not exist (yet)
+    bool open_file(bool at_end) {
+        fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                return false;
+            }
+            throw std::runtime_error("Could not open '" + filename + "': " + std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            throw std::runtime_error("Could not stat '" + filename + "': " + std::strerror(errno));
+        }
+        inode = st.st_ino;
+        offset = at_end ? st.st_size : 0;
+        file_watch = inotify_add_watch(inotify_fd, filename.c_str(), IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+        if (file_watch < 0) {
+            throw std::runtime_error("Could not watch '" + filename + "': " + std::strerror(errno));
+        }
+        return true;
+    }
+
+    template<typename Callback>
+    std::size_t read_available(LineBuffer& buffer, Callback&& callback) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            throw std::runtime_error("Could not stat '" + filename + "': " + std::strerror(errno));
+        }
+        if (st.st_size < offset) {
+            logger->info("'{}' has been truncated", filename);
+            offset = 0;
+            buffer.reset();
+        }
+        std::size_t res = 0;
+        while (true) {
+            auto* buf = buffer.prepare(READ_SIZE);
+            const auto nread = pread(fd, buf, buffer.writable(), offset);
+            if (nread < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Could not read '" + filename + "': " + std::strerror(errno));
+            }
+            if (nread == 0) {
+                return res;
+            }
+            offset += nread;
+            res += nread;
+            buffer.commit(nread, callback);
+        }
+    }
+
+  public:
+    explicit LogFile(std::string filename_p) : filename(std::move(filename_p)) {
+        logger = spdlog::default_logger()->clone("LogFile");
+        const auto slash = filename.rfind('/');
+        const auto directory = slash == std::string::npos ? std::string(".") : filename.substr(0, slash == 0 ? 1 : slash);
+        basename = slash == std::string::npos ? filename : filename.substr(slash + 1);
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            throw std::runtime_error(std::string("Could not initialize inotify: ") + std::strerror(errno));
+        }
+        dir_watch = inotify_add_watch(inotify_fd, directory.c_str(), IN_CREATE | IN_MOVED_TO);
+        if (dir_watch < 0) {
+            throw std::runtime_error("Could not watch directory '" + directory + "': " + std::strerror(errno));
+        }
+        if (!open_file(true)) {
+            logger->warn("'{}' does not exist (yet)", filename);
+        }
+    }
+    LogFile(const LogFile&) = delete;
+    LogFile& operator=(const LogFile&) = delete;
+    LogFile(LogFile&& other) noexcept
+        : filename(std::move(other.filename)),
+          basename(std::move(other.basename)),
+          fd(other.fd),
+          inotify_fd(other.inotify_fd),
+          file_watch(other.file_watch),
+          dir_watch(other.dir_watch),
+          inode(other.inode),
+          offset(other.offset),
+          logger(std::move(other.logger)) {
+        other.fd = -1;
+        other.inotify_fd = -1;
+        other.file_watch = -1;
+    }
+    LogFile& operator=(LogFile&&) = delete;
+
+    ~LogFile() {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (inotify_fd >= 0) {
+            close(inotify_fd);
+        }
+    }
+
+    const std::string& name() const { return filename; }
+    int watch_fd() const { return inotify_fd; }
+
+    // inode and offset of the data read so far (inode is 0 if the file is not open)
+    std::pair<ino_t, off_t> position() const { return {fd >= 0 ? inode : 0, offset}; }
+
+    // continue after a position saved in an earlier run, data written since is read with the next check()
+    void resume(ino_t saved_inode, off_t saved_offset) {
+        if (fd < 0) {
+            return;
+        }
+        if (saved_inode != inode) {
+            logger->info("'{}' has been rotated since last run, reading from start", filename);
+            offset = 0;
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            throw std::runtime_error("Could not stat '" + filename + "': " + std::strerror(errno));
+        }
+        if (st.st_size < saved_offset) {
+            logger->info("'{}' has been truncated since last run, reading from start", filename);
+            offset = 0;
+            return;
+        }
+        logger->info("Resuming '{}' at offset {} ({} bytes to catch up on)", filename, saved_offset, st.st_size - saved_offset);
+        offset = saved_offset;
+    }
+
+    // to be called when watch_fd() is readable, passes new complete lines to callback(begin, end)
+    template<typename Callback>
+    std::size_t check(LineBuffer& buffer, Callback&& callback) {
+        bool check_path = fd < 0;
+        alignas(inotify_event) char events[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+        while (true) {
+            const auto n = read(inotify_fd, events, sizeof(events));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                throw std::runtime_error(std::string("Could not read inotify events: ") + std::strerror(errno));
+            }
+            for (const char* p = events; p < events + n;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(p);
+                if (event->wd == dir_watch) {
+                    if (event->len > 0 && basename == event->name) {
+                        check_path = true;
+                    }
+                } else if (event->wd == file_watch && (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0) {
+                    check_path = true;
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        std::size_t res = 0;
+        if (fd >= 0) {
+            res += read_available(buffer, callback);
+        }
+        if (check_path) {
+            struct stat st;
+            if (stat(filename.c_str(), &st) == 0 && (fd < 0 || st.st_ino != inode)) {
+                if (fd >= 0) {
+                    logger->info("'{}' has been rotated", filename);
+                    close_file();
+                }
+                buffer.reset();
+                if (open_file(false)) {
+                    res += read_available(buffer, callback);
+                }
+            }
+        }
+        return res;
+    }
+};
+
+}  // namespace regban
+
+#endif
@@ -0,0 +1,922 @@
+#ifndef PATTERNMATCHER_H
+#define PATTERNMATCHER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace regban {
+
+// Matches a line against a set of regular expressions (subset of ECMAScript syntax as used by std::regex) at once:
+// a DFA built from the patterns tells in one pass which patterns match the whole line, a Pike VM then extracts
+// the position of the (single) capture group for these patterns with the same priorities as std::regex_match.
+// Before that, lines not containing the longest literal every match of a pattern needs are skipped using a SIMD scan.
+class PatternMatcher {
+  public:
+    static constexpr std::size_t MAX_DFA_STATES = 10000;
+    static constexpr int MAX_REPETITIONS = 1000;
+    static constexpr std::size_t MIN_LITERAL_LENGTH = 3;  // shorter literals do not filter well enough
+
+    // pattern uses syntax not supported here, use std::regex instead
+    class Unsupported : public std::runtime_error {
+      public:
+        using std::runtime_error::runtime_error;
+    };
+
+  private:
+    struct CharSet {
+        std::array<std::uint64_t, 4> bits{};
+        void set(unsigned char c) { bits[c >> 6] |= 1UL << (c & 63); }
+        void set_range(unsigned char from, unsigned char to) {
+            for (unsigned int c = from; c <= to; ++c) {
+                set(c);
+            }
+        }
+        bool test(unsigned char c) const { return ((bits[c >> 6] >> (c & 63)) & 1) != 0; }
+        // returns -1 if set does not contain exactly one character
+        int single() const {
+            int res = -1;
+            for (unsigned int c = 0; c < 256; ++c) {
+                if (test(c)) {
+                    if (res >= 0) {
+                        return -1;
+                    }
+                    res = c;
+                }
+            }
+            return res;
+        }
+        void invert() {
+            for (auto& b : bits) {
+                b = ~b;
+            }
+        }
+        void merge(const CharSet& other) {
+            for (std::size_t i = 0; i < bits.size(); ++i) {
+                bits[i] |= other.bits[i];
+            }
+        }
+    };
+
+    struct Node {
+        enum class Type { EMPTY, SET, CONCAT, ALTERNATE, REPEAT, GROUP };
+        Type type = Type::EMPTY;
+        CharSet set;
+        std::vector<Node> children;
+        int min = 0;
+        int max = 0;  // -1 for unbounded
+        bool greedy = true;
+        bool capturing = false;
+    };
+
+    struct Literals {
+        bool exact = true;         // node only matches exact_string
+        std::string exact_string;  //
+        std::string required;      // longest literal every match contains
+    };
+
+    static void keep_longest(std::string& longest, const std::string& s) {
+        if (s.size() > longest.size()) {
+            longest = s;
+        }
+    }
+
+    static Literals required_literals(const Node& node) {
+        Literals res;
+        switch (node.type) {
+            case Node::Type::EMPTY:
+                break;
+            case Node::Type::SET: {
+                const auto c = node.set.single();
+                if (c < 0) {
+                    res.exact = false;
+                } else {
+                    res.exact_string.push_back(c);
+                    res.required = res.exact_string;
+                }
+            } break;
+            case Node::Type::CONCAT: {
+                std::string run;
+                for (const auto& child : node.children) {
+                    const auto literals = required_literals(child);
+                    keep_longest(res.required, literals.required);
+                    if (literals.exact) {
+                        run += literals.exact_string;
+                    } else {
+                        keep_longest(res.required, run);
+                        run.clear();
+                        res.exact = false;
+                    }
+                }
+                keep_longest(res.required, run);
+                if (res.exact) {
+                    res.exact_string = run;
+                }
+            } break;
+            case Node::Type::GROUP:
+                return required_literals(node.children[0]);
+            case Node::Type::REPEAT:
+                res.exact = false;
+                if (node.min > 0) {
+                    res.required = required_literals(node.children[0]).required;
+                }
+                break;
+            case Node::Type::ALTERNATE:
+                res.exact = false;
+                break;
+        }
+        return res;
+    }
+
+    // whether [begin, end) contains literal, compares first and last character of the literal for 16 positions at once
+    static bool contains(const char* begin, const char* end, const std::string& literal) {
+        const auto n = literal.size();
+        if (static_cast<std::size_t>(end - begin) < n) {
+            return false;
+        }
+        const char* const last = end - n;  // last possible start
+        const char* pos = begin;
+#ifdef __SSE2__
+        const auto first_char = _mm_set1_epi8(literal[0]);
+        const auto last_char = _mm_set1_epi8(literal[n - 1]);
+        for (; pos + 16 <= last + 1; pos += 16) {
+            const auto block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+            const auto block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + n - 1));
+            auto mask = static_cast<unsigned int>(
+                _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first_char, block_first), _mm_cmpeq_epi8(last_char, block_last))));
+            while (mask != 0) {
+                const auto offset = __builtin_ctz(mask);
+                if (std::memcmp(pos + offset + 1, literal.data() + 1, n - 2) == 0) {
+                    return true;
+                }
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; pos <= last; ++pos) {
+            if (*pos == literal[0] && std::memcmp(pos + 1, literal.data() + 1, n - 1) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    class Parser {
+      private:
+        const std::string& s;
+        std::size_t pos = 0;
+        int groups = 0;
+
+        bool at_end() const { return pos >= s.size(); }
+        unsigned char peek() const { return s[pos]; }
+
+        static CharSet class_escape(char c) {
+            CharSet res;
+            switch (c) {
+                case 'd':
+                case 'D':
+                    res.set_range('0', '9');
+                    break;
+                case 'w':
+                case 'W':
+                    res.set_range('a', 'z');
+                    res.set_range('A', 'Z');
+                    res.set_range('0', '9');
+                    res.set('_');
+                    break;
+                case 's':
+                case 'S':
+                    res.set(' ');
+                    res.set_range('\t', '\r');
+                    break;
+                default:
+                    break;
+            }
+            if (c == 'D' || c == 'W' || c == 'S') {
+                res.invert();
+            }
+            return res;
+        }
+
+        static bool is_class_escape(char c) { return c == 'd' || c == 'D' || c == 'w' || c == 'W' || c == 's' || c == 'S'; }
+
+        static int hex_value(char c) {
+            if (c >= '0' && c <= '9') {
+                return c - '0';
+            }
+            if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+            }
+            if (c >= 'A' && c <= 'F') {
+                return c - 'A' + 10;
+            }
+            return -1;
+        }
+
+        // character escape after '\', returns character
+        unsigned char character_escape() {
+            const char c = s[pos++];
+            switch (c) {
+                case 't':
+                    return '\t';
+                case 'n':
+                    return '\n';
+                case 'r':
+                    return '\r';
+                case 'f':
+                    return '\f';
+                case 'v':
+                    return '\v';
+                case '0':
+                    if (!at_end() && peek() >= '0' && peek() <= '9') {
+                        throw Unsupported("octal escape");
+                    }
+                    return '\0';
+                case 'x': {
+                    if (pos + 2 > s.size() || hex_value(s[pos]) < 0 || hex_value(s[pos + 1]) < 0) {
+                        throw Unsupported("invalid hex escape");
+                    }
+                    const auto res = hex_value(s[pos]) * 16 + hex_value(s[pos + 1]);
+                    pos += 2;
+                    return res;
+                }
+                default:
+                    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                        throw Unsupported(std::string("escape \\") + c);
+                    }
+                    return c;  // identity escape
+            }
+        }
+
+        Node bracket() {
+            Node res;
+            res.type = Node::Type::SET;
+            bool negate = false;
+            if (!at_end() && peek() == '^') {
+                negate = true;
+                ++pos;
+            }
+            bool first = true;
+            while (true) {
+                if (at_end()) {
+                    throw Unsupported("unterminated bracket expression");
+                }
+                unsigned char c = s[pos++];
+                if (c == ']' && !first) {
+                    break;
+                }
+                first = false;
+                if (c == '[') {
+                    throw Unsupported("nested bracket expression");
+                }
+                if (c == '\\') {
+                    if (at_end()) {
+                        throw Unsupported("trailing backslash");
+                    }
+                    if (is_class_escape(peek())) {
+                        res.set.merge(class_escape(s[pos++]));
+                        continue;
+                    }
+                    if (peek() == 'b') {
+                        ++pos;
+                        c = '\b';
+                    } else {
+                        c = character_escape();
+                    }
+                }
+                if (pos + 1 < s.size() && peek() == '-' && s[pos + 1] != ']') {
+                    ++pos;
+                    unsigned char to = s[pos++];
+                    if (to == '\\') {
+                        if (at_end() || is_class_escape(peek())) {
+                            throw Unsupported("invalid range");
+                        }
+                        to = character_escape();
+                    } else if (to == '[') {
+                        throw Unsupported("nested bracket expression");
+                    }
+                    if (to < c) {
+                        throw Unsupported("invalid range");
+                    }
+                    res.set.set_range(c, to);
+                } else {
+                    res.set.set(c);
+                }
+            }
+            if (negate) {
+                res.set.invert();
+            }
+            return res;
+        }
+
+        bool parse_int(int& value) {
+            const auto start = pos;
+            value = 0;
+            while (!at_end() && peek() >= '0' && peek() <= '9') {
+                value = value * 10 + (s[pos++] - '0');
+                if (value > MAX_REPETITIONS) {
+                    throw Unsupported("too many repetitions");
+                }
+            }
+            return pos > start;
+        }
+
+        Node atom() {
+            Node res;
+            const unsigned char c = s[pos++];
+            switch (c) {
+                case '.':
+                    res.type = Node::Type::SET;
+                    res.set.set('\n');
+                    res.set.set('\r');
+                    res.set.invert();
+                    return res;
+                case '[':
+                    return bracket();
+                case '(':
+                    res.type = Node::Type::GROUP;
+                    if (!at_end() && peek() == '?') {
+                        if (pos + 1 < s.size() && s[pos + 1] == ':') {
+                            pos += 2;
+                        } else {
+                            throw Unsupported("assertion group");
+                        }
+                    } else {
+                        res.capturing = true;
+                        ++groups;
+                    }
+                    res.children.emplace_back(disjunction());
+                    if (at_end() || peek() != ')') {
+                        throw Unsupported("unbalanced parenthesis");
+                    }
+                    ++pos;
+                    return res;
+                case '\\':
+                    if (at_end()) {
+                        throw Unsupported("trailing backslash");
+                    }
+                    res.type = Node::Type::SET;
+                    if (is_class_escape(peek())) {
+                        res.set = class_escape(s[pos++]);
+                    } else {
+                        res.set.set(character_escape());
+                    }
+                    return res;
+                case '^':
+                case '$':
+                    throw Unsupported("assertion");
+                case ')':
+                case '*':
+                case '+':
+                case '?':
+                case '{':
+                case '}':
+                case ']':
+                case '|':
+                    throw Unsupported(std::string("unexpected ") + static_cast<char>(c));
+                default:
+                    res.type = Node::Type::SET;
+                    res.set.set(c);
+                    return res;
+            }
+        }
+
+        Node term() {
+            Node res = atom();
+            while (!at_end()) {
+                int min;
+                int max;
+                const auto c = peek();
+                if (c == '*') {
+                    min = 0;
+                    max = -1;
+                    ++pos;
+                } else if (c == '+') {
+                    min = 1;
+                    max = -1;
+                    ++pos;
+                } else if (c == '?') {
+                    min = 0;
+                    max = 1;
+                    ++pos;
+                } else if (c == '{') {
+                    ++pos;
+                    if (!parse_int(min)) {
+                        throw Unsupported("invalid repetition");
+                    }
+                    max = min;
+                    if (!at_end() && peek() == ',') {
+                        ++pos;
+                        if (!parse_int(max)) {
+                            max = -1;
+                        } else if (max < min) {
+                            throw Unsupported("invalid repetition");
+                        }
+                    }
+                    if (at_end() || peek() != '}') {
+                        throw Unsupported("invalid repetition");
+                    }
+                    ++pos;
+                } else {
+                    break;
+                }
+                Node repeat;
+                repeat.type = Node::Type::REPEAT;
+                repeat.min = min;
+                repeat.max = max;
+                if (!at_end() && peek() == '?') {
+                    repeat.greedy = false;
+                    ++pos;
+                }
+                repeat.children.emplace_back(std::move(res));
+                res = std::move(repeat);
+            }
+            return res;
+        }
+
+        Node alternative() {
+            Node res;
+            res.type = Node::Type::CONCAT;
+            while (!at_end() && peek() != '|' && peek() != ')' && !(peek() == '$' && pos + 1 == s.size())) {
+                res.children.emplace_back(term());
+            }
+            return res;
+        }
+
+        Node disjunction() {
+            Node res = alternative();
+            if (at_end() || peek() != '|') {
+                return res;
+            }
+            Node alternate;
+            alternate.type = Node::Type::ALTERNATE;
+            alternate.children.emplace_back(std::move(res));
+            while (!at_end() && peek() == '|') {
+                ++pos;
+                alternate.children.emplace_back(alternative());
+            }
+            return alternate;
+        }
+
+      public:
+        explicit Parser(const std::string& s_p) : s(s_p) {}
+
+        Node parse() {
+            // anchors are implied as whole lines are matched
+            if (!at_end() && peek() == '^') {
+                ++pos;
+            }
+            Node res = disjunction();
+            if (!at_end() && peek() == '$' && pos + 1 == s.size()) {
+                ++pos;
+            }
+            if (!at_end()) {
+                throw Unsupported(std::string("unexpected ") + s[pos]);
+            }
+            return res;
+        }
+
+        int group_count() const { return groups; }
+    };
+
+    struct Instruction {
+        enum class Op : std::uint8_t { SET, SPLIT, JMP, SAVE, MATCH };
+        Op op;
+        std::uint32_t x;  // SET: set index, SPLIT/JMP: (preferred) target, SAVE: slot, MATCH: pattern index
+        std::uint32_t y;  // SPLIT: other target
+    };
+
+    std::vector<CharSet> sets;
+    std::vector<Instruction> program;
+    std::vector<std::uint32_t> starts;  // start instruction of each pattern
+
+    std::vector<std::pair<std::size_t, std::size_t>> pattern_sets;  // range in sets used by each pattern
+
+    // prefilter
+    std::vector<std::string> literals;     // distinct required literals
+    std::vector<int> pattern_literals;     // index into literals for each pattern, -1 if none
+    struct Counters {
+        std::atomic<std::uint64_t> candidates{0};
+        std::atomic<std::uint64_t> matches{0};
+    };
+    std::unique_ptr<Counters[]> counters;  // for each pattern
+
+    // DFA for a range of consecutive patterns, state 0 is the dead state
+    struct Dfa {
+        std::size_t first_pattern;
+        std::size_t pattern_count;
+        bool valid = false;  // otherwise patterns are run through the VM
+        std::array<std::uint8_t, 256> byte_classes{};
+        std::size_t class_count = 0;
+        std::uint32_t start = 0;
+        std::vector<std::uint32_t> transitions;
+        std::vector<std::vector<std::uint32_t>> accepting;  // patterns matching when ending in state
+    };
+    std::vector<Dfa> dfas;
+
+    std::uint32_t emit(Instruction::Op op, std::uint32_t x = 0, std::uint32_t y = 0) {
+        program.push_back({op, x, y});
+        return program.size() - 1;
+    }
+
+    void compile_node(const Node& node) {
+        switch (node.type) {
+            case Node::Type::EMPTY:
+                break;
+            case Node::Type::SET:
+                sets.push_back(node.set);
+                emit(Instruction::Op::SET, sets.size() - 1);
+                break;
+            case Node::Type::CONCAT:
+                for (const auto& child : node.children) {
+                    compile_node(child);
+                }
+                break;
+            case Node::Type::ALTERNATE: {
+                std::vector<std::uint32_t> jumps;
+                for (std::size_t i = 0; i < node.children.size(); ++i) {
+                    if (i + 1 < node.children.size()) {
+                        const auto split = emit(Instruction::Op::SPLIT);
+                        program[split].x = split + 1;
+                        compile_node(node.children[i]);
+                        jumps.push_back(emit(Instruction::Op::JMP));
+                        program[split].y = program.size();
+                    } else {
+                        compile_node(node.children[i]);
+                    }
+                }
+                for (const auto jump : jumps) {
+                    program[jump].x = program.size();
+                }
+            } break;
+            case Node::Type::GROUP:
+                if (node.capturing) {
+                    emit(Instruction::Op::SAVE, 0);
+                    compile_node(node.children[0]);
+                    emit(Instruction::Op::SAVE, 1);
+                } else {
+                    compile_node(node.children[0]);
+                }
+                break;
+            case Node::Type::REPEAT: {
+                for (int i = 0; i < node.min; ++i) {
+                    compile_node(node.children[0]);
+                }
+                if (node.max < 0) {
+                    const auto split = emit(Instruction::Op::SPLIT);
+                    compile_node(node.children[0]);
+                    emit(Instruction::Op::JMP, split);
+                    set_split(split, split + 1, program.size(), node.greedy);
+                } else {
+                    std::vector<std::uint32_t> splits;
+                    for (int i = node.min; i < node.max; ++i) {
+                        splits.push_back(emit(Instruction::Op::SPLIT));
+                        compile_node(node.children[0]);
+                    }
+                    for (const auto split : splits) {
+                        set_split(split, split + 1, program.size(), node.greedy);
+                    }
+                }
+            } break;
+        }
+    }
+
+    void set_split(std::uint32_t split, std::uint32_t body, std::uint32_t out, bool greedy) {
+        program[split].x = greedy ? body : out;
+        program[split].y = greedy ? out : body;
+    }
+
+    // collect consuming and matching instructions reachable from pc without consuming input
+    void closure(std::uint32_t pc, std::vector<std::uint32_t>& res, std::vector<std::uint32_t>& marks, std::uint32_t generation) const {
+        while (marks[pc] != generation) {
+            marks[pc] = generation;
+            const auto& instruction = program[pc];
+            switch (instruction.op) {
+                case Instruction::Op::SET:
+                case Instruction::Op::MATCH:
+                    res.push_back(pc);
+                    return;
+                case Instruction::Op::SPLIT:
+                    closure(instruction.x, res, marks, generation);
+                    pc = instruction.y;
+                    break;
+                case Instruction::Op::JMP:
+                    pc = instruction.x;
+                    break;
+                case Instruction::Op::SAVE:
+                    ++pc;
+                    break;
+            }
+        }
+    }
+
+    // returns false if DFA would get too large
+    bool build_dfa(Dfa& dfa) const {
+        dfa.valid = false;
+        dfa.transitions.clear();
+        dfa.accepting.clear();
+
+        // partition bytes into classes that no set distinguishes
+        dfa.byte_classes.fill(0);
+        dfa.class_count = 1;
+        for (auto set = pattern_sets[dfa.first_pattern].first; set < pattern_sets[dfa.first_pattern + dfa.pattern_count - 1].second; ++set) {
+            std::map<std::pair<std::uint8_t, bool>, std::uint8_t> refined;
+            for (unsigned int c = 0; c < 256; ++c) {
+                const auto key = std::make_pair(dfa.byte_classes[c], sets[set].test(c));
+                const auto it = refined.emplace(key, refined.size()).first;
+                dfa.byte_classes[c] = it->second;
+            }
+            dfa.class_count = refined.size();
+        }
+        std::vector<unsigned char> representatives(dfa.class_count);
+        for (unsigned int c = 256; c-- > 0;) {
+            representatives[dfa.byte_classes[c]] = c;
+        }
+
+        std::vector<std::uint32_t> marks(program.size(), 0);
+        std::uint32_t generation = 0;
+        std::map<std::vector<std::uint32_t>, std::uint32_t> ids;
+        std::vector<std::vector<std::uint32_t>> states;
+
+        const auto add_state = [&](std::vector<std::uint32_t>&& state) -> std::uint32_t {
+            std::sort(std::begin(state), std::end(state));
+            const auto it = ids.find(state);
+            if (it != std::end(ids)) {
+                return it->second;
+            }
+            if (states.size() >= MAX_DFA_STATES) {
+                throw Unsupported("too many DFA states");
+            }
+            const std::uint32_t id = states.size();
+            ids.emplace(state, id);
+            states.emplace_back(std::move(state));
+            return id;
+        };
+
+        try {
+            add_state({});  // dead state
+            std::vector<std::uint32_t> start;
+            ++generation;
+            for (std::size_t i = 0; i < dfa.pattern_count; ++i) {
+                closure(starts[dfa.first_pattern + i], start, marks, generation);
+            }
+            dfa.start = add_state(std::move(start));
+
+            for (std::size_t i = 0; i < states.size(); ++i) {
+                dfa.transitions.resize(states.size() * dfa.class_count, 0);
+                for (std::size_t cls = 0; cls < dfa.class_count; ++cls) {
+                    std::vector<std::uint32_t> next;
+                    ++generation;
+                    for (const auto pc : states[i]) {
+                        const auto& instruction = program[pc];
+                        if (instruction.op == Instruction::Op::SET && sets[instruction.x].test(representatives[cls])) {
+                            closure(pc + 1, next, marks, generation);
+                        }
+                    }
+                    const auto id = add_state(std::move(next));
+                    dfa.transitions[i * dfa.class_count + cls] = id;
+                }
+            }
+        } catch (const Unsupported&) {
+            dfa.transitions.clear();
+            return false;
+        }
+        dfa.transitions.resize(states.size() * dfa.class_count, 0);
+
+        dfa.accepting.resize(states.size());
+        for (std::size_t i = 0; i < states.size(); ++i) {
+            for (const auto pc : states[i]) {
+                if (program[pc].op == Instruction::Op::MATCH) {
+                    dfa.accepting[i].push_back(program[pc].x);
+                }
+            }
+            std::sort(std::begin(dfa.accepting[i]), std::end(dfa.accepting[i]));
+        }
+        dfa.valid = true;
+        return true;
+    }
+
+    struct Thread {
+        std::uint32_t pc;
+        std::array<const char*, 2> captures;
+    };
+
+    struct Scratch {
+        std::vector<Thread> current;
+        std::vector<Thread> next;
+        std::vector<std::uint32_t> marks;
+        std::uint32_t generation = 0;
+    };
+
+    void add_thread(std::vector<Thread>& list, std::uint32_t pc, std::array<const char*, 2> captures, const char* pos, Scratch& scratch) const {
+        while (scratch.marks[pc] != scratch.generation) {
+            scratch.marks[pc] = scratch.generation;
+            const auto& instruction = program[pc];
+            switch (instruction.op) {
+                case Instruction::Op::SET:
+                case Instruction::Op::MATCH:
+                    list.push_back({pc, captures});
+                    return;
+                case Instruction::Op::SPLIT:
+                    add_thread(list, instruction.x, captures, pos, scratch);
+                    pc = instruction.y;
+                    break;
+                case Instruction::Op::JMP:
+                    pc = instruction.x;
+                    break;
+                case Instruction::Op::SAVE:
+                    captures[instruction.x] = pos;
+                    ++pc;
+                    break;
+            }
+        }
+    }
+
+    // Pike VM for full match of a single pattern, returns capture
+    bool run_vm(std::size_t pattern, const char* begin, const char* end, std::array<const char*, 2>& captures) const {
+        thread_local Scratch scratch;
+        if (scratch.marks.size() < program.size()) {
+            scratch.marks.assign(program.size(), 0);
+            scratch.generation = 0;
+        }
+        scratch.current.clear();
+        ++scratch.generation;
+        add_thread(scratch.current, starts[pattern], {nullptr, nullptr}, begin, scratch);
+        for (const char* pos = begin;; ++pos) {
+            if (scratch.current.empty()) {
+                return false;
+            }
+            scratch.next.clear();
+            ++scratch.generation;
+            for (const auto& thread : scratch.current) {
+                const auto& instruction = program[thread.pc];
+                if (instruction.op == Instruction::Op::MATCH) {
+                    if (pos == end) {
+                        captures = thread.captures;
+                        return true;
+                    }
+                } else if (pos != end && sets[instruction.x].test(*pos)) {
+                    add_thread(scratch.next, thread.pc + 1, thread.captures, pos + 1, scratch);
+                }
+            }
+            if (pos == end) {
+                return false;
+            }
+            std::swap(scratch.current, scratch.next);
+        }
+    }
+
+  public:
+    // throws Unsupported if pattern has to be handled by std::regex instead, returns index of pattern
+    std::size_t add(const std::string& pattern) {
+        Parser parser(pattern);
+        const auto root = parser.parse();
+        if (parser.group_count() != 1) {
+            throw std::runtime_error("Regexp needs to have exactly one subgroup for " + pattern);
+        }
+        const auto program_size = program.size();
+        const auto sets_size = sets.size();
+        try {
+            starts.push_back(program.size());
+            compile_node(root);
+            emit(Instruction::Op::MATCH, starts.size() - 1);
+            pattern_sets.emplace_back(sets_size, sets.size());
+        } catch (...) {
+            starts.resize(pattern_sets.size());
+            program.resize(program_size);
+            sets.resize(sets_size);
+            throw;
+        }
+
+        const auto literal = required_literals(root).required;
+        if (literal.size() < MIN_LITERAL_LENGTH) {
+            pattern_literals.push_back(-1);
+        } else {
+            const auto it = std::find(std::begin(literals), std::end(literals), literal);
+            pattern_literals.push_back(it - std::begin(literals));
+            if (it == std::end(literals)) {
+                literals.push_back(literal);
+            }
+        }
+        counters.reset(new Counters[starts.size()]);
+
+        dfas.clear();
+        return starts.size() - 1;
+    }
+
+    // to be called after all patterns have been added: patterns are combined into as few DFAs as possible (usually
+    // one per up to a few patterns), returns false if a single pattern is too complex for a DFA (matching it is slower then)
+    bool compile() {
+        dfas.clear();
+        bool res = true;
+        for (std::size_t i = 0; i < starts.size(); ++i) {
+            Dfa dfa;
+            dfa.first_pattern = i;
+            dfa.pattern_count = 1;
+            if (!build_dfa(dfa)) {
+                res = false;
+                dfas.emplace_back(std::move(dfa));
+                continue;
+            }
+            // extend while the DFA stays small enough
+            while (i + 1 < starts.size()) {
+                Dfa extended;
+                extended.first_pattern = dfa.first_pattern;
+                extended.pattern_count = dfa.pattern_count + 1;
+                if (!build_dfa(extended)) {
+                    break;
+                }
+                dfa = std::move(extended);
+                ++i;
+            }
+            dfas.emplace_back(std::move(dfa));
+        }
+        return res;
+    }
+
+    std::size_t size() const { return starts.size(); }
+    std::size_t dfa_count() const { return dfas.size(); }
+
+    // prefilter literal of pattern (empty if none) and number of lines passing prefilter/matching so far
+    std::string literal(std::size_t pattern) const { return pattern_literals[pattern] < 0 ? std::string() : literals[pattern_literals[pattern]]; }
+    std::uint64_t candidates(std::size_t pattern) const { return counters[pattern].candidates.load(std::memory_order_relaxed); }
+    std::uint64_t matches(std::size_t pattern) const { return counters[pattern].matches.load(std::memory_order_relaxed); }
+
+    // calls callback(pattern index, capture begin, capture end) for each pattern matching the whole line in ascending order
+    template<typename Callback>
+    void match(const char* begin, const char* end, Callback&& callback) const {
+        thread_local std::vector<char> candidate;
+        thread_local std::vector<char> found;
+        found.resize(literals.size());
+        for (std::size_t i = 0; i < literals.size(); ++i) {
+            found[i] = contains(begin, end, literals[i]);
+        }
+        candidate.resize(starts.size());
+        bool any = false;
+        for (std::size_t i = 0; i < starts.size(); ++i) {
+            candidate[i] = pattern_literals[i] < 0 || found[pattern_literals[i]];
+            if (candidate[i]) {
+                counters[i].candidates.fetch_add(1, std::memory_order_relaxed);
+                any = true;
+            }
+        }
+        if (!any) {
+            return;
+        }
+
+        std::array<const char*, 2> captures;
+        const auto try_pattern = [&](std::size_t i) {
+            if (run_vm(i, begin, end, captures)) {
+                counters[i].matches.fetch_add(1, std::memory_order_relaxed);
+                callback(i, captures[0], captures[1]);
+            }
+        };
+        if (dfas.empty()) {
+            for (std::size_t i = 0; i < starts.size(); ++i) {
+                if (candidate[i]) {
+                    try_pattern(i);
+                }
+            }
+            return;
+        }
+        for (const auto& dfa : dfas) {
+            const auto first = std::begin(candidate) + dfa.first_pattern;
+            if (std::find(first, first + dfa.pattern_count, 1) == first + dfa.pattern_count) {
+                continue;
+            }
+            if (!dfa.valid) {
+                for (std::size_t i = dfa.first_pattern; i < dfa.first_pattern + dfa.pattern_count; ++i) {
+                    if (candidate[i]) {
+                        try_pattern(i);
+                    }
+                }
+                continue;
+            }
+            std::uint32_t state = dfa.start;
+            const auto* table = dfa.transitions.data();
+            const auto class_count = dfa.class_count;
+            for (const auto* pos = begin; pos != end && state != 0; ++pos) {
+                state = table[state * class_count + dfa.byte_classes[static_cast<unsigned char>(*pos)]];
+            }
+            for (const auto i : dfa.accepting[state]) {
+                try_pattern(i);
+            }
+        }
+    }
+};
+
+}  // namespace regban
+
+#endif
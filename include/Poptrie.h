@@ -0,0 +1,260 @@
+#ifndef POPTRIE_H
+#define POPTRIE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "IPvX.h"
+
+namespace regban {
+
+// longest-prefix matching of ip addresses to 31-bit values, compiled once from a list of prefixes as a poptrie
+// (Asai and Ohara, 2015): the first 16 bits of an address index an array directly, each following 6 bits select one of
+// the 64 positions of a node, whose children and run-length compressed leaves are stored contiguously and found by
+// counting the bits set before that position, so that a lookup needs at most 5 (IPv4) or 21 (IPv6) memory accesses
+class Poptrie {
+  public:
+    static constexpr unsigned int DIRECT_BITS = 16;
+    static constexpr unsigned int STRIDE_BITS = 6;
+    static constexpr std::uint32_t NODE_FLAG = 1U << 31;  // root entry refers to a node instead of a value
+
+    struct Prefix {
+        IPvX::Internal key;  // network aligned to the most significant bit
+        unsigned char length;
+        std::uint32_t value;
+    };
+    struct Node {
+        std::uint64_t children;     // one bit per position having a child node
+        std::uint64_t leaf_starts;  // one bit per position whose leaf differs from the one of the previous position
+        std::uint32_t child_base;   // index of first child in nodes
+        std::uint32_t leaf_base;    // index of first leaf in leaves
+    };
+
+    // read-only access to the arrays of a trie, which may also be those in a memory-mapped file
+    struct View {
+        const std::uint32_t* roots[2];  // nullptr if empty
+        const Node* nodes;
+        const std::uint32_t* leaves;
+
+        // value for the most specific prefix containing ip, 0 if the trie of its address family is empty
+        std::uint32_t lookup(IPvX ip) const {
+            const auto ipv6 = ip.is_ipv6();
+            const auto* root = roots[ipv6];
+            if (root == nullptr) {
+                return 0;
+            }
+            const auto k = key(ip, ipv6);
+            auto entry = root[static_cast<std::size_t>(k >> (IPvX::TOTAL_BIT_SIZE_V6 - DIRECT_BITS))];
+            for (unsigned int depth = DIRECT_BITS; (entry & NODE_FLAG) != 0; depth += STRIDE_BITS) {
+                const auto& node = nodes[entry & ~NODE_FLAG];
+                const auto position = chunk(k, depth);
+                if (((node.children >> position) & 1) != 0) {
+                    entry = NODE_FLAG | (node.child_base + __builtin_popcountll(node.children & up_to(position)) - 1);
+                } else {
+                    entry = leaves[node.leaf_base + __builtin_popcountll(node.leaf_starts & up_to(position)) - 1];
+                }
+            }
+            return entry;
+        }
+    };
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+  public:
+#else
+  protected:
+#endif
+    std::vector<std::uint32_t> roots[2];  // for IPv4 and IPv6, empty if there are no prefixes
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> leaves;
+
+    // STRIDE_BITS bits of key starting at bit depth (counted from the most significant one), zero-padded at the end
+    static unsigned int chunk(IPvX::Internal key, unsigned int depth) {
+        const int shift = IPvX::TOTAL_BIT_SIZE_V6 - depth - STRIDE_BITS;
+        return static_cast<unsigned int>((shift >= 0 ? key >> shift : key << -shift) & ((1 << STRIDE_BITS) - 1));
+    }
+
+    static std::uint64_t up_to(unsigned int position) { return (std::uint64_t(2) << position) - 1; }
+
+    // less specific prefixes first, so that more specific ones are applied on top of them
+    template<typename Apply>
+    static void apply_all(std::vector<Prefix>& prefixes, std::uint32_t* states, unsigned int depth, unsigned int bits, Apply& apply) {
+        std::stable_sort(std::begin(prefixes), std::end(prefixes), [](const Prefix& a, const Prefix& b) { return a.length < b.length; });
+        for (const auto& p : prefixes) {
+            const auto first = static_cast<std::size_t>(bits == DIRECT_BITS ? p.key >> (IPvX::TOTAL_BIT_SIZE_V6 - DIRECT_BITS) : chunk(p.key, depth));
+            const auto count = std::size_t(1) << (depth + bits - p.length);
+            for (auto* state = states + first; state != states + first + count; ++state) {
+                *state = apply(*state, p);
+            }
+        }
+    }
+
+    // all prefixes in [begin, end) are longer than depth and agree on the bits before it
+    template<typename Apply, typename Leaf>
+    void build_node(std::size_t index, const Prefix* begin, const Prefix* end, unsigned int depth, std::uint32_t inherited, Apply& apply, Leaf& leaf) {
+        std::uint32_t states[1 << STRIDE_BITS];
+        std::fill(std::begin(states), std::end(states), inherited);
+        std::vector<Prefix> ending;
+        std::vector<Prefix> deeper;
+        for (const auto* p = begin; p != end; ++p) {
+            (p->length <= depth + STRIDE_BITS ? ending : deeper).push_back(*p);
+        }
+        apply_all(ending, states, depth, STRIDE_BITS, apply);
+
+        Node node{0, 0, static_cast<std::uint32_t>(nodes.size()), static_cast<std::uint32_t>(leaves.size())};
+        for (const auto& p : deeper) {
+            node.children |= std::uint64_t(1) << chunk(p.key, depth);
+        }
+        std::uint32_t previous = 0;
+        for (unsigned int i = 0; i < (1 << STRIDE_BITS); ++i) {
+            const auto value = leaf(states[i]);
+            if (i == 0 || value != previous) {
+                node.leaf_starts |= std::uint64_t(1) << i;
+                leaves.push_back(value);
+                previous = value;
+            }
+        }
+        nodes.resize(nodes.size() + __builtin_popcountll(node.children));
+        nodes[index] = node;
+
+        // deeper is sorted, so prefixes of each child are contiguous
+        std::size_t child = node.child_base;
+        for (auto it = std::begin(deeper); it != std::end(deeper); ++child) {
+            const auto position = chunk(it->key, depth);
+            const auto group_end = std::find_if(it, std::end(deeper), [&](const Prefix& p) { return chunk(p.key, depth) != position; });
+            build_node(child, &*it, &*it + (group_end - it), depth + STRIDE_BITS, states[position], apply, leaf);
+            it = group_end;
+        }
+    }
+
+  public:
+    static IPvX::Internal key(IPvX ip, bool ipv6) {
+        return ipv6 ? static_cast<IPvX::Internal>(ip) : static_cast<IPvX::Internal>(ip) << (IPvX::TOTAL_BIT_SIZE_V6 - IPvX::TOTAL_BIT_SIZE_V4);
+    }
+
+    void clear() {
+        roots[0].clear();
+        roots[1].clear();
+        nodes.clear();
+        leaves.clear();
+    }
+
+    // builds the trie for one address family (replacing an earlier one): the state of an address starts as 0 and
+    // apply(state, prefix) is called for each prefix containing it from less to more specific ones, the value found
+    // for the address is then leaf(state), which has to be less than NODE_FLAG (leaf(0) is returned for no prefix);
+    // prefix keys need to be networks of their length
+    template<typename Apply, typename Leaf>
+    void build(bool ipv6, std::vector<Prefix> prefixes, Apply&& apply, Leaf&& leaf) {
+        auto& root = roots[ipv6];
+        root.clear();
+        if (prefixes.empty()) {
+            return;
+        }
+        std::sort(std::begin(prefixes), std::end(prefixes), [](const Prefix& a, const Prefix& b) { return a.key < b.key || (a.key == b.key && a.length < b.length); });
+
+        constexpr auto shift = IPvX::TOTAL_BIT_SIZE_V6 - DIRECT_BITS;
+        std::vector<std::uint32_t> states(std::size_t(1) << DIRECT_BITS, 0);
+        std::vector<Prefix> ending;
+        std::vector<Prefix> deeper;
+        for (const auto& p : prefixes) {
+            (p.length <= DIRECT_BITS ? ending : deeper).push_back(p);
+        }
+        apply_all(ending, &states[0], 0, DIRECT_BITS, apply);
+        root.resize(states.size());
+        std::transform(std::begin(states), std::end(states), std::begin(root), [&](std::uint32_t state) { return leaf(state); });
+
+        for (auto it = std::begin(deeper); it != std::end(deeper);) {
+            const auto position = static_cast<std::size_t>(it->key >> shift);
+            const auto group_end = std::find_if(it, std::end(deeper), [&](const Prefix& p) { return static_cast<std::size_t>(p.key >> shift) != position; });
+            const auto index = nodes.size();
+            nodes.emplace_back();
+            build_node(index, &*it, &*it + (group_end - it), DIRECT_BITS, states[position], apply, leaf);
+            root[position] = NODE_FLAG | static_cast<std::uint32_t>(index);
+            it = group_end;
+        }
+    }
+
+    View view() const {
+        return View{{roots[0].empty() ? nullptr : roots[0].data(), roots[1].empty() ? nullptr : roots[1].data()}, nodes.data(), leaves.data()};
+    }
+
+    std::uint32_t lookup(IPvX ip) const { return view().lookup(ip); }
+
+    // in native byte order: the numbers of IPv4 roots, IPv6 roots, nodes and leaves as 64-bit integers, then the
+    // nodes, IPv4 roots, IPv6 roots and leaves, padded to a multiple of 8 bytes
+    void write(std::ostream& out) const {
+        const std::uint64_t counts[4] = {roots[0].size(), roots[1].size(), nodes.size(), leaves.size()};
+        out.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+        out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(Node));
+        for (const auto* array : {&roots[0], &roots[1], &leaves}) {
+            out.write(reinterpret_cast<const char*>(array->data()), array->size() * sizeof(std::uint32_t));
+        }
+        if ((roots[0].size() + roots[1].size() + leaves.size()) % 2 != 0) {
+            const std::uint32_t padding = 0;
+            out.write(reinterpret_cast<const char*>(&padding), sizeof(padding));
+        }
+    }
+
+    // view of a trie written by write() at data (8-byte aligned), which is advanced past it; all indices are checked, so
+    // that lookups stay in bounds and return values below value_limit
+    static View read(const char*& data, const char* end, std::uint32_t value_limit) {
+        const auto take = [&](std::size_t size) {
+            if (static_cast<std::size_t>(end - data) < size) {
+                throw std::runtime_error("Truncated trie");
+            }
+            const auto* res = data;
+            data += size;
+            return res;
+        };
+        std::uint64_t counts[4];
+        std::memcpy(counts, take(sizeof(counts)), sizeof(counts));
+        for (unsigned int i = 0; i < 2; ++i) {
+            if (counts[i] != 0 && counts[i] != (std::uint64_t(1) << DIRECT_BITS)) {
+                throw std::runtime_error("Invalid trie roots");
+            }
+        }
+        if (counts[2] >= NODE_FLAG || counts[3] >= NODE_FLAG) {
+            throw std::runtime_error("Invalid trie size");
+        }
+        View res;
+        res.nodes = reinterpret_cast<const Node*>(take(counts[2] * sizeof(Node)));
+        res.roots[0] = counts[0] == 0 ? nullptr : reinterpret_cast<const std::uint32_t*>(take(counts[0] * sizeof(std::uint32_t)));
+        res.roots[1] = counts[1] == 0 ? nullptr : reinterpret_cast<const std::uint32_t*>(take(counts[1] * sizeof(std::uint32_t)));
+        res.leaves = reinterpret_cast<const std::uint32_t*>(take(counts[3] * sizeof(std::uint32_t)));
+        if ((counts[0] + counts[1] + counts[3]) % 2 != 0) {
+            take(sizeof(std::uint32_t));
+        }
+
+        const auto valid = [&](std::uint32_t entry) { return (entry & NODE_FLAG) != 0 ? (entry & ~NODE_FLAG) < counts[2] : entry < value_limit; };
+        for (unsigned int i = 0; i < 2; ++i) {
+            if (!std::all_of(res.roots[i], res.roots[i] + counts[i], valid)) {
+                throw std::runtime_error("Invalid trie root entry");
+            }
+        }
+        // children are stored after their parents, so levels are known when reaching a node
+        constexpr auto max_level = (IPvX::TOTAL_BIT_SIZE_V6 - DIRECT_BITS + STRIDE_BITS - 1) / STRIDE_BITS;
+        std::vector<unsigned char> levels(counts[2], 1);
+        for (std::size_t i = 0; i < counts[2]; ++i) {
+            const auto& node = res.nodes[i];
+            const auto children = static_cast<std::uint64_t>(__builtin_popcountll(node.children));
+            if ((children > 0 && (node.child_base <= i || node.child_base + children > counts[2] || levels[i] == max_level))
+                || node.leaf_base + static_cast<std::uint64_t>(__builtin_popcountll(node.leaf_starts)) > counts[3] || (node.leaf_starts & 1) == 0) {
+                throw std::runtime_error("Invalid trie node");
+            }
+            for (std::size_t child = node.child_base; child < node.child_base + children; ++child) {
+                levels[child] = std::max<unsigned char>(levels[child], levels[i] + 1);
+            }
+        }
+        if (!std::all_of(res.leaves, res.leaves + counts[3], [&](std::uint32_t value) { return value < value_limit; })) {
+            throw std::runtime_error("Invalid trie leaf");
+        }
+        return res;
+    }
+};
+
+}  // namespace regban
+
+#endif
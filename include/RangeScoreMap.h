@@ -0,0 +1,155 @@
+#ifndef RANGESCOREMAP_H
+#define RANGESCOREMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "IPRangeTable.h"
+#include "IPvX.h"
+#include "Poptrie.h"
+#include "types.h"
+
+namespace regban {
+
+// several range tables merged into a single Poptrie: for each ip it gives the sum of the scores of the most specific
+// range containing it in each table, or that the ip is always allowed if any of these scores is not positive
+class RangeScoreMap {
+  public:
+    struct Result {
+        Score score;
+        bool allowed;
+    };
+
+    // read-only access to a map, which may also be one in a memory-mapped file
+    struct View {
+        Poptrie::View trie;
+        const Result* results;
+
+        Result lookup(IPvX ip) const { return results[trie.lookup(ip)]; }
+    };
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+  public:
+#else
+  protected:
+#endif
+    Poptrie trie;
+    std::vector<Result> results;  // distinct results, first one for ips in none of the ranges
+
+  public:
+    RangeScoreMap() : results{Result{0, false}} {}
+
+    std::size_t size() const { return results.size(); }
+
+    void build(const std::vector<IPRangeTable<Score>>& tables) {
+        trie.clear();
+        results.assign(1, Result{0, false});
+        if (tables.size() >= 256) {
+            throw std::runtime_error("Too many range tables");
+        }
+        // while building, states are the ranges (index + 1, or 0) that the ip falls into in each table
+        std::vector<std::vector<std::uint32_t>> states{std::vector<std::uint32_t>(tables.size(), 0)};
+        std::map<std::vector<std::uint32_t>, std::uint32_t> state_index{{states[0], 0}};
+        std::map<std::pair<Score, bool>, std::uint32_t> result_index{{{0, false}, 0}};
+        std::vector<std::uint32_t> state_results{0};
+        std::map<std::pair<std::uint32_t, std::uint32_t>, std::uint32_t> transitions;
+
+        for (const bool ipv6 : {false, true}) {
+            std::vector<Poptrie::Prefix> prefixes;
+            for (std::size_t t = 0; t < tables.size(); ++t) {
+                for (auto p : tables[t].prefixes(ipv6)) {
+                    if (p.value >= (1 << 24)) {
+                        throw std::runtime_error("Too many ranges in range table");
+                    }
+                    p.value |= static_cast<std::uint32_t>(t) << 24;  // table in upper bits
+                    prefixes.push_back(p);
+                }
+            }
+            trie.build(
+                ipv6, std::move(prefixes),
+                [&](std::uint32_t state, const Poptrie::Prefix& p) {
+                    const auto transition = transitions.emplace(std::make_pair(state, p.value), 0);
+                    if (!transition.second) {
+                        return transition.first->second;
+                    }
+                    auto ranges = states[state];
+                    ranges[p.value >> 24] = (p.value & 0xffffff);
+                    const auto res = state_index.emplace(ranges, states.size());
+                    if (res.second) {
+                        Result result{0, false};
+                        for (std::size_t t = 0; t < ranges.size(); ++t) {
+                            if (ranges[t] != 0) {
+                                const auto score = (std::begin(tables[t]) + (ranges[t] - 1))->value;
+                                if (score <= 0) {
+                                    result = Result{0, true};
+                                    break;
+                                }
+                                result.score += score;
+                            }
+                        }
+                        const auto r = result_index.emplace(std::make_pair(result.score, result.allowed), results.size());
+                        if (r.second) {
+                            results.push_back(result);
+                        }
+                        states.push_back(std::move(ranges));
+                        state_results.push_back(r.first->second);
+                    }
+                    transition.first->second = res.first->second;
+                    return res.first->second;
+                },
+                [&](std::uint32_t state) { return state_results[state]; });
+        }
+    }
+
+    View view() const { return View{trie.view(), results.data()}; }
+
+    Result lookup(IPvX ip) const { return results[trie.lookup(ip)]; }
+
+    // in native byte order: the number of results as a 64-bit integer, the results and the trie
+    void write(std::ostream& out) const {
+        const std::uint64_t count = results.size();
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (const auto& result : results) {
+            Result r;
+            std::memset(&r, 0, sizeof(r));  // no uninitialized padding
+            r.score = result.score;
+            r.allowed = result.allowed;
+            out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+        }
+        trie.write(out);
+    }
+
+    // view of a map written by write() at data (8-byte aligned), which is advanced past it
+    static View read(const char*& data, const char* end) {
+        static_assert(sizeof(Result) % 8 == 0, "results need to keep the trie aligned");
+        std::uint64_t count;
+        if (static_cast<std::size_t>(end - data) < sizeof(count)) {
+            throw std::runtime_error("Truncated score map");
+        }
+        std::memcpy(&count, data, sizeof(count));
+        data += sizeof(count);
+        if (count == 0 || count >= Poptrie::NODE_FLAG || static_cast<std::size_t>(end - data) / sizeof(Result) < count) {
+            throw std::runtime_error("Invalid score map");
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            unsigned char allowed;
+            std::memcpy(&allowed, data + i * sizeof(Result) + offsetof(Result, allowed), sizeof(allowed));
+            if (allowed > 1) {
+                throw std::runtime_error("Invalid score map result");
+            }
+        }
+        const auto* res = reinterpret_cast<const Result*>(data);
+        data += count * sizeof(Result);
+        return View{Poptrie::read(data, end, count), res};
+    }
+};
+
+}  // namespace regban
+
+#endif
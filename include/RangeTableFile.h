@@ -0,0 +1,241 @@
+#ifndef RANGETABLEFILE_H
+#define RANGETABLEFILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "IPRangeTable.h"
+#include "IPvX.h"
+#include "RangeScoreMap.h"
+#include "csv-parser.h"
+#include "types.h"
+
+namespace regban {
+
+// range table compiled from a csv file into a binary one, which is memory-mapped and queried in place: a header
+// identifying the format and the csv file compiled from, the ranges sorted by address family, network and prefix length
+// (to merge the table with others) and the RangeScoreMap of the table alone; in native byte order, so files are only
+// meant to be used on the machine they were compiled on
+class RangeTableFile {
+  public:
+    static constexpr std::uint64_t MAGIC = 0x454c424154474552;  // "REGTABLE" in little-endian byte order
+    static constexpr std::uint32_t VERSION = 1;
+
+    struct Source {
+        std::uint64_t size;
+        std::int64_t mtime;  // in nanoseconds
+    };
+    struct Header {
+        std::uint64_t magic;
+        std::uint32_t version;
+        std::uint32_t record_size;
+        Source source;
+        std::uint64_t range_count;
+    };
+    struct Record {
+        std::uint64_t ip_high;  // ip as inserted
+        std::uint64_t ip_low;
+        Score score;
+        std::uint32_t cidr_suffix;
+    };
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+  public:
+#else
+  protected:
+#endif
+    void* data = MAP_FAILED;
+    std::size_t length = 0;
+    const Header* header = nullptr;
+    const Record* records = nullptr;
+    RangeScoreMap::View map;
+
+    void unmap() {
+        if (data != MAP_FAILED) {
+            munmap(data, length);
+            data = MAP_FAILED;
+        }
+    }
+
+  public:
+    explicit RangeTableFile(const std::string& filename) {
+        const auto fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open '" + filename + "': " + std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            const auto err = errno;
+            close(fd);
+            throw std::runtime_error("Could not stat '" + filename + "': " + std::strerror(err));
+        }
+        length = st.st_size;
+        if (length < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("'" + filename + "' is not a compiled range table");
+        }
+        data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        const auto err = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Could not map '" + filename + "': " + std::strerror(err));
+        }
+        try {
+            const auto* begin = static_cast<const char*>(data);
+            const auto* end = begin + length;
+            header = reinterpret_cast<const Header*>(begin);
+            if (header->magic != MAGIC) {
+                throw std::runtime_error("not a compiled range table");
+            }
+            if (header->version != VERSION || header->record_size != sizeof(Record)) {
+                throw std::runtime_error("compiled by another version");
+            }
+            if ((length - sizeof(Header)) / sizeof(Record) < header->range_count) {
+                throw std::runtime_error("truncated");
+            }
+            records = reinterpret_cast<const Record*>(begin + sizeof(Header));
+            const auto* p = begin + sizeof(Header) + header->range_count * sizeof(Record);
+            map = RangeScoreMap::read(p, end);
+            if (p != end) {
+                throw std::runtime_error("trailing data");
+            }
+        } catch (const std::exception& ex) {
+            unmap();
+            throw std::runtime_error("Could not load '" + filename + "': " + ex.what());
+        }
+    }
+
+    RangeTableFile(const RangeTableFile&) = delete;
+    RangeTableFile& operator=(const RangeTableFile&) = delete;
+
+    RangeTableFile(RangeTableFile&& other) noexcept
+        : data(other.data), length(other.length), header(other.header), records(other.records), map(other.map) {
+        other.data = MAP_FAILED;
+    }
+
+    RangeTableFile& operator=(RangeTableFile&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            data = other.data;
+            length = other.length;
+            header = other.header;
+            records = other.records;
+            map = other.map;
+            other.data = MAP_FAILED;
+        }
+        return *this;
+    }
+
+    ~RangeTableFile() { unmap(); }
+
+    std::size_t size() const { return header->range_count; }
+
+    bool compiled_from(const Source& source) const { return header->source.size == source.size && header->source.mtime == source.mtime; }
+
+    RangeScoreMap::Result lookup(IPvX ip) const { return map.lookup(ip); }
+
+    // for merging with other tables
+    IPRangeTable<Score> table() const {
+        IPRangeTable<Score> res;
+        for (const auto* record = records; record != records + header->range_count; ++record) {
+            const IPvX ip = static_cast<IPvX::Internal>(record->ip_high) << 64 | record->ip_low;
+            res.find_or_insert(ip, record->cidr_suffix).second = record->score;
+        }
+        res.build();
+        return res;
+    }
+
+    static Source source_of(const std::string& filename) {
+        struct stat st;
+        if (stat(filename.c_str(), &st) < 0) {
+            throw std::runtime_error("Could not stat '" + filename + "': " + std::strerror(errno));
+        }
+        return Source{static_cast<std::uint64_t>(st.st_size), static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+    }
+
+    // rows of ip, cidr suffix and score
+    static IPRangeTable<Score> read_csv(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file) {
+            throw std::runtime_error("Could not open '" + filename + "'");
+        }
+        IPRangeTable<Score> res;
+        try {
+            csv::Parser parser(file);
+            do {
+                const auto c = parser.read<std::string, unsigned char, Score>();
+                res.find_or_insert(IPvX::parse(std::get<0>(c).c_str()), std::get<1>(c)).second = std::get<2>(c);
+            } while (parser.next_row());
+        } catch (const csv::parser_exception& ex) {
+            throw std::runtime_error(ex.format());
+        }
+        res.build();
+        return res;
+    }
+
+    // writes to a temporary file first, which then replaces filename, so that running instances keep their mapping
+    static void write(const IPRangeTable<Score>& table, const Source& source, const std::string& filename) {
+        std::vector<Record> sorted;
+        sorted.reserve(table.size());
+        for (const auto& range : table) {
+            const auto ip = static_cast<IPvX::Internal>(range.ip);
+            sorted.push_back(Record{static_cast<std::uint64_t>(ip >> 64), static_cast<std::uint64_t>(ip), range.value, range.cidr_suffix});
+        }
+        std::sort(std::begin(sorted), std::end(sorted), [](const Record& a, const Record& b) {
+            const auto a_ip = IPvX(static_cast<IPvX::Internal>(a.ip_high) << 64 | a.ip_low);
+            const auto b_ip = IPvX(static_cast<IPvX::Internal>(b.ip_high) << 64 | b.ip_low);
+            return std::make_tuple(a_ip.is_ipv6(), a_ip.network(a.cidr_suffix), a.cidr_suffix)
+                   < std::make_tuple(b_ip.is_ipv6(), b_ip.network(b.cidr_suffix), b.cidr_suffix);
+        });
+        RangeScoreMap map;
+        map.build(std::vector<IPRangeTable<Score>>{table});
+
+        const auto tmpfilename = filename + ".tmp";
+        {
+            std::ofstream out(tmpfilename, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Could not open '" + tmpfilename + "' for writing");
+            }
+            const Header h{MAGIC, VERSION, sizeof(Record), source, sorted.size()};
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(reinterpret_cast<const char*>(sorted.data()), sorted.size() * sizeof(Record));
+            map.write(out);
+            out.close();
+            if (!out) {
+                std::remove(tmpfilename.c_str());
+                throw std::runtime_error("Could not write '" + tmpfilename + "'");
+            }
+        }
+        if (std::rename(tmpfilename.c_str(), filename.c_str()) < 0) {
+            const auto err = errno;
+            std::remove(tmpfilename.c_str());
+            throw std::runtime_error("Could not rename '" + tmpfilename + "' to '" + filename + "': " + std::strerror(err));
+        }
+    }
+
+    // returns number of ranges
+    static std::size_t compile(const std::string& csv_filename, const std::string& filename) {
+        const auto source = source_of(csv_filename);
+        const auto table = read_csv(csv_filename);
+        write(table, source, filename);
+        return table.size();
+    }
+};
+
+}  // namespace regban
+
+#endif
@@ -1,22 +1,36 @@
 #ifndef REGBAN_H
 #define REGBAN_H
 
-#include <sys/select.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
-#include <array>
+#include <atomic>
+#include <csignal>
 #include <cstdio>
+#include <exception>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include "IPTable.h"
+#include "BoundedQueue.h"
+#include "EventLoop.h"
+#include "FlatIPTable.h"
+#include "IPRangeTable.h"
 #include "IPvX.h"
+#include "LineBuffer.h"
+#include "LogFile.h"
+#include "PatternMatcher.h"
+#include "RangeScoreMap.h"
+#include "RangeTableFile.h"
 #include "ScoreTable.h"
 #include "SystemBanSet.h"
-#include "csv-parser.h"
+#include "TimerWheel.h"
 #include "settingsnode.h"
 #include "spdlog/spdlog.h"
 #include "types.h"
@@ -26,10 +40,16 @@
 
 namespace regban {
 
-constexpr auto BUFFER_SIZE = 1000;
 constexpr auto IP_REGEXP = "([0-9a-f:\\.]+)";
+constexpr auto IPV4_REGEXP = "([0-9\\.]+)";
+constexpr auto IPV6_REGEXP = "([0-9a-f:\\.]+)";  // may end with embedded IPv4
 
-static std::string fill_template(const std::string& in) {
+enum class IPKind { ANY, IPV4, IPV6 };
+constexpr std::size_t LINE_BATCH_SIZE = 1 << 16;  // bytes of lines handed to a matching thread at once
+constexpr std::size_t MAX_EVICTION_VISITS = 256;  // table entries checked at most to make room for a new one
+constexpr std::uint8_t MAX_USAGE = 3;  // repeated hits counted per entry, i.e. passes of the eviction hand it survives
+
+static std::string fill_template(const std::string& in, IPKind& kind) {
     constexpr const char* beg_mark = "{{";
     constexpr const char* end_mark = "}}";
     std::ostringstream ss;
@@ -45,6 +65,13 @@ static std::string fill_template(const std::string& in) {
         std::string key = in.substr(start, stop - start);
         if (key == "ip") {
             ss << IP_REGEXP;
+            kind = IPKind::ANY;
+        } else if (key == "ipv4") {
+            ss << IPV4_REGEXP;
+            kind = IPKind::IPV4;
+        } else if (key == "ipv6") {
+            ss << IPV6_REGEXP;
+            kind = IPKind::IPV6;
         } else {
             throw std::runtime_error("Unknown template '" + key + "'");
         }
@@ -54,25 +81,52 @@ static std::string fill_template(const std::string& in) {
     return ss.str();
 }
 
+// as a double-quoted YAML scalar
+static std::string yaml_quoted(const std::string& in) {
+    std::ostringstream ss;
+    ss << '"';
+    for (const auto c : in) {
+        if (c == '"' || c == '\\') {
+            ss << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+            static constexpr const char* hex = "0123456789abcdef";
+            ss << "\\x" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        } else {
+            ss << c;
+        }
+    }
+    ss << '"';
+    return ss.str();
+}
+
 class RegBan {
   private:
     struct BanData {
         Time last_scoretime;
-        Time last_bantime;
+        Time banned_until;
         Score score;
+        std::uint8_t usage = 0;  // GCLOCK usage count for eviction
+        TimerWheel<IPvX>::Tick expiry = 0;  // tick of the latest expiry scheduled, 0 if none
     };
     struct Pattern {
-        std::regex pattern;
+        std::regex pattern;  // only used if not supported by PatternMatcher
+        bool compiled;
+        IPKind ip_kind;
         Score score;
         std::string name;
     };
-    struct Process {
+    struct Source {
+        std::string description;
+        LineBuffer buffer;
+        std::vector<Pattern> patterns;
+        PatternMatcher matcher;
+        std::vector<std::size_t> compiled_patterns;  // index into patterns for each pattern in matcher
+        std::uint64_t lines = 0;
+    };
+    struct Process : public Source {
         std::string command;
-        int fd;
+        int fd = -1;
         pid_t pid = 0;
-        std::array<char, BUFFER_SIZE> buf;
-        int bufcount = 0;
-        std::vector<Pattern> patterns;
 
         Process() = default;
         Process(const Process&) = delete;
@@ -116,78 +170,221 @@ class RegBan {
                 }
                 pid = 0;
             }
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
         }
     };
+    struct File : public Source {
+        LogFile logfile;
+
+        explicit File(std::string filename) : logfile(std::move(filename)) {}
+    };
+
+    struct LineBatch {
+        const Source* source = nullptr;
+        Time time;
+        std::string lines;  // each terminated by '\n'
+    };
+    struct Event {
+        enum class Type { MATCH, CLEANUP, FLUSH };
+        Type type;
+        Time time;
+        IPvX ip;
+        const Pattern* pattern;
+    };
 
-    std::vector<IPRangeTable<Score>> rangetables;
-    IPTable<BanData> iptable;
+    RangeScoreMap rangescores;  // all rangetables merged
+    std::unique_ptr<RangeTableFile> rangefile;  // queried instead of rangescores if it is the only rangetable
+    FlatIPTable<BanData> iptable;  // only exact lookups needed
+    TimerWheel<IPvX> expiries{to_tick(std::chrono::system_clock::now())};  // when scores of iptable entries reach zero
+    std::size_t max_ips;  // 0 for unlimited, otherwise entries are evicted to make room for new ones
+    Score protect_score;  // entries with at least this score (and banned ones) are never evicted
+    std::size_t clock_hand = 0;
+    std::atomic<std::uint64_t> evicted_ips{0};
+    std::atomic<std::uint64_t> untracked_ips{0};  // matches of ips not added to full table, as no entry could be evicted
     Score score_decay;
     ScoreTable scoretable;
     SystemBanSet banset;
     unsigned int cleanup_interval;
-    Time last_cleanup;
+    unsigned int ban_batch_delay;  // in milliseconds, 0 to commit each ban on its own
     unsigned int score_decay_interval;
     unsigned int restart_usleep;
+    unsigned int stats_interval;
     bool dry_run;
-    int selfpipe[2];  // for self-pipe trick to cancel select() call
+    volatile std::sig_atomic_t stopped = 0;
+    int selfpipe[2];  // for self-pipe trick to cancel epoll_wait() call
+    EventLoop loop;
     std::shared_ptr<spdlog::logger> logger;
     std::vector<Process> processes;
+    std::vector<File> files;
     bool ipv4_enabled;
     bool ipv6_enabled;
+    unsigned char ipv4_prefix_length;  // ips are scored and banned as networks of these prefix lengths
+    unsigned char ipv6_prefix_length;
+
+    // multi-threaded mode: the event loop only reads lines, matching threads turn them into events,
+    // which are applied to the tables and ban set by a single owner thread
+    // (the event loop is the reader of all sources: their fds are non-blocking, so one source does not hold up the
+    // others, and readers per source would only wait on the same line queue, while the positions of file sources
+    // saved to the state file could no longer be taken consistently with their buffers)
+    unsigned int threads;
+    std::unique_ptr<BoundedQueue<LineBatch>> line_queue;
+    std::unique_ptr<BoundedQueue<Event>> event_queue;
+    std::vector<std::thread> workers;
+    std::thread owner;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    template<typename Function>
+    std::thread start_thread(Function function) {
+        return std::thread([this, function]() {
+            try {
+                (this->*function)();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                line_queue->close();
+                event_queue->close();
+                stop();
+            }
+        });
+    }
+
+    void run_worker() {
+        LineBatch batch;
+        while (line_queue->pop(batch)) {
+            const char* begin = batch.lines.data();
+            const char* const last = begin + batch.lines.size();
+            while (begin < last) {
+                const auto* end = static_cast<const char*>(std::memchr(begin, '\n', last - begin));
+                match_line(*batch.source, begin, end, [&](IPvX ip, const Pattern& pattern) {
+                    event_queue->push(Event{Event::Type::MATCH, batch.time, ip, &pattern});
+                });
+                begin = end + 1;
+            }
+        }
+    }
+
+    void run_owner() {
+        Event event;
+        while (event_queue->pop(event)) {
+            switch (event.type) {
+                case Event::Type::MATCH:
+                    handle_ip(event.ip, event.time, event.pattern->score, event.pattern->name);
+                    break;
+                case Event::Type::CLEANUP:
+                    cleanup(event.time);
+                    break;
+                case Event::Type::FLUSH:
+                    banset.flush();
+                    break;
+            }
+        }
+    }
+
+    void stop_threads() {
+        if (threads == 0) {
+            return;
+        }
+        line_queue->close();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        event_queue->close();
+        if (owner.joinable()) {
+            owner.join();
+        }
+    }
 
   public:
     RegBan(const settings::SettingsNode& settings, bool dry_run_p) : dry_run(dry_run_p) {
         logger = spdlog::default_logger()->clone("RegBan");
 
-        cleanup_interval = settings["cleanupinterval"].as<unsigned int>();
+        if (pipe2(selfpipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            throw std::runtime_error("Could not create pipe: " + std::string(std::strerror(errno)));
+        }
+
+        cleanup_interval = settings["cleanupinterval"].as<unsigned int>(1);
+        if (cleanup_interval == 0) {
+            throw std::runtime_error("cleanupinterval needs to be positive");
+        }
         restart_usleep = settings["restartusleep"].as<unsigned int>(0);
+        stats_interval = settings["statsinterval"].as<unsigned int>(0);
+
+        threads = settings["threads"].as<unsigned int>(0);
+        if (threads > 0) {
+            const auto queue_length = settings["queuelength"].as<std::size_t>(1024);
+            line_queue.reset(new BoundedQueue<LineBatch>(queue_length));
+            event_queue.reset(new BoundedQueue<Event>(queue_length));
+        }
+
+        const auto ipv4_prefix = settings["ipv4prefix"].as<unsigned int>(IPvX::TOTAL_BIT_SIZE_V4);
+        if (ipv4_prefix < 1 || ipv4_prefix > IPvX::TOTAL_BIT_SIZE_V4) {
+            throw std::runtime_error("ipv4prefix needs to be between 1 and 32");
+        }
+        ipv4_prefix_length = ipv4_prefix;
+        const auto ipv6_prefix = settings["ipv6prefix"].as<unsigned int>(64);
+        if (ipv6_prefix < IPvX::MIN_PREFIX_LENGTH_V6 || ipv6_prefix > IPvX::TOTAL_BIT_SIZE_V6) {
+            throw std::runtime_error("ipv6prefix needs to be between 32 and 128");
+        }
+        ipv6_prefix_length = ipv6_prefix;
 
         const auto& nftsettings = settings["nft"];
         ipv4_enabled = nftsettings.has("ipv4set");
         ipv6_enabled = nftsettings.has("ipv6set");
         if (!dry_run) {
             banset.initialize(nftsettings["type"].as<std::string>(), nftsettings["table"].as<std::string>(), nftsettings["ipv4set"].as<std::string>(""),
-                              nftsettings["ipv6set"].as<std::string>(""));
+                              nftsettings["ipv6set"].as<std::string>(""), ipv4_prefix_length, ipv6_prefix_length);
         }
+        ban_batch_delay = nftsettings["batchdelay"].as<unsigned int>(100);
+        banset.set_max_batch_size(ban_batch_delay > 0 ? nftsettings["batchsize"].as<std::size_t>(256) : 1);
 
         for (const auto& processessettings : settings["processes"].as_sequence()) {
             Process& process = *processes.emplace(std::end(processes));
             process.command = processessettings["command"].as<std::string>();
-            const auto& name = processessettings["name"].as<std::string>();
-            for (const auto& patternsettings : processessettings["patterns"].as_sequence()) {
-                const auto p = fill_template(patternsettings["pattern"].as<std::string>());
-                const auto regex = std::regex(p, std::regex::optimize);
-                if (regex.mark_count() != 1) {
-                    throw std::runtime_error("Regexp needs to have exactly one subgroup for " + p);
-                }
-                process.patterns.emplace_back<Pattern>({regex, patternsettings["score"].as<Score>(), patternsettings["name"].as<std::string>(name)});
-            }
+            process.description = process.command;
+            configure_source(process, processessettings, processessettings["name"].as<std::string>());
             process.open_process();
         }
 
+        for (const auto& filesettings : settings["files"].as_sequence()) {
+            const auto& filename = filesettings["filename"].as<std::string>();
+            files.emplace_back(filename);
+            File& file = files.back();
+            file.description = filename;
+            configure_source(file, filesettings, filesettings["name"].as<std::string>(filename));
+        }
+
+        std::vector<IPRangeTable<Score>> rangetables;
+        std::vector<RangeTableFile> rangefiles;
         for (const auto& rangetablesettings : settings["rangetables"].as_sequence()) {
-            IPRangeTable<Score> rangetable;
-            if (rangetablesettings.has("filename")) {
-                const auto& filename = rangetablesettings["filename"].as<std::string>();
-                std::ifstream file(filename);
-                if (!file) {
-                    throw std::runtime_error("Could not open '" + filename + "'");
-                }
-                try {
-                    csv::Parser parser(file);
-                    do {
-                        const auto c = parser.read<std::string, unsigned char, Score>();
-                        rangetable.find_or_insert(IPvX::parse(std::get<0>(c).c_str()), std::get<1>(c)).second = std::get<2>(c);
-                    } while (parser.next_row());
-                } catch (const csv::parser_exception& ex) {
-                    throw std::runtime_error(ex.format());
-                }
+            if (rangetablesettings.has("compiled")) {
+                load_compiled_rangetable(rangetablesettings["compiled"].as<std::string>(), rangetablesettings["filename"].as<std::string>(""), rangetables,
+                                         rangefiles);
+            } else if (rangetablesettings.has("filename")) {
+                rangetables.push_back(RangeTableFile::read_csv(rangetablesettings["filename"].as<std::string>()));
             } else {
+                IPRangeTable<Score> rangetable;
                 for (const auto& it : rangetablesettings["table"].as_sequence()) {
                     rangetable.find_or_insert(IPvX::parse(it["ip"].as<std::string>().c_str()), it["cidr"].as<unsigned>()).second = it["score"].as<Score>();
                 }
+                rangetables.push_back(std::move(rangetable));
             }
-            rangetables.push_back(std::move(rangetable));
+        }
+        if (rangetables.empty() && rangefiles.size() == 1) {
+            rangefile.reset(new RangeTableFile(std::move(rangefiles[0])));
+        } else {
+            for (const auto& file : rangefiles) {
+                rangetables.push_back(file.table());
+            }
+            rangescores.build(rangetables);
         }
 
         const auto& scoressettings = settings["scores"];
@@ -202,9 +399,79 @@ class RegBan {
                 scoretableentry.second["score"].as<Score>(),
             });
         }
+
+        max_ips = settings["maxips"].as<std::size_t>(0);
+        protect_score = settings["protectscore"].as<Score>(scoretable.ban_threshold() / 2);
+        if (max_ips > 0) {
+            iptable.clear_and_reserve(max_ips);
+        }
+    }
+
+    // maps the compiled version of a csv file (if given), which is rebuilt if it is missing, invalid or outdated, falling
+    // back to the csv file itself if it cannot be written
+    void load_compiled_rangetable(const std::string& compiled,
+                                  const std::string& filename,
+                                  std::vector<IPRangeTable<Score>>& rangetables,
+                                  std::vector<RangeTableFile>& rangefiles) {
+        if (filename.empty()) {
+            rangefiles.emplace_back(compiled);
+            return;
+        }
+        const auto source = RangeTableFile::source_of(filename);
+        try {
+            RangeTableFile file(compiled);
+            if (file.compiled_from(source)) {
+                rangefiles.emplace_back(std::move(file));
+                return;
+            }
+            logger->info("Rebuilding {} as {} has changed", compiled, filename);
+        } catch (const std::exception& ex) {
+            logger->info("Rebuilding {} ({})", compiled, ex.what());
+        }
+        auto rangetable = RangeTableFile::read_csv(filename);
+        try {
+            RangeTableFile::write(rangetable, source, compiled);
+            rangefiles.emplace_back(compiled);
+        } catch (const std::exception& ex) {
+            logger->warn("Using {} directly: {}", filename, ex.what());
+            rangetables.push_back(std::move(rangetable));
+        }
+    }
+
+    void configure_source(Source& source, const settings::SettingsNode& sourcesettings, const std::string& name) {
+        source.buffer = LineBuffer(sourcesettings["maxlinelength"].as<std::size_t>(LineBuffer::DEFAULT_MAX_LINE_LENGTH),
+                                   LineBuffer::parse_policy(sourcesettings["overlonglines"].as<std::string>("skip")));
+        for (const auto& patternsettings : sourcesettings["patterns"].as_sequence()) {
+            IPKind ip_kind = IPKind::ANY;
+            const auto p = fill_template(patternsettings["pattern"].as<std::string>(), ip_kind);
+            Pattern pattern{std::regex(), true, ip_kind, patternsettings["score"].as<Score>(), patternsettings["name"].as<std::string>(name)};
+            try {
+                source.matcher.add(p);
+                source.compiled_patterns.push_back(source.patterns.size());
+            } catch (const PatternMatcher::Unsupported& ex) {
+                logger->warn("Using std::regex for {} ({})", p, ex.what());
+                pattern.compiled = false;
+                pattern.pattern = std::regex(p, std::regex::optimize);
+                if (pattern.pattern.mark_count() != 1) {
+                    throw std::runtime_error("Regexp needs to have exactly one subgroup for " + p);
+                }
+            }
+            source.patterns.emplace_back(std::move(pattern));
+        }
+        if (!source.matcher.compile()) {
+            logger->warn("Some patterns for '{}' are too complex for a DFA, matching them will be slower", source.description);
+        }
     }
 
-    ~RegBan() { stop(); }
+    ~RegBan() {
+        for (auto& process : processes) {
+            process.close_process();
+        }
+        close(selfpipe[0]);
+        close(selfpipe[1]);
+    }
+
+    IPvX network_of(IPvX ip) const { return ip.network(ip.is_ipv6() ? ipv6_prefix_length : ipv4_prefix_length); }
 
     void adjust_ip_score(BanData& bandata, Time now) {
         const auto diff = std::chrono::duration_cast<std::chrono::seconds>(now - bandata.last_scoretime).count() * score_decay / score_decay_interval;
@@ -216,21 +483,86 @@ class RegBan {
         bandata.last_scoretime = now;
     }
 
+    static TimerWheel<IPvX>::Tick to_tick(Time time) { return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count(); }
+
+    // tick at which the score of bandata will have decayed to zero, 0 if never
+    TimerWheel<IPvX>::Tick expiry_of(const BanData& bandata) const {
+        const auto last = to_tick(bandata.last_scoretime);
+        if (bandata.score <= 0) {
+            return last;
+        }
+        if (score_decay <= 0) {
+            return 0;
+        }
+        return last + (static_cast<std::int64_t>(bandata.score) * score_decay_interval + score_decay - 1) / score_decay;
+    }
+
+    // to be called whenever the score of an entry has changed; an entry is only rescheduled if its score
+    // reaches zero earlier than before, later expiries are taken care of when the earlier one is due
+    void schedule_expiry(IPvX key, BanData& bandata) {
+        const auto expiry = expiry_of(bandata);
+        if (expiry != 0 && (bandata.expiry == 0 || expiry < bandata.expiry)) {
+            bandata.expiry = expiries.schedule(key, expiry);
+        }
+    }
+
+    // only touches entries whose score is due to have reached zero
     void cleanup(Time now) {
-        std::vector<IPvX> to_remove;
-        for (auto e : iptable) {
-            const auto ip = e.first;
-            auto& bandata = e.second;
-            adjust_ip_score(bandata, now);
-            if (bandata.score <= 0) {
-                to_remove.push_back(ip);
+        std::size_t removed = 0;
+        const auto due = expiries.advance(to_tick(now), [&](IPvX key, TimerWheel<IPvX>::Tick tick) {
+            auto* bandata = iptable.find(key);
+            if (bandata == nullptr || bandata->expiry != tick) {
+                return;  // superseded by an earlier expiry
+            }
+            const auto expiry = expiry_of(*bandata);
+            if (expiry != 0 && expiry <= tick) {
+                iptable.remove(key);
+                ++removed;
+            } else {  // score has been raised since
+                bandata->expiry = 0;
+                schedule_expiry(key, *bandata);
             }
+        });
+        if (due > 0) {
+            logger->debug("Removed {} of {} due ips from table, {} remaining", removed, due, iptable.size());
         }
-        for (const auto ip : to_remove) {
-            iptable.remove(ip);
+        if (!dry_run) {
+            banset.cleanup();
         }
     }
 
+    // all superseded entries of the timer wheel are dropped by rescheduling every table entry
+    void rebuild_expiries() {
+        expiries.clear();
+        for (auto p : iptable) {
+            p.second.expiry = 0;
+            schedule_expiry(p.first, p.second);
+        }
+    }
+
+    // makes room in the table by evicting an entry that has been scored rarely and not recently (GCLOCK: usage counts
+    // are decremented as the hand passes), returns false if none has been found among the next candidates
+    bool evict_ip(Time now) {
+        const auto evicted = iptable.evict(clock_hand, MAX_EVICTION_VISITS, [&](IPvX, BanData& bandata) {
+            if (bandata.score >= protect_score || bandata.banned_until > now) {
+                return false;
+            }
+            if (bandata.usage > 0) {
+                --bandata.usage;
+                return false;
+            }
+            return true;
+        });
+        if (!evicted) {
+            return false;
+        }
+        evicted_ips.fetch_add(1, std::memory_order_relaxed);
+        if (expiries.size() > 2 * max_ips) {
+            rebuild_expiries();
+        }
+        return true;
+    }
+
     void handle_ip(IPvX ip, Time now, Score match_score, const std::string& process_name) {
         if (!ipv4_enabled && !ip.is_ipv6()) {
             logger->debug("Match in {} ({} +{} - -- ipv4 disabled)", process_name, IPvX::Formatter(ip), match_score);
@@ -241,40 +573,47 @@ class RegBan {
             return;
         }
 
-        auto iplookup = iptable.find_or_insert(ip);
+        const auto key = network_of(ip);
+        const bool tracked = max_ips == 0 || iptable.size() < max_ips || iptable.find(key) != nullptr || evict_ip(now);
+        BanData untracked{};  // match is still acted upon, but not remembered
+        if (!tracked) {
+            untracked_ips.fetch_add(1, std::memory_order_relaxed);
+            logger->debug("Not tracking {}, ip table is full", IPvX::Formatter(ip));
+        }
+        auto iplookup = tracked ? iptable.find_or_insert(key) : std::pair<bool, BanData&>(false, untracked);
         bool found = iplookup.first;
         auto& bandata = iplookup.second;
         if (found && bandata.score > 0) {
             adjust_ip_score(bandata, now);
         }
+        if (found && bandata.usage < MAX_USAGE) {  // single-hit entries are evicted first
+            ++bandata.usage;
+        }
         bandata.last_scoretime = now;
         bandata.score += match_score;
 
         if (match_score == 0 || bandata.score <= 0) {
             // unbanning
             bandata.score = 0;
+            bandata.banned_until = Time();
             logger->info("Match in {} ({} {}+0+0~0 -- unbanning)", process_name, IPvX::Formatter(ip), match_score);
             if (!dry_run) {
-                banset.add_ip_to_batch(ip, 0);
-                banset.commit_del_batch();
+                banset.unban(ip);
             }
         } else if (match_score < 0) {
             logger->info("Match in {} ({} {}+0+0~{})", process_name, IPvX::Formatter(ip), match_score, bandata.score);
         } else {
             // banning
-            Score add_score = 0;
-            for (auto& rangetable : rangetables) {
-                const auto rangelookup = rangetable.find_range_for(ip);
-                if (rangelookup.second != nullptr) {
-                    const auto rangescore = *rangelookup.second;
-                    if (rangescore <= 0) {  // ip is always allowed
-                        logger->info("Match in {} ({} {}+0+0~0 -- always allowed)", process_name, IPvX::Formatter(ip), match_score);
-                        bandata.score = 0;
-                        return;
-                    }
-                    add_score += rangescore;
+            const auto range = rangefile ? rangefile->lookup(ip) : rangescores.lookup(ip);
+            if (range.allowed) {
+                logger->info("Match in {} ({} {}+0+0~0 -- always allowed)", process_name, IPvX::Formatter(ip), match_score);
+                bandata.score = 0;
+                if (tracked) {
+                    schedule_expiry(key, bandata);
                 }
+                return;
             }
+            const auto add_score = range.score;
             bandata.score += add_score;
             const auto& tabledata = scoretable.lookup(bandata.score);
             bandata.score += tabledata.add_score;
@@ -282,23 +621,121 @@ class RegBan {
                 logger->info("Match in {} ({} {}+{}+{}~{} -- banning for {}s)", process_name, IPvX::Formatter(ip), match_score, add_score, tabledata.add_score,
                              bandata.score, tabledata.bantime);
                 if (!dry_run) {
-                    banset.add_ip_to_batch(ip, tabledata.bantime);
-                    banset.commit_add_batch();
+                    banset.ban(ip, tabledata.bantime);
                 }
-                bandata.last_bantime = now;
+                bandata.banned_until = now + std::chrono::seconds(tabledata.bantime);
             } else {
                 logger->info("Match in {} ({} {}+{}+{}~{})", process_name, IPvX::Formatter(ip), match_score, add_score, tabledata.add_score, bandata.score);
             }
         }
+        if (tracked) {
+            schedule_expiry(key, bandata);
+        }
+    }
+
+    void watch_process(Process& process) {
+        loop.add(process.fd, [this, &process](std::uint32_t) { check_process(process, std::chrono::system_clock::now()); });
+    }
+
+    // decodes ip directly from the captured part [ip_begin, ip_end) of the line
+    template<typename Callback>
+    void match_ip(const Pattern& pattern, const char* begin, const char* end, const char* ip_begin, const char* ip_end, Callback&& callback) {
+        const spdlog::string_view_t ipstring(ip_begin, ip_end - ip_begin);
+        logger->debug("Found match for line '{}' with ip {}", spdlog::string_view_t(begin, end - begin), ipstring);
+        const auto ip = IPvX::parse(ip_begin, ip_end - ip_begin);
+        if (ip == 0) {
+            logger->error("Could not parse ip from '{}'", ipstring);
+        } else if ((pattern.ip_kind == IPKind::IPV4 && ip.is_ipv6()) || (pattern.ip_kind == IPKind::IPV6 && !ip.is_ipv6())) {
+            logger->debug("Ignoring ip {} of wrong address family", ipstring);
+        } else {
+            callback(ip, pattern);
+        }
+    }
+
+    template<typename Callback>
+    void match_line(const Source& source, const char* begin, const char* end, Callback&& callback) {
+        if (source.compiled_patterns.size() == source.patterns.size()) {
+            source.matcher.match(begin, end, [&](std::size_t index, const char* capture_begin, const char* capture_end) {
+                match_ip(source.patterns[source.compiled_patterns[index]], begin, end, capture_begin, capture_end, callback);
+            });
+            return;
+        }
+        // matches are reported in the configured order of the patterns (e.g. a later unbanning one has to come last),
+        // so those of compiled patterns (reported by the matcher in increasing order) are merged with the others
+        struct CompiledMatch {
+            std::size_t pattern;
+            const char* capture_begin;
+            const char* capture_end;
+        };
+        thread_local std::vector<CompiledMatch> compiled_matches;
+        compiled_matches.clear();
+        source.matcher.match(begin, end, [&](std::size_t index, const char* capture_begin, const char* capture_end) {
+            compiled_matches.push_back(CompiledMatch{source.compiled_patterns[index], capture_begin, capture_end});
+        });
+        auto next = std::begin(compiled_matches);
+        for (std::size_t i = 0; i < source.patterns.size(); ++i) {
+            const auto& pattern = source.patterns[i];
+            if (pattern.compiled) {
+                for (; next != std::end(compiled_matches) && next->pattern == i; ++next) {
+                    match_ip(pattern, begin, end, next->capture_begin, next->capture_end, callback);
+                }
+                continue;
+            }
+            std::cmatch match;
+            if (std::regex_match(begin, end, match, pattern.pattern)) {
+                match_ip(pattern, begin, end, match[1].first, match[1].second, callback);
+            }
+        }
+    }
+
+    // read is called with a line callback and has to return the number of bytes read
+    template<typename Read>
+    std::size_t read_lines(Source& source, Time now, Read&& read) {
+        const auto truncated = source.buffer.truncated_lines();
+        const auto skipped = source.buffer.skipped_lines();
+        LineBatch batch{&source, now, {}};
+        const auto bytes = read([&](const char* begin, const char* end) {
+            ++source.lines;
+            if (!line_queue) {
+                match_line(source, begin, end, [&](IPvX ip, const Pattern& pattern) { handle_ip(ip, now, pattern.score, pattern.name); });
+                return;
+            }
+            batch.lines.append(begin, end);
+            batch.lines.push_back('\n');
+            if (batch.lines.size() >= LINE_BATCH_SIZE) {
+                line_queue->push(std::move(batch));
+                batch = LineBatch{&source, now, {}};
+            }
+        });
+        if (!batch.lines.empty()) {
+            line_queue->push(std::move(batch));
+        }
+        logger->debug("Read {} bytes", bytes);
+        if (source.buffer.truncated_lines() != truncated) {
+            logger->warn("Truncated overlong line from '{}' ({} so far)", source.description, source.buffer.truncated_lines());
+        }
+        if (source.buffer.skipped_lines() != skipped) {
+            logger->warn("Skipped overlong line from '{}' ({} so far)", source.description, source.buffer.skipped_lines());
+        }
+        return bytes;
+    }
+
+    void check_file(File& file, Time now) {
+        read_lines(file, now, [&](auto&& callback) { return file.logfile.check(file.buffer, callback); });
     }
 
     void check_process(Process& process, Time now) {
-        const auto nread = read(process.fd, &process.buf[process.bufcount], process.buf.size() - process.bufcount - 1);
-        if (nread == 0) {
+        LineBuffer::ReadResult res;
+        read_lines(process, now, [&](auto&& callback) {
+            res = process.buffer.read_from(process.fd, callback);
+            return res.bytes;
+        });
+        if (res.eof) {
             int stat;
             if (waitpid(process.pid, &stat, 0) < 0) {
                 throw std::runtime_error("Waiting for pid " + std::to_string(process.pid) + " failed: " + std::strerror(errno));
             }
+            process.pid = 0;
             if (WIFEXITED(stat) | WIFSIGNALED(stat)) {
                 if (WEXITSTATUS(stat) != 0) {
                     throw std::runtime_error("Command '" + process.command + "' failed with rc " + std::to_string(WEXITSTATUS(stat)));
@@ -307,93 +744,191 @@ class RegBan {
                 if (restart_usleep > 0) {
                     usleep(restart_usleep);
                 }
+                loop.remove(process.fd);
+                process.buffer.reset();
                 process.open_process();
+                watch_process(process);
             }
         }
-        logger->debug("Read {} bytes", nread);
-        process.bufcount += nread;
-        process.buf[process.bufcount] = '\0';
-        auto* begin = &process.buf[0];
-        auto* end = begin;
-        while ((end = std::strchr(begin, '\n')) != nullptr) {
-            *end = '\0';
-            if (end > begin && *(end - 1) == '\r') {
-                *(end - 1) = '\0';
-            }
-            for (const auto& pattern : process.patterns) {
-                std::cmatch match;
-                if (std::regex_match(begin, match, pattern.pattern)) {
-                    const auto& submatch = match[1];
-                    logger->debug("Found match for line '{}' with ip {}", begin, submatch.str());
-                    const auto ip = IPvX::parse(submatch.str().c_str());
-                    if (ip > 0) {
-                        handle_ip(ip, now, pattern.score, pattern.name);
-                    } else {
-                        logger->error("Could not parse ip from '{}'", submatch.str());
-                    }
-                }
-            }
-            begin = end + 1;
+    }
+
+    void log_stats(const Source& source) {
+        for (std::size_t i = 0; i < source.compiled_patterns.size(); ++i) {
+            const auto literal = source.matcher.literal(i);
+            const auto candidates = source.matcher.candidates(i);
+            logger->info("Pattern {} of '{}' ({}): {} of {} lines passed prefilter ({:.1f}%), {} matched", source.compiled_patterns[i] + 1, source.description,
+                         literal.empty() ? "no prefilter" : "prefilter '" + literal + "'", candidates, source.lines,
+                         source.lines > 0 ? 100.0 * candidates / source.lines : 0.0, source.matcher.matches(i));
+        }
+    }
+
+    void log_stats() {
+        if (!dry_run) {
+            banset.log_stats();
+        }
+        if (max_ips > 0) {
+            logger->info("{} ips evicted from full ip table (max {}), {} matches of ips not tracked as no entry could be evicted", evicted_ips.load(std::memory_order_relaxed),
+                         max_ips, untracked_ips.load(std::memory_order_relaxed));
+        }
+        for (const auto& process : processes) {
+            log_stats(process);
+        }
+        for (const auto& file : files) {
+            log_stats(file);
         }
-        std::memmove(&process.buf[0], begin, process.bufcount + &process.buf[0] - begin);
-        process.bufcount -= begin - &process.buf[0];
     }
 
     void run() {
-        pipe(selfpipe);
-        last_cleanup = std::chrono::system_clock::now();
-        fd_set fds;
-        while (processes.size() > 0) {
-            FD_ZERO(&fds);
-            auto nfds = selfpipe[0];
-            FD_SET(selfpipe[0], &fds);
-            for (const auto& process : processes) {
-                FD_SET(process.fd, &fds);
-                if (process.fd > nfds) {
-                    nfds = process.fd;
-                }
+        if (processes.empty() && files.empty()) {
+            return;
+        }
+        loop.add(selfpipe[0], [this](std::uint32_t) {
+            char c;
+            while (read(selfpipe[0], &c, 1) > 0) {
             }
-            logger->debug("Waiting for new lines from {} processes...", processes.size());
-            const auto n = select(nfds + 1, &fds, nullptr, nullptr, nullptr);
+        });
+        loop.add_timer(std::chrono::seconds(cleanup_interval), [this]() {
             const auto now = std::chrono::system_clock::now();
-            if (std::chrono::duration_cast<std::chrono::seconds>(now - last_cleanup).count() > cleanup_interval) {
+            if (event_queue) {
+                event_queue->push(Event{Event::Type::CLEANUP, now, 0, nullptr});
+            } else {
                 cleanup(now);
             }
-            if (n <= 0) {
-                if (errno != EINTR) {
-                    throw std::runtime_error(std::string("select() failed: ") + std::strerror(errno));
+        });
+        if (ban_batch_delay > 0 && !dry_run) {
+            loop.add_timer(std::chrono::milliseconds(ban_batch_delay), [this]() {
+                if (event_queue) {
+                    event_queue->push(Event{Event::Type::FLUSH, Time(), 0, nullptr});
+                } else {
+                    banset.flush();
                 }
-                break;
+            });
+        }
+        if (stats_interval > 0) {
+            loop.add_timer(std::chrono::seconds(stats_interval), [this]() { log_stats(); });
+        }
+        for (auto& process : processes) {
+            watch_process(process);
+        }
+        for (auto& file : files) {
+            loop.add(file.logfile.watch_fd(), [this, &file](std::uint32_t) { check_file(file, std::chrono::system_clock::now()); });
+        }
+        if (threads > 0) {
+            logger->info("Matching lines in {} threads", threads);
+            owner = start_thread(&RegBan::run_owner);
+            for (unsigned int i = 0; i < threads; ++i) {
+                workers.emplace_back(start_thread(&RegBan::run_worker));
             }
-            for (auto& process : processes) {
-                if (FD_ISSET(process.fd, &fds) != 0) {
-                    check_process(process, now);
+        }
+        try {
+            for (auto& file : files) {  // catch up after resuming from saved positions
+                check_file(file, std::chrono::system_clock::now());
+            }
+            while (stopped == 0) {
+                logger->debug("Waiting for new lines from {} sources...", processes.size() + files.size());
+                if (!loop.run_once()) {
+                    break;
                 }
             }
+        } catch (...) {
+            stop_threads();
+            throw;
+        }
+        stop_threads();
+        if (!dry_run) {
+            banset.close();
+        }
+        log_stats();
+        if (error) {
+            std::rethrow_exception(error);
         }
     }
 
-    void read_state(const settings::SettingsNode& state) {
+    // bans (by remaining seconds, 0 if ended) are only known from state files recording them
+    void read_ip_state(const settings::SettingsNode& state, std::vector<std::pair<IPvX, unsigned int>>& bans) {
+        const auto now = std::chrono::system_clock::now();
+        std::size_t untracked = 0;
         for (const auto& p : state.as_map()) {
-            auto iplookup = iptable.find_or_insert(IPvX::parse(p.first.c_str()));
-            iplookup.second.last_scoretime = std::chrono::system_clock::from_time_t(p.second["last_scoretime"].as<unsigned long>());
-            iplookup.second.score = p.second["score"].as<Score>();
+            const auto key = network_of(IPvX::parse(p.first.c_str()));
+            // the table is kept within maxips as while running, e.g. if it has been lowered since the state was written
+            const bool tracked = max_ips == 0 || iptable.size() < max_ips || iptable.find(key) != nullptr || evict_ip(now);
+            BanData untracked_bandata{};
+            auto& bandata = tracked ? iptable.find_or_insert(key).second : untracked_bandata;
+            bandata.last_scoretime = std::chrono::system_clock::from_time_t(p.second["last_scoretime"].as<unsigned long>());
+            bandata.score = p.second["score"].as<Score>();
+            if (p.second.has("banned_until")) {  // only written for ips having been banned
+                bandata.banned_until = std::chrono::system_clock::from_time_t(p.second["banned_until"].as<unsigned long>());
+                if (bandata.banned_until != Time() && (key.is_ipv6() ? ipv6_enabled : ipv4_enabled)) {
+                    const auto remaining = std::chrono::duration_cast<std::chrono::seconds>(bandata.banned_until - now).count();
+                    bans.emplace_back(key, bandata.banned_until > now ? std::max<unsigned int>(remaining, 1) : 0);
+                }
+            }
+            if (tracked) {
+                schedule_expiry(key, bandata);
+            } else {
+                ++untracked;
+            }
+        }
+        if (untracked > 0) {
+            logger->warn("Not tracking {} ips from state file, ip table is full (max {})", untracked, max_ips);
+        }
+    }
+
+    // the nft sets are brought in line with the bans of the state file, e.g. after they have been flushed while not running
+    void read_state(const settings::SettingsNode& state) {
+        std::vector<std::pair<IPvX, unsigned int>> bans;
+        if (!state.has("ips") && !state.has("files")) {
+            read_ip_state(state, bans);  // state file written by older version
+            return;
+        }
+        if (state.has("ips")) {
+            read_ip_state(state["ips"], bans);
+            if (!dry_run && !bans.empty()) {
+                banset.reconcile(bans);
+            }
+        }
+        if (state.has("files")) {
+            const auto& filesstate = state["files"];
+            for (auto& file : files) {
+                if (filesstate.has(file.logfile.name())) {
+                    const auto& filestate = filesstate[file.logfile.name()];
+                    file.logfile.resume(filestate["inode"].as<ino_t>(), filestate["offset"].as<off_t>());
+                }
+            }
         }
     }
 
     void write_state(const std::string& filename) {
         std::ofstream o(filename);
-        for (const auto& p : iptable) {
-            o << '"' << p.first << "\":\n  last_scoretime: " << std::chrono::system_clock::to_time_t(p.second.last_scoretime) << "\n  score: " << p.second.score
-              << "\n";
+        if (iptable.size() > 0) {
+            o << "ips:\n";
+            for (const auto& p : iptable) {
+                o << "  \"" << p.first << "\":\n    last_scoretime: " << std::chrono::system_clock::to_time_t(p.second.last_scoretime)
+                  << "\n    score: " << p.second.score << "\n";
+                if (p.second.banned_until != Time()) {
+                    o << "    banned_until: " << std::chrono::system_clock::to_time_t(p.second.banned_until) << "\n";
+                }
+            }
+        }
+        bool files_header = false;
+        for (const auto& file : files) {
+            const auto position = file.logfile.position();
+            if (position.first == 0) {
+                continue;
+            }
+            if (!files_header) {
+                o << "files:\n";
+                files_header = true;
+            }
+            // pending incomplete line is read again on resume
+            const auto offset = std::max<off_t>(0, position.second - static_cast<off_t>(file.buffer.pending()));
+            o << "  " << yaml_quoted(file.logfile.name()) << ":\n    inode: " << position.first << "\n    offset: " << offset << "\n";
         }
     }
 
+    // async-signal-safe, processes are closed on destruction
     void stop() {
-        for (auto& process : processes) {
-            process.close_process();
-        }
-        processes.clear();
+        stopped = 1;
         write(selfpipe[1], "\0", 1);
     }
 };
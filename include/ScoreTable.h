@@ -1,6 +1,7 @@
 #ifndef SCORETABLE_H
 #define SCORETABLE_H
 
+#include <limits>
 #include <vector>
 
 #include "types.h"
@@ -40,6 +41,16 @@ class ScoreTable {
         }
         return *it;
     }
+
+    // lowest score leading to a ban
+    Score ban_threshold() const {
+        for (const auto& e : table) {
+            if (e.bantime > 0) {
+                return e.lower_bound;
+            }
+        }
+        return std::numeric_limits<Score>::max();
+    }
 };
 
 }  // namespace regban
@@ -1,16 +1,30 @@
 #ifndef SYSTEMBANSET_H
 #define SYSTEMBANSET_H
 
+#include <fcntl.h>
 #include <libmnl/libmnl.h>
 #include <libnftnl/set.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <poll.h>
+#include <sys/socket.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "BoundedQueue.h"
+#include "FlatIPTable.h"
 #include "IPvX.h"
 #include "spdlog/spdlog.h"
 
@@ -23,28 +37,125 @@ class SystemBanSet {
   public:
     static constexpr uint32_t KEY_TYPE_IPv4 = 7;  // see nftables/include/datatype.h
     static constexpr uint32_t KEY_TYPE_IPv6 = 8;  // see nftables/include/datatype.h
+    static constexpr std::size_t MAX_ELEMENT_SIZE = 128;  // upper bound of the netlink attributes of one set element
+    static constexpr std::size_t MAX_HEADER_SIZE = 1024;  // upper bound of a message without its elements (names of at most 256 bytes)
+    static constexpr std::size_t MAX_MESSAGE_ELEMENTS = 256;  // keeps the element list of a message well below the 64 KiB attribute limit
+    static constexpr int MAX_SEND_BUFFER_SIZE = 16 << 20;  // requested for the socket, bounding the size of a transaction
+    static constexpr std::size_t KEPT_BUFFER_SIZE = 1 << 20;  // larger send buffers are released after their transaction
+    static constexpr std::size_t MAX_IN_FLIGHT = 8;  // unacknowledged batches
+    static constexpr std::size_t BATCH_QUEUE_SIZE = 64;
+    static constexpr int ACK_TIMEOUT = 5000;  // in milliseconds
+    static constexpr unsigned int RECONCILE_TOLERANCE = 5;  // in seconds, timeouts differing less are left as they are
 
   private:
+    using Clock = std::chrono::steady_clock;  // as used for timeouts by the kernel
+
+    struct Change {
+        bool ban;  // otherwise unban
+        unsigned int timeout;
+    };
+
+    // set elements of one message
+    struct Elements {
+        nftnl_set* ipv4 = nullptr;
+        nftnl_set* ipv6 = nullptr;
+        std::size_t count = 0;
+
+        Elements() = default;
+        Elements(const Elements&) = delete;
+        Elements& operator=(const Elements&) = delete;
+        ~Elements() { clear(); }
+
+        void clear() {
+            if (ipv6 != nullptr) {
+                nftnl_set_free(ipv6);
+                ipv6 = nullptr;
+            }
+            if (ipv4 != nullptr) {
+                nftnl_set_free(ipv4);
+                ipv4 = nullptr;
+            }
+            count = 0;
+        }
+    };
+
+    struct Entry {
+        IPvX network;
+        bool remove;  // from the set, as it is in there
+        bool add;
+        unsigned int timeout;  // if added
+    };
+
+    // changes committed together, each network's ones in the same transaction
+    struct Batch {
+        std::vector<Entry> entries;
+        std::size_t changes = 0;  // pending changes it has been built from
+        bool retry = false;  // of a failed batch, split further if failing again
+    };
+
+    // transaction sent but not acknowledged yet
+    struct InFlight {
+        Batch batch;
+        uint32_t begin_seq;  // of the batch begin message, only acknowledged if the whole batch is rejected
+        uint32_t end_seq;  // of the last message, the only one acknowledged unless failing
+        int error;  // first one received
+    };
+
     uint32_t table_type;
     mnl_socket* nl = nullptr;
-    nftnl_set* current_ipv4_set = nullptr;
-    nftnl_set* current_ipv6_set = nullptr;
     std::shared_ptr<spdlog::logger> logger;
     std::string set_v4_name;
     std::string set_v6_name;
     std::string table_name;
     std::string table_type_name;
     uint32_t portid;
+    unsigned char ipv4_prefix_length = IPvX::TOTAL_BIT_SIZE_V4;
+    unsigned char ipv6_prefix_length = IPvX::TOTAL_BIT_SIZE_V6;
+    FlatIPTable<Change> pending;  // by network, only the last change for each is committed
+    FlatIPTable<Clock::time_point> present;  // networks known to be in the sets by the time they time out
+    std::size_t max_batch_size = 1;
+    std::size_t max_transaction_entries = 1;  // as fitting into the socket's send buffer
+    std::atomic<std::uint64_t> committed_batches{0};
+    std::atomic<std::uint64_t> transactions{0};
+    std::atomic<std::uint64_t> committed_changes{0};
+    std::atomic<std::uint64_t> largest_batch{0};
+    std::atomic<std::uint64_t> skipped_unbans{0};
+    std::atomic<std::uint64_t> retried_batches{0};
+
+    // commits are sent by a writer thread, which keeps up to MAX_IN_FLIGHT batches unacknowledged
+    BoundedQueue<Batch> batches{BATCH_QUEUE_SIZE};
+    std::thread writer;
+    std::mutex writer_error_mutex;
+    std::exception_ptr writer_error;
+    std::deque<InFlight> in_flight;  // only used by writer
+    std::deque<Batch> outgoing;  // transactions of batches taken from the queue, only used by writer
+    // a failed batch is redone before any later one, once all transactions in flight are acknowledged
+    bool recovering = false;  // only used by writer
+    std::vector<Batch> failed;  // in the order sent, only used by writer
+    FlatIPTable<bool> superseded;  // networks changed by batches acknowledged after a failed one, only used by writer
+    std::deque<Batch> retries;  // sent before any later batch, only used by writer
+    uint32_t seq = 0;  // of the next request, only used by the writer once started
+    std::vector<char> send_buffer;  // kept across batches, only used by writer
+    std::vector<char> receive_buffer;
+
+    IPvX network_of(IPvX ip) const { return ip.network(prefix_length_of(ip)); }
+
+    unsigned char prefix_length_of(IPvX ip) const { return ip.is_ipv6() ? ipv6_prefix_length : ipv4_prefix_length; }
+
+    bool is_present(IPvX network, Clock::time_point now) const {
+        const auto* timeout = present.find(network);
+        return timeout != nullptr && *timeout > now;
+    }
 
-    void check_set(const std::string& set_name, uint32_t key_type) {
+    void check_set(const std::string& set_name, uint32_t key_type, bool interval) {
         std::vector<char> buf(MNL_SOCKET_BUFFER_SIZE);
-        uint32_t seq = std::time(nullptr);
+        const auto dump_seq = seq++;
 
         auto* t = nftnl_set_alloc();
         if (t == nullptr) {
             throw std::bad_alloc();
         }
-        auto* nlh = nftnl_set_nlmsg_build_hdr(&buf[0], NFT_MSG_GETSET, table_type, NLM_F_DUMP | NLM_F_ACK, seq);
+        auto* nlh = nftnl_set_nlmsg_build_hdr(&buf[0], NFT_MSG_GETSET, table_type, NLM_F_DUMP | NLM_F_ACK, dump_seq);
         nftnl_set_set_str(t, NFTNL_SET_TABLE, table_name.c_str());
         nftnl_set_set_u32(t, NFTNL_SET_FAMILY, table_type);
         nftnl_set_nlmsg_build_payload(nlh, t);
@@ -57,14 +168,15 @@ class SystemBanSet {
         struct CheckData {
             const std::string& name;
             uint32_t key_type;
+            bool interval;
             std::shared_ptr<spdlog::logger> logger;
             bool found;
         };
-        CheckData data = {set_name, key_type, logger, false};
+        CheckData data = {set_name, key_type, interval, logger, false};
 
         auto ret = mnl_socket_recvfrom(nl, &buf[0], buf.size());
         while (ret > 0) {
-            ret = mnl_cb_run(&buf[0], ret, seq, portid,
+            ret = mnl_cb_run(&buf[0], ret, dump_seq, portid,
                              [](const nlmsghdr* nlh, void* data) {
                                  auto* d = static_cast<CheckData*>(data);
                                  auto* t = nftnl_set_alloc();
@@ -86,7 +198,7 @@ class SystemBanSet {
                                          nftnl_set_free(t);
                                          throw std::runtime_error("nftable set " + d->name + " does not support timeouts");
                                      }
-                                     if (d->key_type == KEY_TYPE_IPv6 && (nftnl_set_get_u32(t, NFTNL_SET_FLAGS) & NFT_SET_INTERVAL) == 0) {
+                                     if (d->interval && (nftnl_set_get_u32(t, NFTNL_SET_FLAGS) & NFT_SET_INTERVAL) == 0) {
                                          nftnl_set_free(t);
                                          throw std::runtime_error("nftable set " + d->name + " does not support intervals");
                                      }
@@ -116,53 +228,442 @@ class SystemBanSet {
         }
     }
 
-    bool run_batch(uint16_t type, uint16_t flags) {
-        std::vector<char> buf(MNL_SOCKET_BUFFER_SIZE);
-        auto* batch = mnl_nlmsg_batch_start(&buf[0], buf.size());
-
-        uint32_t seq = std::time(nullptr);
-        nftnl_batch_begin(static_cast<char*>(mnl_nlmsg_batch_current(batch)), seq++);
-        mnl_nlmsg_batch_next(batch);
-
-        if (current_ipv6_set != nullptr) {
-            logger->debug("Committing ipv6 data");
-            auto* nlh = nftnl_nlmsg_build_hdr(static_cast<char*>(mnl_nlmsg_batch_current(batch)), type, table_type, flags, seq++);
-            nftnl_set_elems_nlmsg_build_payload(nlh, current_ipv6_set);
-            mnl_nlmsg_batch_next(batch);
-        }
+    // remembers the elements already in the set (e.g. from a previous run) as present
+    void load_elements(const std::string& set_name) {
+        std::vector<char> buf(MNL_SOCKET_DUMP_SIZE);
+        const auto dump_seq = seq++;
 
-        if (current_ipv4_set != nullptr) {
-            logger->debug("Committing ipv4 data");
-            auto* nlh = nftnl_nlmsg_build_hdr(static_cast<char*>(mnl_nlmsg_batch_current(batch)), type, table_type, flags, seq++);
-            nftnl_set_elems_nlmsg_build_payload(nlh, current_ipv4_set);
-            mnl_nlmsg_batch_next(batch);
+        auto* t = nftnl_set_alloc();
+        if (t == nullptr) {
+            throw std::bad_alloc();
         }
+        auto* nlh = nftnl_nlmsg_build_hdr(&buf[0], NFT_MSG_GETSETELEM, table_type, NLM_F_DUMP | NLM_F_ACK, dump_seq);
+        nftnl_set_set_str(t, NFTNL_SET_TABLE, table_name.c_str());
+        nftnl_set_set_str(t, NFTNL_SET_NAME, set_name.c_str());
+        nftnl_set_set_u32(t, NFTNL_SET_FAMILY, table_type);
+        nftnl_set_elems_nlmsg_build_payload(nlh, t);
+        nftnl_set_free(t);
 
-        nftnl_batch_end(static_cast<char*>(mnl_nlmsg_batch_current(batch)), seq++);
-        mnl_nlmsg_batch_next(batch);
-
-        if (mnl_socket_sendto(nl, mnl_nlmsg_batch_head(batch), mnl_nlmsg_batch_size(batch)) < 0) {
+        if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
             throw std::runtime_error(std::string("Could not send to mnl socket: ") + std::strerror(errno));
         }
 
-        mnl_nlmsg_batch_stop(batch);
+        struct LoadData {
+            FlatIPTable<Clock::time_point>& present;
+            Clock::time_point now;
+            std::shared_ptr<spdlog::logger> logger;
+        };
+        LoadData data = {present, Clock::now(), logger};
 
         auto ret = mnl_socket_recvfrom(nl, &buf[0], buf.size());
         while (ret > 0) {
-            ret = mnl_cb_run(&buf[0], ret, 0, portid, nullptr, nullptr);
+            ret = mnl_cb_run(&buf[0], ret, dump_seq, portid,
+                             [](const nlmsghdr* nlh, void* data) {
+                                 auto* d = static_cast<LoadData*>(data);
+                                 auto* t = nftnl_set_alloc();
+                                 if (t == nullptr) {
+                                     throw std::bad_alloc();
+                                 }
+
+                                 if (nftnl_set_elems_nlmsg_parse(nlh, t) < 0) {
+                                     d->logger->error("nft message parsing failed");
+                                     nftnl_set_free(t);
+                                     return MNL_CB_OK;
+                                 }
+
+                                 nftnl_set_elem_foreach(
+                                     t,
+                                     [](nftnl_set_elem* e, void* data) {
+                                         auto* d = static_cast<LoadData*>(data);
+                                         if (nftnl_set_elem_is_set(e, NFTNL_SET_ELEM_FLAGS)
+                                             && (nftnl_set_elem_get_u32(e, NFTNL_SET_ELEM_FLAGS) & NFT_SET_ELEM_INTERVAL_END) != 0) {
+                                             return 0;
+                                         }
+                                         uint32_t length = 0;
+                                         const auto* key = static_cast<const unsigned char*>(nftnl_set_elem_get(e, NFTNL_SET_ELEM_KEY, &length));
+                                         if (key == nullptr || (length != 4 && length != 16)) {
+                                             return 0;
+                                         }
+                                         IPvX::Internal ip = 0;
+                                         for (uint32_t i = 0; i < length; ++i) {
+                                             ip = ip << 8 | key[i];
+                                         }
+                                         if (length == 16 && (ip >> (IPvX::TOTAL_BIT_SIZE_V6 - IPvX::MIN_PREFIX_LENGTH_V6)) == 0) {
+                                             return 0;  // in the reserved ::/32, never banned and possibly taken for an ipv4 address
+                                         }
+                                         d->present.find_or_insert(ip).second =
+                                             nftnl_set_elem_is_set(e, NFTNL_SET_ELEM_EXPIRATION)
+                                                 ? d->now + std::chrono::milliseconds(nftnl_set_elem_get_u64(e, NFTNL_SET_ELEM_EXPIRATION))
+                                                 : Clock::time_point::max();
+                                         return 0;
+                                     },
+                                     d);
+
+                                 nftnl_set_free(t);
+                                 return MNL_CB_OK;
+                             },
+                             &data);
             if (ret <= 0) {
                 break;
             }
             ret = mnl_socket_recvfrom(nl, &buf[0], buf.size());
         }
-        return ret != -1;
+        if (ret == -1) {
+            throw std::runtime_error(std::string("Error received from mnl socket: ") + std::strerror(errno));
+        }
+    }
+
+    // end of the interval of a network: the first address after it, or, for the top network of the address space
+    // having none after it, its last address
+    static IPvX key_end(IPvX network, unsigned char prefix_length) {
+        const auto last = network.network_last(prefix_length);
+        const auto max = network.is_ipv6() ? ~static_cast<IPvX::Internal>(0) : static_cast<IPvX::Internal>(~static_cast<IPvX::IPv4>(0));
+        return last == max ? last : network.network_end(prefix_length);
+    }
+
+    void add_element(Elements& elements, IPvX network, unsigned int timeout) {  // timeout in seconds
+        auto* e = nftnl_set_elem_alloc();
+        if (e == nullptr) {
+            throw std::bad_alloc();
+        }
+        nftnl_set** set;
+        if (network.is_ipv6()) {
+            const auto begin = network.byte_representation_v6();
+            nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, &begin[0], begin.size());
+            if (ipv6_prefix_length < IPvX::TOTAL_BIT_SIZE_V6) {
+                const auto end = key_end(network, ipv6_prefix_length).byte_representation_v6();
+                nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY_END, &end[0], end.size());
+            }
+            set = &elements.ipv6;
+        } else {
+            const auto begin = network.byte_representation_v4();
+            nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, &begin[0], begin.size());
+            if (ipv4_prefix_length < IPvX::TOTAL_BIT_SIZE_V4) {
+                const auto end = key_end(network, ipv4_prefix_length).byte_representation_v4();
+                nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY_END, &end[0], end.size());
+            }
+            set = &elements.ipv4;
+        }
+        if (timeout > 0) {
+            nftnl_set_elem_set_u64(e, NFTNL_SET_ELEM_TIMEOUT, static_cast<std::uint64_t>(timeout) * 1000);
+        }
+        if (*set == nullptr) {
+            *set = nftnl_set_alloc();
+            if (*set == nullptr) {
+                nftnl_set_elem_free(e);
+                throw std::bad_alloc();
+            }
+            nftnl_set_set_str(*set, NFTNL_SET_TABLE, table_name.c_str());
+            nftnl_set_set_u32(*set, NFTNL_SET_FAMILY, table_type);
+            if (network.is_ipv6()) {
+                nftnl_set_set_u32(*set, NFTNL_SET_KEY_LEN, 16 * 8);
+                nftnl_set_set_u32(*set, NFTNL_SET_KEY_TYPE, KEY_TYPE_IPv6);
+                nftnl_set_set_str(*set, NFTNL_SET_NAME, set_v6_name.c_str());
+            } else {
+                nftnl_set_set_u32(*set, NFTNL_SET_KEY_LEN, 4 * 8);
+                nftnl_set_set_u32(*set, NFTNL_SET_KEY_TYPE, KEY_TYPE_IPv4);
+                nftnl_set_set_str(*set, NFTNL_SET_NAME, set_v4_name.c_str());
+            }
+        }
+        nftnl_set_elem_add(*set, e);
+        ++elements.count;
+    }
+
+    // upper bound of the size of a transaction of the given number of set elements
+    static std::size_t transaction_size(std::size_t elements) {
+        // besides the batch begin and end, per operation and address family one message might not be filled up
+        return (elements / MAX_MESSAGE_ELEMENTS + 6) * MAX_HEADER_SIZE + elements * MAX_ELEMENT_SIZE;
+    }
+
+    // deletions and additions (in this order) are committed in one transaction in messages of at most
+    // MAX_MESSAGE_ELEMENTS elements
+    void send_transaction(Batch batch) {
+        std::size_t elements = 0;
+        for (const auto& e : batch.entries) {
+            elements += e.remove + e.add;
+        }
+        if (elements == 0) {
+            complete(InFlight{std::move(batch), 0, 0, 0});
+            return;
+        }
+        const auto size = transaction_size(elements);
+        const auto capacity = size + MAX_HEADER_SIZE + MAX_MESSAGE_ELEMENTS * MAX_ELEMENT_SIZE;  // a message is written before checking the limit
+        if (send_buffer.size() < capacity) {
+            send_buffer.resize(capacity);
+        }
+        auto* b = mnl_nlmsg_batch_start(&send_buffer[0], size);
+        const auto next = [b]() {
+            if (!mnl_nlmsg_batch_next(b)) {
+                mnl_nlmsg_batch_stop(b);
+                throw std::runtime_error("nft batch exceeds its buffer");
+            }
+        };
+
+        InFlight f{std::move(batch), seq, 0, 0};
+        nftnl_batch_begin(static_cast<char*>(mnl_nlmsg_batch_current(b)), seq++);
+        next();
+
+        Elements message;
+        nlmsghdr* last = nullptr;
+        const auto add_message = [&](uint16_t type, uint16_t flags) {
+            last = nftnl_nlmsg_build_hdr(static_cast<char*>(mnl_nlmsg_batch_current(b)), type, table_type, flags, seq++);
+            nftnl_set_elems_nlmsg_build_payload(last, message.ipv6 != nullptr ? message.ipv6 : message.ipv4);
+            message.clear();
+            next();
+        };
+        for (const bool add : {false, true}) {
+            const uint16_t type = add ? NFT_MSG_NEWSETELEM : NFT_MSG_DELSETELEM;
+            const uint16_t flags = add ? NLM_F_CREATE | NLM_F_REPLACE : 0;
+            for (const bool ipv6 : {true, false}) {
+                for (const auto& e : f.batch.entries) {
+                    if ((add ? e.add : e.remove) && e.network.is_ipv6() == ipv6) {
+                        add_element(message, e.network, add ? e.timeout : 0);
+                        if (message.count == MAX_MESSAGE_ELEMENTS) {
+                            add_message(type, flags);
+                        }
+                    }
+                }
+                if (message.count > 0) {
+                    add_message(type, flags);
+                }
+            }
+        }
+        // errors are reported for every message, but only the last one is to be acknowledged otherwise
+        last->nlmsg_flags |= NLM_F_ACK;
+        f.end_seq = last->nlmsg_seq;
+
+        nftnl_batch_end(static_cast<char*>(mnl_nlmsg_batch_current(b)), seq++);
+        next();
+
+        const auto res = mnl_socket_sendto(nl, mnl_nlmsg_batch_head(b), mnl_nlmsg_batch_size(b));
+        mnl_nlmsg_batch_stop(b);
+        if (res < 0) {
+            throw std::runtime_error(std::string("Could not send to mnl socket: ") + std::strerror(errno));
+        }
+        if (send_buffer.size() > KEPT_BUFFER_SIZE) {
+            send_buffer.resize(KEPT_BUFFER_SIZE);
+            send_buffer.shrink_to_fit();
+        }
+        transactions.fetch_add(1, std::memory_order_relaxed);
+        in_flight.push_back(std::move(f));
+    }
+
+    // the kernel only takes a transaction as a whole from the socket's send buffer, so larger batches are split
+    void split(Batch batch, std::deque<Batch>& transactions_p) {
+        const auto count = batch.entries.size();
+        if (count <= max_transaction_entries) {
+            transactions_p.push_back(std::move(batch));
+            return;
+        }
+        logger->debug("Committing {} changes in {} transactions", count, (count + max_transaction_entries - 1) / max_transaction_entries);
+        for (std::size_t i = 0; i < count; i += max_transaction_entries) {
+            const auto end = std::min(i + max_transaction_entries, count);
+            Batch part;
+            part.entries.assign(std::begin(batch.entries) + i, std::begin(batch.entries) + end);
+            part.changes = end == count ? batch.changes : 0;
+            part.retry = batch.retry;
+            transactions_p.push_back(std::move(part));
+        }
+    }
+
+    // redoes the failed batches once all later ones sent are acknowledged, leaving out the networks changed by those
+    // applied, and only each network's last change
+    void recover() {
+        Batch retry;
+        retry.retry = true;
+        for (auto it = failed.rbegin(); it != failed.rend(); ++it) {
+            for (const auto& e : it->entries) {
+                if (!superseded.find_or_insert(e.network).first) {
+                    retry.entries.push_back(e);
+                }
+            }
+        }
+        logger->debug("Redoing {} changes of {} failed batches", retry.entries.size(), failed.size());
+        failed.clear();
+        superseded.clear();
+        recovering = false;
+        if (!retry.entries.empty()) {
+            split(std::move(retry), retries);
+        }
+    }
+
+    // redoes a failed retry in halves until finding the networks to delete which are not in the set anymore
+    void bisect(Batch batch) {
+        if (batch.entries.size() == 1) {
+            auto& e = batch.entries.front();
+            if (!e.add) {
+                return;  // network to delete was not in the set anymore
+            }
+            e.remove = false;
+            retries.push_back(std::move(batch));
+            return;
+        }
+        Batch second;
+        second.retry = true;
+        second.entries.assign(std::begin(batch.entries) + batch.entries.size() / 2, std::end(batch.entries));
+        batch.entries.resize(batch.entries.size() / 2);
+        retries.push_back(std::move(batch));
+        retries.push_back(std::move(second));
+    }
+
+    void complete(InFlight f) {
+        const auto changes = f.batch.changes;
+        const auto& entries = f.batch.entries;
+        if (f.error == ENOENT && std::any_of(std::begin(entries), std::end(entries), [](const Entry& e) { return e.remove; })) {
+            // (some of) the networks to delete were not in the set anymore, e.g. as they have just timed out, which
+            // fails the whole transaction
+            if (f.batch.retry) {
+                bisect(std::move(f.batch));
+            } else {
+                logger->debug("Networks to delete not found, redoing batch");
+                retried_batches.fetch_add(1, std::memory_order_relaxed);
+                recovering = true;
+                failed.push_back(std::move(f.batch));
+            }
+        } else {
+            switch (f.error) {
+                case 0:
+                    if (recovering && !f.batch.retry) {
+                        for (const auto& e : entries) {
+                            superseded.find_or_insert(e.network);
+                        }
+                    }
+                    break;
+                case ENOENT:
+                    throw std::runtime_error("nftable or set not found");
+                case EEXIST:
+                    logger->error("ip already in table");
+                    break;
+                default:
+                    throw std::runtime_error(std::string("Error received from mnl socket: ") + std::strerror(f.error));
+            }
+        }
+        if (changes > 0) {
+            committed_batches.fetch_add(1, std::memory_order_relaxed);
+            committed_changes.fetch_add(changes, std::memory_order_relaxed);
+            if (changes > largest_batch.load(std::memory_order_relaxed)) {
+                largest_batch.store(changes, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void handle_ack(uint32_t ack_seq, int error) {
+        for (auto it = std::begin(in_flight); it != std::end(in_flight); ++it) {
+            if (ack_seq - it->begin_seq <= it->end_seq - it->begin_seq) {
+                if (it->error == 0) {
+                    it->error = error;
+                }
+                // the whole transaction is either rejected or its last message acknowledged after all errors
+                if (ack_seq == it->begin_seq || ack_seq == it->end_seq) {
+                    auto f = std::move(*it);
+                    in_flight.erase(it);
+                    complete(std::move(f));
+                }
+                return;
+            }
+        }
+        logger->warn("Unexpected acknowledgement with sequence number {}", ack_seq);
+    }
+
+    // waits for acknowledgements and reads all available ones
+    void receive_acks() {
+        pollfd pfd{mnl_socket_get_fd(nl), POLLIN, 0};
+        const auto n = poll(&pfd, 1, ACK_TIMEOUT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                return;
+            }
+            throw std::runtime_error(std::string("Could not poll mnl socket: ") + std::strerror(errno));
+        }
+        if (n == 0) {
+            throw std::runtime_error("No acknowledgement received for nft batch");
+        }
+        while (!in_flight.empty()) {
+            const auto ret = mnl_socket_recvfrom(nl, &receive_buffer[0], receive_buffer.size());
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("Could not receive from mnl socket: ") + std::strerror(errno));
+            }
+            int length = ret;
+            for (const auto* nlh = reinterpret_cast<const nlmsghdr*>(&receive_buffer[0]); mnl_nlmsg_ok(nlh, length); nlh = mnl_nlmsg_next(nlh, &length)) {
+                if (nlh->nlmsg_type == NLMSG_ERROR) {
+                    handle_ack(nlh->nlmsg_seq, -static_cast<const nlmsgerr*>(mnl_nlmsg_get_payload(nlh))->error);
+                }
+            }
+        }
+    }
+
+    // whether later batches have to wait for failed ones to be redone
+    bool redoing() const {
+        return recovering || !retries.empty() || std::any_of(std::begin(in_flight), std::end(in_flight), [](const InFlight& f) { return f.batch.retry; });
+    }
+
+    // the kernel applies batches as they are sent, so several ones are sent before their acknowledgements are read
+    void run_writer() {
+        bool open = true;
+        while (true) {
+            if (recovering && in_flight.empty()) {
+                recover();
+            }
+            while (in_flight.size() < MAX_IN_FLIGHT) {
+                auto& next = redoing() ? retries : outgoing;
+                if (next.empty()) {
+                    if (&next == &retries || !open) {
+                        break;
+                    }
+                    Batch batch;
+                    if (in_flight.empty()) {
+                        if (!batches.pop(batch)) {
+                            open = false;  // closed and drained
+                            break;
+                        }
+                    } else if (!batches.try_pop(batch)) {
+                        break;
+                    }
+                    split(std::move(batch), outgoing);
+                    continue;
+                }
+                auto batch = std::move(next.front());
+                next.pop_front();
+                send_transaction(std::move(batch));
+            }
+            if (!in_flight.empty()) {
+                receive_acks();
+            } else if (!open && retries.empty() && outgoing.empty()) {
+                break;
+            }
+        }
+    }
+
+    void rethrow_writer_error() {
+        std::lock_guard<std::mutex> lock(writer_error_mutex);
+        if (writer_error) {
+            std::rethrow_exception(writer_error);
+        }
     }
 
   public:
     SystemBanSet() { logger = spdlog::default_logger()->clone("SystemBanSet"); }
 
-    void initialize(std::string table_type_name_p, std::string table_name_p, std::string set_v4_name_p, std::string set_v6_name_p) {
+    // ips are banned as networks of the given prefix lengths, which need interval sets unless covering single addresses
+    void initialize(std::string table_type_name_p,
+                    std::string table_name_p,
+                    std::string set_v4_name_p,
+                    std::string set_v6_name_p,
+                    unsigned char ipv4_prefix_length_p,
+                    unsigned char ipv6_prefix_length_p) {
         logger->debug("Initializing");
+        if (ipv4_prefix_length_p < 1 || ipv4_prefix_length_p > IPvX::TOTAL_BIT_SIZE_V4 || ipv6_prefix_length_p < IPvX::MIN_PREFIX_LENGTH_V6
+            || ipv6_prefix_length_p > IPvX::TOTAL_BIT_SIZE_V6) {
+            throw std::runtime_error("Invalid prefix lengths");
+        }
+        ipv4_prefix_length = ipv4_prefix_length_p;
+        ipv6_prefix_length = ipv6_prefix_length_p;
         table_name = std::move(table_name_p);
         table_type_name = std::move(table_type_name_p);
         if (table_type_name == "inet") {
@@ -194,126 +695,195 @@ class SystemBanSet {
             throw std::runtime_error(std::string("Could not bind to mnl socket: ") + std::strerror(errno));
         }
         portid = mnl_socket_get_portid(nl);
+        seq = std::time(nullptr);
 
         if (!set_v4_name.empty()) {
             logger->debug("Checking set {} of ipv4 type", set_v4_name);
-            check_set(set_v4_name, KEY_TYPE_IPv4);
+            check_set(set_v4_name, KEY_TYPE_IPv4, ipv4_prefix_length < IPvX::TOTAL_BIT_SIZE_V4);
+            load_elements(set_v4_name);
         }
         if (!set_v6_name.empty()) {
             logger->debug("Checking set {} of ipv6 type", set_v6_name);
-            check_set(set_v6_name, KEY_TYPE_IPv6);
+            check_set(set_v6_name, KEY_TYPE_IPv6, ipv6_prefix_length < IPvX::TOTAL_BIT_SIZE_V6);
+            load_elements(set_v6_name);
+        }
+        if (present.size() > 0) {
+            logger->info("{} networks already banned", present.size());
+        }
+
+        // acknowledgements are only read by the writer as they are available
+        const auto fd = mnl_socket_get_fd(nl);
+        const auto fl = fcntl(fd, F_GETFL);
+        if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+            throw std::runtime_error(std::string("Could not make mnl socket non-blocking: ") + std::strerror(errno));
         }
+        int on = 1;
+        mnl_socket_setsockopt(nl, NETLINK_CAP_ACK, &on, sizeof(on));  // errors without the failed message, if supported
+
+        // transactions are bounded by the send buffer, which is enlarged beyond net.core.wmem_max if permitted
+        int sndbuf = MAX_SEND_BUFFER_SIZE;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) < 0) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        }
+        socklen_t sndbuf_length = sizeof(sndbuf);
+        if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_length) < 0) {
+            throw std::runtime_error(std::string("Could not get send buffer size of mnl socket: ") + std::strerror(errno));
+        }
+        // the kernel rejects messages larger than the send buffer less 32 bytes, and an entry has up to two elements
+        const auto usable = static_cast<std::size_t>(sndbuf) - 32;
+        max_transaction_entries = usable > transaction_size(0) + 2 * (MAX_ELEMENT_SIZE + MAX_HEADER_SIZE / MAX_MESSAGE_ELEMENTS)
+                                      ? (usable - transaction_size(0)) / (2 * (MAX_ELEMENT_SIZE + MAX_HEADER_SIZE / MAX_MESSAGE_ELEMENTS))
+                                      : 1;
+        logger->debug("Committing up to {} changes per transaction", max_transaction_entries);
+
+        send_buffer.resize(MNL_SOCKET_BUFFER_SIZE);
+        receive_buffer.resize(MNL_SOCKET_BUFFER_SIZE + MAX_HEADER_SIZE + MAX_MESSAGE_ELEMENTS * MAX_ELEMENT_SIZE);  // errors might include the failed message
+        writer = std::thread([this]() {
+            try {
+                run_writer();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(writer_error_mutex);
+                    writer_error = std::current_exception();
+                }
+                batches.close();
+            }
+        });
     }
 
     ~SystemBanSet() {
+        if (writer.joinable()) {
+            batches.close();
+            writer.join();
+        }
         if (nl != nullptr) {
             mnl_socket_close(nl);
         }
-        if (current_ipv6_set != nullptr) {
-            nftnl_set_free(current_ipv6_set);
-        }
-        if (current_ipv4_set != nullptr) {
-            nftnl_set_free(current_ipv4_set);
+    }
+
+    // queued changes are committed together once max_batch_size_p of them are pending (or on flush())
+    void set_max_batch_size(std::size_t max_batch_size_p) {
+        max_batch_size = max_batch_size_p > 0 ? max_batch_size_p : 1;
+        pending.clear_and_reserve(max_batch_size);
+    }
+
+    std::size_t pending_changes() const { return pending.size(); }
+
+    void ban(IPvX ip, unsigned int timeout) {
+        auto& change = pending.find_or_insert(network_of(ip)).second;
+        change.ban = true;
+        change.timeout = timeout;
+        if (pending.size() >= max_batch_size) {
+            flush();
         }
     }
 
-    void add_ip_to_batch(IPvX ip, unsigned int timeout) {  // timeout in seconds
-        auto* e = nftnl_set_elem_alloc();
-        if (e == nullptr) {
-            throw std::bad_alloc();
+    void unban(IPvX ip) {
+        const auto network = network_of(ip);
+        auto* change = pending.find(network);
+        if (change == nullptr) {
+            if (!is_present(network, Clock::now())) {
+                skipped_unbans.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            change = &pending.find_or_insert(network).second;
         }
-        nftnl_set* current_set;
-        if (ip.is_ipv6()) {
-            logger->debug("Adding ipv6 {} timeout {}s", IPvX::Formatter(ip), timeout * 1000);
-            const auto begin = ip.byte_representation_v6();
-            const auto end = IPvX(ip + 1).byte_representation_v6();
-            nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, &begin[0], begin.size());
-            nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY_END, &end[0], end.size());
-            current_set = current_ipv6_set;
-        } else {
-            logger->debug("Adding ipv4 {} timeout {}s", IPvX::Formatter(ip), timeout * 1000);
-            const auto d = ip.byte_representation_v4();
-            nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, &d[0], d.size());
-            current_set = current_ipv4_set;
+        change->ban = false;
+        if (pending.size() >= max_batch_size) {
+            flush();
         }
-        if (timeout > 0) {
-            nftnl_set_elem_set_u64(e, NFTNL_SET_ELEM_TIMEOUT, timeout * 1000);
+    }
+
+    // commits all pending changes together, in one transaction unless too many: networks already in the set are deleted (and, to refresh their
+    // timeout, added again in the same transaction, so that they are never missing from the set in between)
+    void flush() {
+        rethrow_writer_error();
+        if (pending.size() == 0) {
+            return;
         }
-        if (current_set == nullptr) {
-            logger->debug("Allocating new set data");
-            current_set = nftnl_set_alloc();
-            if (current_set == nullptr) {
-                throw std::bad_alloc();
+        logger->debug("Committing {} changes", pending.size());
+        const auto now = Clock::now();
+
+        Batch batch;
+        batch.changes = pending.size();
+        batch.entries.reserve(pending.size());
+        present.reserve(present.size() + pending.size());
+        for (const auto& p : pending) {
+            const bool in_set = is_present(p.first, now);
+            if (p.second.ban) {
+                logger->debug("{} {}/{} timeout {}s", in_set ? "Refreshing" : "Adding", IPvX::Formatter(p.first), static_cast<int>(prefix_length_of(p.first)),
+                              p.second.timeout);
+            } else {
+                logger->debug("Deleting {}/{}", IPvX::Formatter(p.first), static_cast<int>(prefix_length_of(p.first)));
             }
-            nftnl_set_set_str(current_set, NFTNL_SET_TABLE, table_name.c_str());
-            nftnl_set_set_u32(current_set, NFTNL_SET_FAMILY, table_type);
-            if (ip.is_ipv6()) {
-                nftnl_set_set_u32(current_set, NFTNL_SET_KEY_LEN, 16 * 8);
-                nftnl_set_set_u32(current_set, NFTNL_SET_KEY_TYPE, KEY_TYPE_IPv6);
-                nftnl_set_set_str(current_set, NFTNL_SET_NAME, set_v6_name.c_str());
-                current_ipv6_set = current_set;
+            if (in_set || p.second.ban) {
+                batch.entries.push_back(Entry{p.first, in_set, p.second.ban, p.second.timeout});
+            }
+            if (p.second.ban) {
+                present.find_or_insert(p.first).second = p.second.timeout > 0 ? now + std::chrono::seconds(p.second.timeout) : Clock::time_point::max();
             } else {
-                nftnl_set_set_u32(current_set, NFTNL_SET_KEY_LEN, 4 * 8);
-                nftnl_set_set_u32(current_set, NFTNL_SET_KEY_TYPE, KEY_TYPE_IPv4);
-                nftnl_set_set_str(current_set, NFTNL_SET_NAME, set_v4_name.c_str());
-                current_ipv4_set = current_set;
+                present.remove(p.first);
             }
         }
-        nftnl_set_elem_add(current_set, e);
-    }
-
-    void commit_add_batch() {
-        logger->debug("Committing add batch");
+        pending.clear_and_reserve(max_batch_size);
 
-        if (current_ipv4_set == nullptr && current_ipv6_set == nullptr) {
-            logger->debug("Empty commit, ignoring");
-            return;
-        }
-
-        run_batch(NFT_MSG_DELSETELEM, NLM_F_ACK);
-
-        bool res = run_batch(NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK);
-
-        if (current_ipv6_set != nullptr) {
-            nftnl_set_free(current_ipv6_set);
-            current_ipv6_set = nullptr;
-        }
-        if (current_ipv4_set != nullptr) {
-            nftnl_set_free(current_ipv4_set);
-            current_ipv4_set = nullptr;
+        if (!batches.push(std::move(batch))) {
+            rethrow_writer_error();
+            throw std::runtime_error("nft writer has been stopped");
         }
+    }
 
-        if (!res) {
-            switch (errno) {
-                case EEXIST:
-                    logger->error("ip already in table");
-                    break;
-                case ENOENT:
-                    throw std::runtime_error("nftable or set not found");
-                default:
-                    throw std::runtime_error(std::string("Error received from mnl socket: ") + std::strerror(errno));
+    // brings the sets in line with bans given by network and remaining time (0 if ended), e.g. as restored from a
+    // state file after a restart: networks missing from the sets or timing out too early are banned again, networks
+    // still in the sets although their ban has ended are unbanned, all together in as few transactions as possible;
+    // networks not given are left alone; returns number of changes
+    std::size_t reconcile(const std::vector<std::pair<IPvX, unsigned int>>& bans) {
+        const auto now = Clock::now();
+        const auto tolerance = std::chrono::seconds(RECONCILE_TOLERANCE);
+        std::size_t additions = 0;
+        std::size_t unbans = 0;
+        pending.reserve(pending.size() + bans.size());
+        for (const auto& b : bans) {
+            const auto network = network_of(b.first);
+            const auto* timeout = present.find(network);
+            const bool in_set = timeout != nullptr && *timeout > now;
+            if (b.second > 0) {
+                if (!in_set || *timeout + tolerance < now + std::chrono::seconds(b.second)) {
+                    pending.find_or_insert(network).second = Change{true, b.second};
+                    ++additions;
+                }
+            } else if (in_set && *timeout > now + tolerance) {
+                pending.find_or_insert(network).second = Change{false, 0};
+                ++unbans;
             }
         }
+        logger->info("Reconciling {} bans with the sets: {} to ban, {} to unban", bans.size(), additions, unbans);
+        flush();
+        return additions + unbans;
     }
 
-    void commit_del_batch() {
-        logger->debug("Committing del batch");
-
-        if (current_ipv4_set == nullptr && current_ipv6_set == nullptr) {
-            logger->debug("Empty commit, ignoring");
-            return;
+    // commits pending changes and waits for all batches to be acknowledged
+    void close() {
+        flush();
+        if (writer.joinable()) {
+            batches.close();
+            writer.join();
         }
+        rethrow_writer_error();
+    }
 
-        run_batch(NFT_MSG_DELSETELEM, NLM_F_ACK);
+    // forgets networks which have timed out
+    void cleanup() {
+        const auto now = Clock::now();
+        present.erase_if([now](IPvX /* network */, Clock::time_point timeout) { return timeout <= now; });
+    }
 
-        if (current_ipv6_set != nullptr) {
-            nftnl_set_free(current_ipv6_set);
-            current_ipv6_set = nullptr;
-        }
-        if (current_ipv4_set != nullptr) {
-            nftnl_set_free(current_ipv4_set);
-            current_ipv4_set = nullptr;
-        }
+    void log_stats() const {
+        const auto count = committed_batches.load(std::memory_order_relaxed);
+        const auto changes = committed_changes.load(std::memory_order_relaxed);
+        logger->info("{} ban changes committed in {} batches (average {:.1f}, largest {}, {} retried) and {} transactions, {} unbans of networks not banned skipped",
+                     changes, count, count > 0 ? static_cast<double>(changes) / count : 0.0, largest_batch.load(std::memory_order_relaxed),
+                     retried_batches.load(std::memory_order_relaxed), transactions.load(std::memory_order_relaxed), skipped_unbans.load(std::memory_order_relaxed));
     }
 };
 }  // namespace regban
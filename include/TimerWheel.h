@@ -0,0 +1,152 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace regban {
+
+// hierarchical timing wheel of keys due at whole ticks (e.g. seconds): level l has SLOTS slots of SLOTS^l ticks each,
+// entries are placed in the lowest level that still distinguishes their tick from the current one and move down a level
+// whenever the current tick reaches their slot, so advancing only touches due entries and those being cascaded
+template<typename Key>
+class TimerWheel {
+  public:
+    using Tick = std::uint64_t;
+
+    static constexpr unsigned int SLOT_BITS = 6;
+    static constexpr unsigned int SLOTS = 1 << SLOT_BITS;
+    static constexpr unsigned int LEVELS = 4;  // 2^24 ticks, later entries are kept in overflow until then
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+  public:
+#else
+  protected:
+#endif
+    struct Entry {
+        Key key;
+        Tick tick;
+    };
+    struct Level {
+        std::uint64_t occupied = 0;  // one bit per non-empty slot
+        std::vector<Entry> slots[SLOTS];
+    };
+
+    Level levels[LEVELS];
+    std::vector<Entry> overflow;
+    Tick current;
+    std::size_t size_m = 0;
+
+    static unsigned int digit(Tick tick, unsigned int level) { return (tick >> (level * SLOT_BITS)) & (SLOTS - 1); }
+
+    // entry.tick has to be >= current
+    void place(Entry&& entry) {
+        const auto differing = entry.tick ^ current;
+        unsigned int level = 0;
+        while (level < LEVELS && (differing >> ((level + 1) * SLOT_BITS)) != 0) {
+            ++level;
+        }
+        if (level == LEVELS) {
+            overflow.emplace_back(std::move(entry));
+            return;
+        }
+        const auto slot = digit(entry.tick, level);
+        levels[level].occupied |= std::uint64_t(1) << slot;
+        levels[level].slots[slot].emplace_back(std::move(entry));
+    }
+
+    std::vector<Entry> take(unsigned int level, unsigned int slot) {
+        std::vector<Entry> res;
+        std::swap(res, levels[level].slots[slot]);
+        levels[level].occupied &= ~(std::uint64_t(1) << slot);
+        return res;
+    }
+
+    // next tick after current at which a slot has to be cascaded or fired
+    Tick next_event() const {
+        Tick res = ((current >> (LEVELS * SLOT_BITS)) + 1) << (LEVELS * SLOT_BITS);
+        if (overflow.empty()) {
+            res = ~Tick(0);
+        }
+        for (unsigned int level = 0; level < LEVELS; ++level) {
+            // all entries of a level are in slots after the current one
+            const auto later = levels[level].occupied & ~((std::uint64_t(2) << digit(current, level)) - 1);
+            if (later != 0) {
+                const auto shift = (level + 1) * SLOT_BITS;
+                const auto tick = ((current >> shift) << shift) + (Tick(__builtin_ctzll(later)) << (level * SLOT_BITS));
+                if (tick < res) {
+                    res = tick;
+                }
+            }
+        }
+        return res;
+    }
+
+  public:
+    explicit TimerWheel(Tick start) : current(start) {}
+
+    std::size_t size() const { return size_m; }
+    Tick now() const { return current; }
+
+    void clear() {
+        for (auto& level : levels) {
+            for (auto& slot : level.slots) {
+                slot.clear();
+            }
+            level.occupied = 0;
+        }
+        overflow.clear();
+        size_m = 0;
+    }
+
+    // ticks that have already passed are due with the next one, returns the tick the entry is due at
+    Tick schedule(Key key, Tick tick) {
+        if (tick <= current) {
+            tick = current + 1;
+        }
+        place(Entry{std::move(key), tick});
+        ++size_m;
+        return tick;
+    }
+
+    // calls callback(key, tick) for all entries due until (including) tick, which may schedule new ones;
+    // returns number of entries due
+    template<typename Callback>
+    std::size_t advance(Tick tick, Callback&& callback) {
+        std::size_t res = 0;
+        while (current < tick) {
+            const auto next = next_event();
+            if (next > tick) {
+                current = tick;
+                break;
+            }
+            current = next;
+            if ((current & ((Tick(1) << (LEVELS * SLOT_BITS)) - 1)) == 0) {
+                auto entries = std::move(overflow);
+                overflow.clear();
+                for (auto& entry : entries) {
+                    place(std::move(entry));
+                }
+            }
+            for (unsigned int level = LEVELS - 1; level > 0; --level) {
+                if ((current & ((Tick(1) << (level * SLOT_BITS)) - 1)) == 0) {
+                    for (auto& entry : take(level, digit(current, level))) {
+                        place(std::move(entry));
+                    }
+                }
+            }
+            const auto due = take(0, digit(current, 0));
+            size_m -= due.size();
+            res += due.size();
+            for (const auto& entry : due) {
+                callback(entry.key, entry.tick);
+            }
+        }
+        return res;
+    }
+};
+
+}  // namespace regban
+
+#endif
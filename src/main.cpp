@@ -30,11 +30,11 @@ static int run(const settings::SettingsNode& settings, bool dry_run) {
             spdlog::set_pattern(logsettings["pattern"].as<std::string>());
         }
         if (logsettings.has("filename")) {
-            logger = spdlog::basic_logger_st("main", logsettings["filename"].as<std::string>());
+            logger = spdlog::basic_logger_mt("main", logsettings["filename"].as<std::string>());
         }
     }
     if (!logger) {
-        logger = spdlog::stdout_color_st("main");
+        logger = spdlog::stdout_color_mt("main");
     }
     spdlog::set_default_logger(logger);
 
@@ -89,6 +89,8 @@ static void print_usage(const char* program_name) {
               << program_name
               << " (<option> | <settingsfile>)\n"
                  "Options:\n"
+                 "      --compile-rangetable <csvfile> <outfile>\n"
+                 "                 Compile rangetable for the 'compiled' setting\n"
               << (regban::has_diff ? "      --diff     Print git diff output from compilation\n" : "") << "  -d, --dry-run  Dry run\n"
               << "  -h, --help     Print this help text\n"
                  "  -v, --version  Print version"
@@ -111,6 +113,20 @@ int main(int argc, char* argv[]) {
             std::cout << regban::git_diff << std::flush;
             return 0;
         }
+        if (arg == "--compile-rangetable") {
+            if (argc != 4) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            try {
+                const auto count = regban::RangeTableFile::compile(argv[2], argv[3]);
+                std::cout << "Compiled " << count << " ranges" << std::endl;
+                return 0;
+            } catch (const std::exception& ex) {
+                std::cerr << ex.what() << std::endl;
+                return 255;
+            }
+        }
         if (arg == "--help" || arg == "-h") {
             print_usage(argv[0]);
             return 0;
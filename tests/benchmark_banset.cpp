@@ -0,0 +1,168 @@
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+namespace nanobench = ankerl::nanobench;
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/set.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "IPvX.h"
+#include "SystemBanSet.h"
+
+using regban::IPvX;
+
+// mock netlink endpoint standing in for the kernel: libmnl's socket functions are replaced by ones answering the set
+// checks with two sets ("ban4" and "ban6") and acknowledging transactions as requested, replies are passed through a
+// datagram socket pair, so that the socket options and polling of SystemBanSet work as usual
+namespace {
+struct Endpoint {
+    int fds[2] = {-1, -1};  // read by SystemBanSet, written by the endpoint
+    std::uint64_t transactions = 0;
+
+    void reply(const std::vector<char>& buf, std::size_t size) {
+        if (send(fds[1], &buf[0], size, 0) < 0) {
+            throw std::runtime_error("Could not send reply of mock netlink endpoint");
+        }
+    }
+
+    void reply_ack(const nlmsghdr* req, int error) {
+        std::vector<char> buf(MNL_SOCKET_BUFFER_SIZE);
+        auto* nlh = mnl_nlmsg_put_header(&buf[0]);
+        nlh->nlmsg_type = NLMSG_ERROR;
+        nlh->nlmsg_seq = req->nlmsg_seq;
+        auto* err = static_cast<nlmsgerr*>(mnl_nlmsg_put_extra_header(nlh, sizeof(nlmsgerr)));
+        err->error = -error;
+        err->msg = *req;
+        reply(buf, nlh->nlmsg_len);
+    }
+
+    void reply_sets(const nlmsghdr* req) {
+        std::vector<char> buf(MNL_SOCKET_BUFFER_SIZE);
+        auto* batch = mnl_nlmsg_batch_start(&buf[0], buf.size() / 2);
+        for (const bool ipv6 : {false, true}) {
+            auto* t = nftnl_set_alloc();
+            nftnl_set_set_str(t, NFTNL_SET_TABLE, "filter");
+            nftnl_set_set_str(t, NFTNL_SET_NAME, ipv6 ? "ban6" : "ban4");
+            nftnl_set_set_u32(t, NFTNL_SET_FAMILY, NFPROTO_INET);
+            nftnl_set_set_u32(t, NFTNL_SET_FLAGS, NFT_SET_TIMEOUT | NFT_SET_INTERVAL);
+            nftnl_set_set_u32(t, NFTNL_SET_KEY_TYPE, ipv6 ? regban::SystemBanSet::KEY_TYPE_IPv6 : regban::SystemBanSet::KEY_TYPE_IPv4);
+            nftnl_set_set_u32(t, NFTNL_SET_KEY_LEN, ipv6 ? 16 : 4);
+            auto* nlh = nftnl_set_nlmsg_build_hdr(static_cast<char*>(mnl_nlmsg_batch_current(batch)), NFT_MSG_NEWSET, NFPROTO_INET, NLM_F_MULTI, req->nlmsg_seq);
+            nftnl_set_nlmsg_build_payload(nlh, t);
+            nftnl_set_free(t);
+            mnl_nlmsg_batch_next(batch);
+        }
+        reply_done(batch, req);
+    }
+
+    void reply_done(mnl_nlmsg_batch* batch, const nlmsghdr* req) {
+        auto* nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(batch));
+        nlh->nlmsg_type = NLMSG_DONE;
+        nlh->nlmsg_flags = NLM_F_MULTI;
+        nlh->nlmsg_seq = req->nlmsg_seq;
+        mnl_nlmsg_batch_next(batch);
+        const auto size = mnl_nlmsg_batch_size(batch);
+        const std::vector<char> buf(static_cast<char*>(mnl_nlmsg_batch_head(batch)), static_cast<char*>(mnl_nlmsg_batch_head(batch)) + size);
+        mnl_nlmsg_batch_stop(batch);
+        reply(buf, size);
+    }
+
+    // like the kernel, processes a transaction while it is sent
+    ssize_t receive(const void* buf, std::size_t size) {
+        int sndbuf = 0;
+        socklen_t length = sizeof(sndbuf);
+        getsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, &length);
+        if (size > static_cast<std::size_t>(sndbuf) - 32) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        int len = size;
+        const auto* nlh = static_cast<const nlmsghdr*>(buf);
+        if (nlh->nlmsg_type == NFNL_MSG_BATCH_BEGIN) {
+            ++transactions;
+        }
+        for (; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+            switch (nlh->nlmsg_type & 0xff) {
+                case NFT_MSG_GETSET:
+                    reply_sets(nlh);
+                    break;
+                case NFT_MSG_GETSETELEM: {
+                    std::vector<char> done(MNL_SOCKET_BUFFER_SIZE);
+                    reply_done(mnl_nlmsg_batch_start(&done[0], done.size() / 2), nlh);  // sets are empty
+                } break;
+                case NFT_MSG_NEWSETELEM:
+                case NFT_MSG_DELSETELEM:
+                    if ((nlh->nlmsg_flags & NLM_F_ACK) != 0) {
+                        reply_ack(nlh, 0);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        return size;
+    }
+};
+
+Endpoint endpoint;
+struct mnl_socket* const the_socket = reinterpret_cast<struct mnl_socket*>(&endpoint);
+}  // namespace
+
+extern "C" {
+struct mnl_socket* mnl_socket_open(int /* bus */) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, endpoint.fds) < 0) {
+        return nullptr;
+    }
+    return the_socket;
+}
+int mnl_socket_bind(struct mnl_socket* /* nl */, unsigned int /* groups */, pid_t /* pid */) { return 0; }
+int mnl_socket_close(struct mnl_socket* /* nl */) {
+    close(endpoint.fds[0]);
+    close(endpoint.fds[1]);
+    return 0;
+}
+int mnl_socket_get_fd(const struct mnl_socket* /* nl */) { return endpoint.fds[0]; }
+unsigned int mnl_socket_get_portid(const struct mnl_socket* /* nl */) { return 0; }
+int mnl_socket_setsockopt(const struct mnl_socket* /* nl */, int /* type */, void* /* buf */, socklen_t /* len */) { return 0; }
+ssize_t mnl_socket_sendto(const struct mnl_socket* /* nl */, const void* req, size_t siz) { return endpoint.receive(req, siz); }
+ssize_t mnl_socket_recvfrom(const struct mnl_socket* /* nl */, void* buf, size_t siz) { return recv(endpoint.fds[0], buf, siz, 0); }
+}
+
+int main() {
+    spdlog::set_level(spdlog::level::warn);
+    constexpr std::size_t N = 100000;
+
+    // e.g. as banned by a previous run and restored after a restart
+    std::vector<IPvX> ips;
+    for (std::size_t i = 0; i < N; ++i) {
+        ips.push_back(i % 6 != 0 ? static_cast<IPvX::Internal>((i % 223 + 1) << 24 | (i * 2654435761U & 0xffffff))
+                                 : static_cast<IPvX::Internal>(0x20010db800000000UL | i) << 64);
+    }
+
+    nanobench::Bench b;
+    b.title("ban and commit (" + std::to_string(N) + " networks)").unit("network").batch(N).relative(true);
+    b.epochs(1).epochIterations(1);
+    for (const std::size_t batch_size : {static_cast<std::size_t>(1), static_cast<std::size_t>(256), N}) {
+        b.run("regban::SystemBanSet (batch size " + std::to_string(batch_size) + ")", [&] {
+            regban::SystemBanSet banset;
+            banset.initialize("inet", "filter", "ban4", "ban6", 32, 64);
+            banset.set_max_batch_size(batch_size);
+            for (const auto ip : ips) {
+                banset.ban(ip, 3600);
+            }
+            banset.close();
+            nanobench::doNotOptimizeAway(endpoint.transactions);
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+namespace nanobench = ankerl::nanobench;
+
+#include <fcntl.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "EventLoop.h"
+
+struct Pipes {
+    std::vector<std::array<int, 2>> fds;
+
+    explicit Pipes(std::size_t n) : fds(n) {
+        for (auto& p : fds) {
+            if (pipe2(&p[0], O_NONBLOCK) < 0) {
+                throw std::runtime_error("Could not create pipe");
+            }
+        }
+    }
+
+    ~Pipes() {
+        for (auto& p : fds) {
+            close(p[0]);
+            close(p[1]);
+        }
+    }
+
+    int max_fd() const {
+        int res = 0;
+        for (const auto& p : fds) {
+            res = std::max(res, std::max(p[0], p[1]));
+        }
+        return res;
+    }
+};
+
+// one wakeup = one byte written to one of N pipes, waited for, dispatched and read again
+int main() {
+    for (const std::size_t N : {10, 50, 100, 250, 500}) {
+        Pipes pipes(N);
+        std::size_t next = 0;
+        char c = 0;
+
+        nanobench::Bench b;
+        b.title("wakeup (" + std::to_string(N) + " processes)").unit("wakeup").relative(true).minEpochIterations(1000);
+
+        if (pipes.max_fd() < FD_SETSIZE) {
+            b.run("select()", [&] {
+                write(pipes.fds[next][1], &c, 1);
+                next = (next + 1) % N;
+                fd_set set;
+                FD_ZERO(&set);
+                int nfds = 0;
+                for (const auto& p : pipes.fds) {
+                    FD_SET(p[0], &set);
+                    nfds = std::max(nfds, p[0]);
+                }
+                select(nfds + 1, &set, nullptr, nullptr, nullptr);
+                for (const auto& p : pipes.fds) {
+                    if (FD_ISSET(p[0], &set) != 0) {
+                        read(p[0], &c, 1);
+                    }
+                }
+            });
+        }
+
+        regban::EventLoop loop;
+        for (const auto& p : pipes.fds) {
+            const auto fd = p[0];
+            loop.add(fd, [fd, &c](std::uint32_t) { read(fd, &c, 1); });
+        }
+        b.run("regban::EventLoop", [&] {
+            write(pipes.fds[next][1], &c, 1);
+            next = (next + 1) % N;
+            loop.run_once();
+        });
+    }
+
+    return 0;
+}
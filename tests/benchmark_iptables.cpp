@@ -2,86 +2,229 @@
 #include "nanobench.h"
 namespace nanobench = ankerl::nanobench;
 
+#include <malloc.h>
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+
+#include "FlatIPTable.h"
 #include "test_iptables.h"
 
-int main() {
-    constexpr auto N = 10000;
-    const auto elements = create_element_list(2 * N);
+using Elements = std::vector<regban::IPTable<Payload>::Element>;
+using BTreeIPTable = regban::IPTable<Payload, regban::BTreeBucket>;
+using CompactIPTable = regban::IPTable<Payload, regban::CompactBucket>;
+
+// heap memory in use, to report memory per element
+static std::size_t allocated = 0;
+
+void* operator new(std::size_t size) {
+    auto* res = std::malloc(size);
+    if (res == nullptr) {
+        throw std::bad_alloc();
+    }
+    allocated += malloc_usable_size(res);
+    return res;
+}
+
+void operator delete(void* p) noexcept {
+    allocated -= malloc_usable_size(p);
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+
+template<typename IPTable>
+static void report_memory(const std::string& name, const Elements& elements, std::size_t N) {
+    const auto before = allocated;
+    auto* iptable = new IPTable;
+    const auto empty = allocated - before;
+    for (std::size_t i = 0; i < N; ++i) {
+        iptable->find_or_insert(elements[i].ip).second = elements[i].value;
+    }
+    std::cout << "| " << std::setw(10) << std::fixed << std::setprecision(1) << static_cast<double>(allocated - before - empty) / N << " | "
+              << std::setw(10) << empty << " | " << name << "\n";
+    delete iptable;
+}
+
+template<typename IPTable>
+static void run_insert(nanobench::Bench& b, const std::string& name, const Elements& elements, std::size_t N, std::size_t reserve) {
+    b.run(name, [&] {
+        IPTable iptable(reserve);
+        for (std::size_t i = 0; i < N; ++i) {
+            const auto& e = elements[i];
+            iptable.find_or_insert(e.ip).second = e.value;
+        }
+    });
+}
+
+template<typename IPTable>
+static void run_find(nanobench::Bench& b, const std::string& name, const Elements& elements, std::size_t begin, std::size_t end) {
+    IPTable iptable;
+    for (std::size_t i = 0; i < elements.size() / 2; ++i) {
+        iptable.find_or_insert(elements[i].ip).second = elements[i].value;
+    }
+    b.run(name, [&] {
+        for (auto i = begin; i < end; ++i) {
+            const auto* res = iptable.find(elements[i].ip);
+            nanobench::doNotOptimizeAway(res);
+        }
+    });
+}
+
+// fills table and then sweeps it once, removing about half of the ips as in RegBan::cleanup
+template<typename IPTable>
+static void run_sweep(nanobench::Bench& b, const std::string& name, const Elements& elements, bool use_erase_if) {
+    IPTable iptable;
+    for (const auto& e : elements) {
+        iptable.find_or_insert(e.ip).second = e.value;
+    }
+    b.run(name, [&] {
+        if (use_erase_if) {
+            iptable.erase_if([](IPvX, Payload& value) {
+                value -= 2;  // decay
+                return (value & 2) == 0;
+            });
+        } else {
+            std::vector<IPvX> to_remove;
+            for (auto e : iptable) {
+                e.second -= 2;
+                if ((e.second & 2) == 0) {
+                    to_remove.push_back(e.first);
+                }
+            }
+            for (const auto ip : to_remove) {
+                iptable.remove(ip);
+            }
+        }
+    });
+}
+
+// loads unsorted elements into an empty table, e.g. from a state file
+template<typename IPTable>
+static void run_load(nanobench::Bench& b, const std::string& name, const Elements& elements, bool use_bulk_load) {
+    b.run(name, [&] {
+        IPTable iptable;
+        if (use_bulk_load) {
+            iptable.bulk_load(elements);
+        } else {
+            for (const auto& e : elements) {
+                iptable.find_or_insert(e.ip).second = e.value;
+            }
+        }
+        nanobench::doNotOptimizeAway(iptable.size());
+    });
+}
+
+// first half of elements is inserted, second half is used for misses
+static void run(const std::string& distribution, const Elements& elements) {
+    const auto N = elements.size() / 2;
 
     {
         nanobench::Bench b;
-        b.title("insert").unit(std::to_string(N) + "ips").relative(true);
+        b.title("insert (" + distribution + ")").unit(std::to_string(N) + "ips").relative(true);
 
         b.run("std::map", [&] {
             std::map<IPvX, Payload> std_map;
-            for (auto i = 0; i < N; ++i) {
+            for (std::size_t i = 0; i < N; ++i) {
                 const auto& e = elements[i];
                 std_map.emplace(e.ip, e.value);
             }
         });
 
-        b.run("regban::IPTable", [&] {
-            regban::IPTable<Payload> iptable;
-            for (auto i = 0; i < N; ++i) {
-                const auto& e = elements[i];
-                iptable.find_or_insert(e.ip).second = e.value;
-            }
-        });
-
-        b.run("regban::IPTable (prereserved)", [&] {
-            regban::IPTable<Payload> iptable2(N);
-            for (auto i = 0; i < N; ++i) {
-                const auto& e = elements[i];
-                iptable2.find_or_insert(e.ip).second = e.value;
-            }
-        });
+        run_insert<regban::IPTable<Payload>>(b, "regban::IPTable", elements, N, 0);
+        run_insert<regban::IPTable<Payload>>(b, "regban::IPTable (prereserved)", elements, N, N);
+        run_insert<BTreeIPTable>(b, "regban::IPTable<BTreeBucket>", elements, N, 0);
+        run_insert<CompactIPTable>(b, "regban::IPTable<CompactBucket>", elements, N, 0);
+        run_insert<regban::FlatIPTable<Payload>>(b, "regban::FlatIPTable", elements, N, 0);
+        run_insert<regban::FlatIPTable<Payload>>(b, "regban::FlatIPTable (prereserved)", elements, N, N);
     }
 
     {
         std::map<IPvX, Payload> std_map;
-        for (const auto e : elements) {
-            std_map.emplace(std::make_pair(e.ip, e.value));
-        }
-
-        regban::IPTable<Payload> iptable;
-        for (const auto e : elements) {
-            iptable.find_or_insert(e.ip).second = e.value;
+        for (std::size_t i = 0; i < N; ++i) {
+            std_map.emplace(elements[i].ip, elements[i].value);
         }
 
         {
             nanobench::Bench b;
-            b.title("find (hit)").unit(std::to_string(N) + "ips").relative(true);
+            b.title("find (hit, " + distribution + ")").unit(std::to_string(N) + "ips").relative(true);
 
             b.run("std::map", [&] {
-                for (auto i = 0; i < N; ++i) {
+                for (std::size_t i = 0; i < N; ++i) {
                     const auto& res = std_map.find(elements[i].ip);
+                    nanobench::doNotOptimizeAway(res);
                 }
             });
 
-            b.run("regban::IPTable", [&] {
-                for (auto i = 0; i < N; ++i) {
-                    const auto* res = iptable.find(elements[i].ip);
-                }
-            });
+            run_find<regban::IPTable<Payload>>(b, "regban::IPTable", elements, 0, N);
+            run_find<BTreeIPTable>(b, "regban::IPTable<BTreeBucket>", elements, 0, N);
+            run_find<CompactIPTable>(b, "regban::IPTable<CompactBucket>", elements, 0, N);
+            run_find<regban::FlatIPTable<Payload>>(b, "regban::FlatIPTable", elements, 0, N);
         }
 
         {
             nanobench::Bench b;
-            b.title("find (miss)").unit(std::to_string(N) + "ips").relative(true).minEpochIterations(100);
+            b.title("find (miss, " + distribution + ")").unit(std::to_string(N) + "ips").relative(true).minEpochIterations(100);
 
             b.run("std::map", [&] {
                 for (auto i = N; i < 2 * N; ++i) {
                     const auto& res = std_map.find(elements[i].ip);
+                    nanobench::doNotOptimizeAway(res);
                 }
             });
 
-            b.run("regban::IPTable", [&] {
-                for (auto i = N; i < 2 * N; ++i) {
-                    const auto* res = iptable.find(elements[i].ip);
-                }
-            });
+            run_find<regban::IPTable<Payload>>(b, "regban::IPTable", elements, N, 2 * N);
+            run_find<BTreeIPTable>(b, "regban::IPTable<BTreeBucket>", elements, N, 2 * N);
+            run_find<CompactIPTable>(b, "regban::IPTable<CompactBucket>", elements, N, 2 * N);
+            run_find<regban::FlatIPTable<Payload>>(b, "regban::FlatIPTable", elements, N, 2 * N);
         }
     }
 
+    std::cout << "\n| memory (" << distribution << ")\n|  bytes/ip  | empty size | table\n";
+    report_memory<regban::IPTable<Payload>>("regban::IPTable", elements, N);
+    report_memory<BTreeIPTable>("regban::IPTable<BTreeBucket>", elements, N);
+    report_memory<CompactIPTable>("regban::IPTable<CompactBucket>", elements, N);
+    report_memory<regban::FlatIPTable<Payload>>("regban::FlatIPTable", elements, N);
+    std::cout << std::endl;
+}
+
+int main() {
+    run("uniform", create_element_list(2 * 10000));
+    run("skewed", create_skewed_element_list(2 * 200000));
+
+    {
+        constexpr auto N = 5000000;
+        const auto elements = create_element_list(N);
+    
+        nanobench::Bench b;
+        b.title("sweep (50% expiring)").unit(std::to_string(N) + "ips").relative(true).epochs(1).epochIterations(1);
+
+        run_sweep<regban::IPTable<Payload>>(b, "regban::IPTable remove()", elements, false);
+        run_sweep<regban::IPTable<Payload>>(b, "regban::IPTable erase_if()", elements, true);
+        run_sweep<BTreeIPTable>(b, "regban::IPTable<BTreeBucket> remove()", elements, false);
+        run_sweep<BTreeIPTable>(b, "regban::IPTable<BTreeBucket> erase_if()", elements, true);
+        run_sweep<CompactIPTable>(b, "regban::IPTable<CompactBucket> erase_if()", elements, true);
+        run_sweep<regban::FlatIPTable<Payload>>(b, "regban::FlatIPTable remove()", elements, false);
+        run_sweep<regban::FlatIPTable<Payload>>(b, "regban::FlatIPTable erase_if()", elements, true);
+    }
+
+    {
+        constexpr auto N = 400000;
+        const auto elements = create_skewed_element_list(N);
+    
+        nanobench::Bench b;
+        b.title("load (skewed)").unit(std::to_string(N) + "ips").relative(true).epochs(1).epochIterations(1);
+
+        run_load<regban::IPTable<Payload>>(b, "regban::IPTable find_or_insert()", elements, false);
+        run_load<regban::IPTable<Payload>>(b, "regban::IPTable bulk_load()", elements, true);
+        run_load<BTreeIPTable>(b, "regban::IPTable<BTreeBucket> find_or_insert()", elements, false);
+        run_load<BTreeIPTable>(b, "regban::IPTable<BTreeBucket> bulk_load()", elements, true);
+        run_load<CompactIPTable>(b, "regban::IPTable<CompactBucket> find_or_insert()", elements, false);
+        run_load<CompactIPTable>(b, "regban::IPTable<CompactBucket> bulk_load()", elements, true);
+    }
     return 0;
 }
@@ -0,0 +1,107 @@
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+namespace nanobench = ankerl::nanobench;
+
+#include <arpa/inet.h>
+
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "IPvX.h"
+
+using regban::IPvX;
+
+// strtoul-based parser IPvX::parse used before
+static IPvX parse_strtoul(const char* c) {
+    IPvX::Internal res = 0;
+    const auto* pos = c;
+    char* end;
+    auto last = *pos;
+    if (std::strchr(pos, ':') != nullptr) {
+        int i;
+        for (i = 0; i < 4; ++i) {
+            const auto v = std::strtoul(pos, &end, 16);
+            if (v > 0xffff) {
+                return 0;
+            }
+            if (last == ':') {
+                break;
+            }
+            if (*end != ':') {
+                return 0;
+            }
+            res = (res << 16) | v;
+            last = *pos;
+            pos = end + 1;
+        }
+        return res << ((4 - i) * 16);
+    }
+    for (int i = 0; i < 4; ++i) {
+        const auto v = std::strtoul(pos, &end, 10);
+        if (v > 255 || (i < 3 && *end != '.') || (i == 3 && *end == '.')) {
+            return 0;
+        }
+        res = (res << 8) | v;
+        pos = end + 1;
+    }
+    return res;
+}
+
+static void run(const std::string& title, const std::vector<std::string>& strings) {
+    std::vector<std::pair<const char*, std::size_t>> input;
+    for (const auto& s : strings) {
+        input.emplace_back(s.data(), s.size());
+    }
+    std::vector<IPvX> output(strings.size());
+    IPvX::Internal sum = 0;
+
+    nanobench::Bench b;
+    b.title(title).unit("ip").relative(true).batch(strings.size());
+
+    b.run("inet_pton", [&] {
+        for (const auto& s : strings) {
+            unsigned char addr[16];
+            inet_pton(s.find(':') == std::string::npos ? AF_INET : AF_INET6, s.c_str(), addr);
+            sum += addr[0];
+        }
+    });
+
+    b.run("strtoul (previous)", [&] {
+        for (const auto& s : strings) {
+            sum += parse_strtoul(s.c_str());
+        }
+    });
+
+    b.run("regban::IPvX::parse", [&] {
+        for (const auto& s : strings) {
+            sum += IPvX::parse(s.data(), s.size());
+        }
+    });
+
+    b.run("regban::IPvX::parse_many", [&] {
+        sum += IPvX::parse_many(std::begin(input), std::end(input), std::begin(output));
+    });
+
+    nanobench::doNotOptimizeAway(sum);
+}
+
+int main() {
+    constexpr auto N = 10000;
+    std::mt19937_64 random(42);
+    std::vector<std::string> v4;
+    std::vector<std::string> v6;
+    for (auto i = 0; i < N; ++i) {
+        std::ostringstream ss;
+        ss << IPvX(random() & 0xffffffff);
+        v4.push_back(ss.str());
+        ss.str("");
+        ss << std::hex << (random() & 0xffff) << ':' << (random() & 0xffff) << ':' << (random() & 0xffff) << "::" << (random() & 0xffff);
+        v6.push_back(ss.str());
+    }
+    run("parse IPv4", v4);
+    run("parse IPv6", v6);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+namespace nanobench = ankerl::nanobench;
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "PatternMatcher.h"
+
+// patterns as in examples/settings.yml with {{ip}} filled in
+static const std::vector<std::string> patterns = {
+    ".* Invalid user .* from ([0-9a-f:\\.]+).*",
+    ".* Connection closed by authenticating user .* ([0-9a-f:\\.]+) port .*",
+    ".* Disconnected from authenticating user .* ([0-9a-f:\\.]+) port .*",
+    ".* Failed password for .* from ([0-9a-f:\\.]+) port .*",
+    ".* Did not receive identification string from ([0-9a-f:\\.]+).*",
+};
+
+// typical sshd journal output, most lines do not match
+static const std::vector<std::string> lines = {
+    "Jan 01 00:00:00 host sshd[4711]: Invalid user admin from 192.0.2.1 port 52234",
+    "Jan 01 00:00:00 host sshd[4711]: Received disconnect from 192.0.2.1 port 52234:11: Bye Bye [preauth]",
+    "Jan 01 00:00:00 host sshd[4711]: Disconnected from invalid user admin 192.0.2.1 port 52234 [preauth]",
+    "Jan 01 00:00:00 host sshd[4712]: Accepted publickey for user from 2001:db8::1 port 40000 ssh2: ED25519 SHA256:abcdefghijklmnopqrstuvwxyz",
+    "Jan 01 00:00:00 host sshd[4712]: pam_unix(sshd:session): session opened for user user(uid=1000) by (uid=0)",
+    "Jan 01 00:00:00 host sshd[4713]: Connection closed by authenticating user root 192.0.2.2 port 41234 [preauth]",
+    "Jan 01 00:00:00 host sshd[4714]: Did not receive identification string from 192.0.2.3 port 1234",
+    "Jan 01 00:00:00 host sshd[4715]: error: kex_exchange_identification: Connection closed by remote host",
+};
+
+// lines containing none of the prefilter literals
+static const std::vector<std::string> other_lines = {
+    "Jan 01 00:00:00 host systemd[1]: Started Session 1 of user user.",
+    "Jan 01 00:00:00 host kernel: [UFW BLOCK] IN=eth0 OUT= MAC=00:00:00:00:00:00 SRC=192.0.2.1 DST=192.0.2.2 LEN=40 PROTO=TCP SPT=1234 DPT=23",
+    "Jan 01 00:00:00 host CRON[4711]: pam_unix(cron:session): session closed for user root",
+    "Jan 01 00:00:00 host sshd[4712]: Received disconnect from 192.0.2.1 port 52234:11: Bye Bye [preauth]",
+};
+
+int main() {
+    std::vector<std::regex> regexes;
+    regban::PatternMatcher matcher;
+    for (const auto& p : patterns) {
+        regexes.emplace_back(p, std::regex::optimize);
+        matcher.add(p);
+    }
+    matcher.compile();
+
+    nanobench::Bench b;
+    b.title("match").unit("line").relative(true).batch(lines.size()).minEpochIterations(100);
+
+    std::size_t matches = 0;
+    b.run("std::regex_match per pattern", [&] {
+        for (const auto& line : lines) {
+            for (const auto& regex : regexes) {
+                std::smatch match;
+                if (std::regex_match(line, match, regex)) {
+                    matches += match[1].length();
+                }
+            }
+        }
+    });
+
+    b.run("regban::PatternMatcher", [&] {
+        for (const auto& line : lines) {
+            matcher.match(line.data(), line.data() + line.size(), [&](std::size_t, const char* begin, const char* end) { matches += end - begin; });
+        }
+    });
+
+    nanobench::Bench b2;
+    b2.title("prefiltered").unit("line").relative(true).batch(other_lines.size()).minEpochIterations(100);
+
+    b2.run("std::regex_match per pattern", [&] {
+        for (const auto& line : other_lines) {
+            for (const auto& regex : regexes) {
+                std::smatch match;
+                if (std::regex_match(line, match, regex)) {
+                    matches += match[1].length();
+                }
+            }
+        }
+    });
+
+    b2.run("regban::PatternMatcher", [&] {
+        for (const auto& line : other_lines) {
+            matcher.match(line.data(), line.data() + line.size(), [&](std::size_t, const char* begin, const char* end) { matches += end - begin; });
+        }
+    });
+    nanobench::doNotOptimizeAway(matches);
+
+    return 0;
+}
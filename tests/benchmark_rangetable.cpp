@@ -0,0 +1,222 @@
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+namespace nanobench = ankerl::nanobench;
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "IPRangeTable.h"
+#include "IPvX.h"
+#include "RangeScoreMap.h"
+#include "RangeTableFile.h"
+
+using regban::IPvX;
+
+struct Range {
+    IPvX ip;
+    unsigned char cidr;
+    int value;
+};
+
+// prefix lengths roughly distributed as in full routing or geo-ip tables: mostly /24 (IPv4) and /32 to /48 (IPv6),
+// many of them nested in shorter ones
+static std::vector<Range> create_table(std::size_t N) {
+    std::mt19937_64 gen(0);
+    std::vector<Range> res;
+    res.reserve(N);
+    const auto pick = [&](const std::vector<std::pair<int, int>>& weights) {
+        int total = 0;
+        for (const auto& w : weights) {
+            total += w.second;
+        }
+        auto r = static_cast<int>(gen() % total);
+        for (const auto& w : weights) {
+            if (r < w.second) {
+                return w.first;
+            }
+            r -= w.second;
+        }
+        return weights.back().first;
+    };
+    const std::vector<std::pair<int, int>> v4_lengths = {{8, 1}, {12, 2}, {14, 3}, {16, 8}, {18, 4}, {19, 6}, {20, 7}, {21, 7}, {22, 12}, {23, 10}, {24, 55}};
+    const std::vector<std::pair<int, int>> v6_lengths = {{19, 1}, {29, 5}, {32, 30}, {36, 5}, {40, 8}, {44, 10}, {48, 40}, {56, 1}};
+    while (res.size() < N) {
+        if (gen() % 6 != 0) {
+            const auto cidr = pick(v4_lengths);
+            const IPvX ip = static_cast<IPvX::Internal>((gen() % 223 + 1) << 24 | (gen() & 0xffffff));
+            res.push_back(Range{ip.network(cidr), static_cast<unsigned char>(cidr), static_cast<int>(res.size())});
+        } else {
+            const auto cidr = pick(v6_lengths);
+            const IPvX ip = static_cast<IPvX::Internal>(0x2000000000000000UL | (gen() & 0x0fffffffffffffffUL)) << 64;
+            res.push_back(Range{ip.network(cidr), static_cast<unsigned char>(cidr), static_cast<int>(res.size())});
+        }
+    }
+    return res;
+}
+
+// one hash map per prefix length, probed from the longest length on
+class HashPerLengthTable {
+  private:
+    struct Hash {
+        std::size_t operator()(IPvX ip) const { return std::hash<std::uint64_t>()(static_cast<std::uint64_t>(ip >> 64) * 31 ^ static_cast<std::uint64_t>(ip)); }
+    };
+    std::vector<std::unordered_map<IPvX, int, Hash>> maps[2];
+
+  public:
+    HashPerLengthTable() {
+        maps[0].resize(IPvX::TOTAL_BIT_SIZE_V4 + 1);
+        maps[1].resize(IPvX::TOTAL_BIT_SIZE_V6 + 1);
+    }
+
+    void insert(IPvX ip, unsigned char cidr, int value) { maps[ip.is_ipv6()][cidr][ip.network(cidr)] = value; }
+
+    const int* find_range_for(IPvX ip) const {
+        const auto& m = maps[ip.is_ipv6()];
+        for (auto cidr = static_cast<int>(m.size()) - 1; cidr >= 0; --cidr) {
+            if (!m[cidr].empty()) {
+                const auto it = m[cidr].find(ip.network(cidr));
+                if (it != std::end(m[cidr])) {
+                    return &it->second;
+                }
+            }
+        }
+        return nullptr;
+    }
+};
+
+int main() {
+    constexpr std::size_t N = 300000;
+    constexpr std::size_t LOOKUPS = 100000;
+    const auto table = create_table(N);
+
+    std::vector<IPvX> ips;
+    std::mt19937_64 gen(1);
+    for (std::size_t i = 0; i < LOOKUPS; ++i) {
+        if (gen() % 4 == 0) {
+            // random address, mostly not in any range
+            ips.push_back(gen() % 2 == 0 ? static_cast<IPvX::Internal>(gen() & 0xffffffff) : static_cast<IPvX::Internal>(gen() | (1UL << 63)) << 64 | gen());
+        } else {
+            // within a range of the table
+            const auto& r = table[gen() % table.size()];
+            const auto host_bits = r.ip.total_bit_size() - r.cidr;
+            ips.push_back(r.ip + (static_cast<IPvX::Internal>(gen()) & ((static_cast<IPvX::Internal>(1) << std::min(host_bits, 64)) - 1)));
+        }
+    }
+
+    regban::IPRangeTable<int> rangetable;
+    HashPerLengthTable hashtable;
+    {
+        nanobench::Bench b;
+        b.title("build (" + std::to_string(N) + " ranges)").unit("table").relative(true);
+        b.epochs(1).epochIterations(1);
+        b.run("regban::IPRangeTable", [&] {
+            regban::IPRangeTable<int> t;
+            for (const auto& r : table) {
+                t.find_or_insert(r.ip, r.cidr).second = r.value;
+            }
+            t.build();
+            nanobench::doNotOptimizeAway(t.size());
+            rangetable = std::move(t);
+        });
+        b.run("hash map per prefix length", [&] {
+            HashPerLengthTable t;
+            for (const auto& r : table) {
+                t.insert(r.ip, r.cidr, r.value);
+            }
+            hashtable = std::move(t);
+        });
+    }
+
+    {
+        nanobench::Bench b;
+        b.title("find_range_for (" + std::to_string(N) + " ranges)").unit(std::to_string(LOOKUPS) + "ips").relative(true);
+        b.run("regban::IPRangeTable", [&] {
+            for (const auto ip : ips) {
+                const auto res = rangetable.find_range_for(ip);
+                nanobench::doNotOptimizeAway(res.second);
+            }
+        });
+        b.run("hash map per prefix length", [&] {
+            for (const auto ip : ips) {
+                const auto* res = hashtable.find_range_for(ip);
+                nanobench::doNotOptimizeAway(res);
+            }
+        });
+    }
+
+    {
+        // e.g. a geo-ip table, a cloud provider table and an allowlist
+        std::vector<regban::IPRangeTable<regban::Score>> tables(3);
+        for (std::size_t i = 0; i < table.size(); ++i) {
+            const auto& r = table[i];
+            auto& t = tables[i % 10 < 7 ? 0 : i % 10 < 9 ? 1 : 2];
+            t.find_or_insert(r.ip, r.cidr).second = &t == &tables[2] ? 0 : r.value % 100 + 1;
+        }
+        for (auto& t : tables) {
+            t.build();
+        }
+        regban::RangeScoreMap rangescores;
+        rangescores.build(tables);
+
+        nanobench::Bench b;
+        b.title("range scores (3 tables, " + std::to_string(N) + " ranges)").unit(std::to_string(LOOKUPS) + "ips").relative(true);
+        b.run("regban::IPRangeTable per table", [&] {
+            for (const auto ip : ips) {
+                regban::Score score = 0;
+                for (const auto& t : tables) {
+                    const auto res = t.find_range_for(ip);
+                    if (res.second != nullptr) {
+                        if (*res.second <= 0) {
+                            break;
+                        }
+                        score += *res.second;
+                    }
+                }
+                nanobench::doNotOptimizeAway(score);
+            }
+        });
+        b.run("regban::RangeScoreMap", [&] {
+            for (const auto ip : ips) {
+                const auto res = rangescores.lookup(ip);
+                nanobench::doNotOptimizeAway(res);
+            }
+        });
+    }
+
+    {
+        const std::string csv_filename = "benchmark_rangetable.csv";
+        const std::string filename = "benchmark_rangetable.bin";
+        {
+            std::ofstream out(csv_filename);
+            for (const auto& r : table) {
+                out << IPvX::Formatter(r.ip) << ',' << static_cast<int>(r.cidr) << ',' << r.value % 100 << '\n';
+            }
+        }
+        regban::RangeTableFile::compile(csv_filename, filename);
+
+        nanobench::Bench b;
+        b.title("load (" + std::to_string(N) + " ranges)").unit("table").relative(true);
+        b.epochs(1).epochIterations(1);
+        b.run("regban::RangeTableFile::read_csv and regban::RangeScoreMap::build", [&] {
+            std::vector<regban::IPRangeTable<regban::Score>> t;
+            t.push_back(regban::RangeTableFile::read_csv(csv_filename));
+            regban::RangeScoreMap m;
+            m.build(t);
+            nanobench::doNotOptimizeAway(m.size());
+        });
+        b.run("regban::RangeTableFile", [&] {
+            regban::RangeTableFile f(filename);
+            nanobench::doNotOptimizeAway(f.size());
+        });
+        std::remove(csv_filename.c_str());
+        std::remove(filename.c_str());
+    }
+    return 0;
+}
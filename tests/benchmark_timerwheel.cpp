@@ -0,0 +1,69 @@
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+namespace nanobench = ankerl::nanobench;
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "FlatIPTable.h"
+#include "TimerWheel.h"
+#include "test_iptables.h"
+
+using Wheel = regban::TimerWheel<IPvX>;
+
+int main() {
+    constexpr std::size_t N = 1000000;
+    constexpr Wheel::Tick START = 1600000000;
+    constexpr Wheel::Tick SPREAD = 86400;  // expiries spread over a day
+    const auto elements = create_element_list(N);
+    std::mt19937_64 gen(42);
+    std::vector<Wheel::Tick> expiries(N);
+    for (auto& expiry : expiries) {
+        expiry = START + 1 + gen() % SPREAD;
+    }
+
+    {
+        nanobench::Bench b;
+        b.title("schedule").unit(std::to_string(N) + "ips").relative(true);
+        b.epochs(1).epochIterations(1);
+        b.run("regban::TimerWheel", [&] {
+            Wheel wheel(START);
+            for (std::size_t i = 0; i < N; ++i) {
+                wheel.schedule(elements[i].ip, expiries[i]);
+            }
+            nanobench::doNotOptimizeAway(wheel.size());
+        });
+    }
+
+    {
+        // cost of expiring ips once per second, as RegBan::cleanup does
+        nanobench::Bench b;
+        b.title("expire per second (" + std::to_string(N) + " ips)").unit("tick").relative(true);
+        b.epochs(1).epochIterations(10);
+
+        regban::FlatIPTable<Wheel::Tick> iptable(N);
+        for (std::size_t i = 0; i < N; ++i) {
+            iptable.find_or_insert(elements[i].ip).second = expiries[i];
+        }
+        Wheel::Tick now = START;
+        b.run("full sweep with erase_if()", [&] {
+            ++now;
+            const auto removed = iptable.erase_if([&](IPvX, Wheel::Tick& expiry) { return expiry <= now; });
+            nanobench::doNotOptimizeAway(removed);
+        });
+
+        Wheel wheel(START);
+        for (std::size_t i = 0; i < N; ++i) {
+            wheel.schedule(elements[i].ip, expiries[i]);
+        }
+        now = START;
+        b.epochs(10).epochIterations(100);
+        b.run("regban::TimerWheel advance()", [&] {
+            ++now;
+            const auto due = wheel.advance(now, [](IPvX ip, Wheel::Tick) { nanobench::doNotOptimizeAway(ip); });
+            nanobench::doNotOptimizeAway(due);
+        });
+    }
+    return 0;
+}
@@ -3,6 +3,19 @@
 #include "doctest.h"
 // make sure doctest comes before including tested classes
 
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+
+#include "FlatIPTable.h"
+#include "IPRangeTable.h"
+#include "RangeScoreMap.h"
+#include "RangeTableFile.h"
 #include "test_iptables.h"
 
 TEST_CASE("single") {
@@ -225,14 +238,27 @@ TEST_CASE("range") {
 
     SUBCASE("insert again") {
         {
-            const auto& res = iprangetable.find_or_insert(e1.ip, 32);
+            const auto& res = iprangetable.find_or_insert(IPvX::parse("192.168.1.1"), 24);
             REQUIRE(iprangetable.size() == 2);
             REQUIRE(res.first);
             REQUIRE(res.second == e1.value);
         }
+
+        {
+            const auto& res = iprangetable.find_or_insert(e1.ip, 32);
+            REQUIRE(iprangetable.size() == 3);
+            REQUIRE(!res.first);
+        }
+    }
+
+    SUBCASE("not built") {
+        iprangetable.find_or_insert(e1.ip, 28);
+        REQUIRE_THROWS(iprangetable.find_range_for(e1.ip));
     }
 
     SUBCASE("find") {
+        iprangetable.build();
+
         {
             const auto res = iprangetable.find_range_for(e1.ip);
             const auto& res_ip = res.first.first;
@@ -298,3 +324,553 @@ TEST_CASE("range") {
         }
     }
 }
+
+// longest-prefix match by scanning all ranges
+static std::pair<IPvX, int> reference_range_for(const std::vector<std::pair<IPvX, int>>& ranges, IPvX ip) {
+    std::pair<IPvX, int> res{ip, -1};
+    for (const auto& r : ranges) {
+        if (r.first.is_ipv6() == ip.is_ipv6() && ip.network(r.second) == r.first.network(r.second) && r.second > res.second) {
+            res = r;
+        }
+    }
+    return res;
+}
+
+TEST_CASE("range nested") {
+    std::mt19937_64 gen(3);
+    regban::IPRangeTable<Payload> iprangetable;
+    std::vector<std::pair<IPvX, int>> ranges;
+    std::vector<IPvX> ips;
+    std::set<std::tuple<bool, IPvX, int>> seen;
+
+    // ranges nested within each other and of all lengths (including ones covering whole address families)
+    for (int i = 0; i < 3000; ++i) {
+        IPvX ip;
+        if (ranges.empty() || gen() % 4 == 0) {
+            do {
+                ip = gen() % 2 == 0 ? static_cast<IPvX::Internal>(gen() & 0xffffffff) : static_cast<IPvX::Internal>(gen()) << 64 | gen();
+            } while (ip == 0);
+        } else {
+            // close to an existing range
+            const auto& r = ranges[gen() % ranges.size()];
+            const auto bits = r.first.total_bit_size() - r.second;
+            ip = r.first.network(r.second) + (bits == 0 ? 0 : static_cast<IPvX::Internal>(gen()) % (static_cast<IPvX::Internal>(1) << std::min(bits, 64)));
+            if (ip.is_ipv6() != r.first.is_ipv6()) {
+                continue;
+            }
+        }
+        const int cidr = gen() % (ip.total_bit_size() + 1);
+        if (!seen.emplace(ip.is_ipv6(), ip.network(cidr), cidr).second) {
+            continue;
+        }
+        const auto res = iprangetable.find_or_insert(ip, cidr);
+        REQUIRE(!res.first);
+        res.second = i;
+        ranges.emplace_back(ip, cidr);
+        ips.push_back(ip);
+        ips.push_back(ip.network(cidr));
+        ips.push_back(ip.network_end(cidr) - 1);
+        if (ip.network_end(cidr).is_ipv6() == ip.is_ipv6()) {
+            ips.push_back(ip.network_end(cidr));
+        }
+    }
+    for (int i = 0; i < 10000; ++i) {
+        ips.push_back(gen() % 2 == 0 ? static_cast<IPvX::Internal>(gen() & 0xffffffff) : static_cast<IPvX::Internal>(gen()) << 64 | gen());
+    }
+    iprangetable.build();
+    REQUIRE(iprangetable.size() == ranges.size());
+
+    for (const auto ip : ips) {
+        const auto expected = reference_range_for(ranges, ip);
+        const auto res = iprangetable.find_range_for(ip);
+        if (expected.second < 0) {
+            REQUIRE(res.second == nullptr);
+            REQUIRE(res.first.first == ip);
+        } else {
+            REQUIRE(res.second != nullptr);
+            REQUIRE(res.first.first == expected.first);
+            REQUIRE(static_cast<int>(res.first.second) == expected.second);
+        }
+    }
+}
+
+TEST_CASE("range scores") {
+    std::mt19937_64 gen(4);
+    std::vector<regban::IPRangeTable<regban::Score>> tables(3);
+    std::vector<IPvX> ips;
+    // overlapping ranges within a few shared networks, so that ips fall into ranges of several tables
+    const std::vector<IPvX> bases = {IPvX::parse("10.0.0.0"), IPvX::parse("192.168.0.0"), IPvX::parse("2001:db8::")};
+    for (auto& table : tables) {
+        for (int i = 0; i < 500; ++i) {
+            const auto base = bases[gen() % bases.size()];
+            const IPvX ip = base + (static_cast<IPvX::Internal>(gen() & 0xffff) << (base.is_ipv6() ? 96 : 0));
+            const int cidr = ip.is_ipv6() ? 16 + gen() % 30 : 8 + gen() % 25;
+            table.find_or_insert(ip, cidr).second = static_cast<regban::Score>(gen() % 60) - 3;
+            ips.push_back(ip.network(cidr));
+            ips.push_back(ip.network_end(cidr));
+            ips.push_back(ip.network_end(cidr) - 1);
+        }
+        table.build();
+    }
+    for (int i = 0; i < 2000; ++i) {
+        ips.push_back(gen() % 2 == 0 ? static_cast<IPvX::Internal>(gen() & 0xffffffff) : static_cast<IPvX::Internal>(gen()) << 64 | gen());
+    }
+
+    regban::RangeScoreMap rangescores;
+    rangescores.build(tables);
+    for (const auto ip : ips) {
+        // as done separately for each table before
+        regban::Score score = 0;
+        bool allowed = false;
+        for (const auto& table : tables) {
+            const auto res = table.find_range_for(ip);
+            if (res.second != nullptr) {
+                if (*res.second <= 0) {
+                    allowed = true;
+                    break;
+                }
+                score += *res.second;
+            }
+        }
+        const auto res = rangescores.lookup(ip);
+        REQUIRE(res.allowed == allowed);
+        if (!allowed) {
+            REQUIRE(res.score == score);
+        }
+    }
+}
+
+TEST_CASE("range table file") {
+    std::mt19937_64 gen(5);
+    regban::IPRangeTable<regban::Score> table;
+    std::vector<IPvX> ips;
+    const std::vector<IPvX> bases = {IPvX::parse("10.0.0.0"), IPvX::parse("2001:db8::")};
+    for (int i = 0; i < 1000; ++i) {
+        const auto base = bases[gen() % bases.size()];
+        const IPvX ip = base + (static_cast<IPvX::Internal>(gen() & 0xffff) << (base.is_ipv6() ? 96 : 0));
+        const int cidr = ip.is_ipv6() ? 16 + gen() % 113 : 8 + gen() % 25;
+        table.find_or_insert(ip, cidr).second = static_cast<regban::Score>(gen() % 60) - 3;
+        ips.push_back(ip.network(cidr));
+        ips.push_back(ip.network_end(cidr) - 1);
+        ips.push_back(gen() % 2 == 0 ? static_cast<IPvX::Internal>(gen() & 0xffffffff) : static_cast<IPvX::Internal>(gen()) << 64 | gen());
+    }
+    table.build();
+    regban::RangeScoreMap rangescores;
+    rangescores.build({table});
+
+    const auto filename = "test_rangetable." + std::to_string(getpid()) + ".bin";
+    regban::RangeTableFile::write(table, regban::RangeTableFile::Source{123, 456}, filename);
+
+    SUBCASE("lookup") {
+        regban::RangeTableFile file(filename);
+        REQUIRE(file.size() == table.size());
+        REQUIRE(file.compiled_from(regban::RangeTableFile::Source{123, 456}));
+        REQUIRE(!file.compiled_from(regban::RangeTableFile::Source{123, 457}));
+        const auto moved = std::move(file);
+        for (const auto ip : ips) {
+            const auto expected = rangescores.lookup(ip);
+            const auto res = moved.lookup(ip);
+            REQUIRE(res.allowed == expected.allowed);
+            REQUIRE(res.score == expected.score);
+        }
+    }
+
+    SUBCASE("merge") {
+        const auto copy = regban::RangeTableFile(filename).table();
+        REQUIRE(copy.size() == table.size());
+        for (const auto ip : ips) {
+            const auto expected = table.find_range_for(ip);
+            const auto res = copy.find_range_for(ip);
+            REQUIRE(res.first == expected.first);
+            REQUIRE((res.second == nullptr) == (expected.second == nullptr));
+            if (res.second != nullptr) {
+                REQUIRE(*res.second == *expected.second);
+            }
+        }
+    }
+
+    SUBCASE("invalid") {
+        std::string content;
+        {
+            std::ifstream in(filename, std::ios::binary);
+            content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        const auto rewrite = [&](const std::string& c) {
+            std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+            out.write(c.data(), c.size());
+        };
+        rewrite(content.substr(0, content.size() - 8));
+        REQUIRE_THROWS(regban::RangeTableFile(filename));
+        rewrite(content + std::string(8, '\0'));
+        REQUIRE_THROWS(regban::RangeTableFile(filename));
+        rewrite("x" + content.substr(1));
+        REQUIRE_THROWS(regban::RangeTableFile(filename));
+        auto broken = content;
+        broken[sizeof(regban::RangeTableFile::Header) + table.size() * sizeof(regban::RangeTableFile::Record) + 7] = 0x7f;  // number of results
+        rewrite(broken);
+        REQUIRE_THROWS(regban::RangeTableFile(filename));
+        std::remove(filename.c_str());
+        REQUIRE_THROWS(regban::RangeTableFile(filename));
+    }
+
+    std::remove(filename.c_str());
+}
+
+using VectorIPTable = regban::IPTable<Payload>;
+using BTreeIPTable = regban::IPTable<Payload, regban::BTreeBucket>;
+using CompactIPTable = regban::IPTable<Payload, regban::CompactBucket>;
+
+TEST_CASE_TEMPLATE("backends", IPTable, VectorIPTable, BTreeIPTable, CompactIPTable) {
+    const auto elements = create_skewed_element_list(20000);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<std::size_t> dist_index(0, elements.size() - 1);
+    std::uniform_int_distribution<int> dist_percent(0, 99);
+
+    IPTable iptable;
+    std::map<IPvX, Payload> reference;
+    for (int i = 0; i < 100000; ++i) {
+        const auto& e = elements[dist_index(gen)];
+        if (dist_percent(gen) < 60) {
+            const auto res = iptable.find_or_insert(e.ip);
+            REQUIRE(res.first == (reference.count(e.ip) > 0));
+            res.second = e.value;
+            reference[e.ip] = e.value;
+        } else {
+            iptable.remove(e.ip);
+            reference.erase(e.ip);
+        }
+        REQUIRE(iptable.size() == reference.size());
+    }
+
+    SUBCASE("find") {
+        for (const auto& e : elements) {
+            const auto* res = iptable.find(e.ip);
+            const auto it = reference.find(e.ip);
+            if (it == std::end(reference)) {
+                REQUIRE(res == nullptr);
+            } else {
+                REQUIRE(res != nullptr);
+                REQUIRE(*res == it->second);
+            }
+        }
+    }
+
+    SUBCASE("lower_bound") {
+        for (const auto& e : elements) {
+            if (e.ip.is_ipv6()) {
+                continue;  // ipv4 buckets cover contiguous ranges
+            }
+            for (const IPvX ip : {e.ip - 1, e.ip + 0, e.ip + 1}) {
+                const auto res = iptable.lower_bound(ip);
+                auto it = reference.upper_bound(ip);
+                if (it == std::begin(reference) || (--it)->first.is_ipv6() || IPTable::get_bucket_index(it->first) != IPTable::get_bucket_index(ip)) {
+                    REQUIRE(res.second == std::end(res.first));
+                } else {
+                    REQUIRE(res.second != std::end(res.first));
+                    REQUIRE(res.second->ip == it->first);
+                }
+            }
+        }
+    }
+
+    SUBCASE("iterate") {
+        std::size_t count = 0;
+        IPvX last = 0;
+        for (const auto& j : iptable) {
+            const auto it = reference.find(j.first);
+            REQUIRE(it != std::end(reference));
+            REQUIRE(it->second == j.second);
+            if (count > 0 && IPTable::get_bucket_index(last) == IPTable::get_bucket_index(j.first)) {
+                REQUIRE(last < j.first);
+            }
+            last = j.first;
+            ++count;
+        }
+        REQUIRE(count == reference.size());
+    }
+
+    SUBCASE("remove all") {
+        for (const auto& e : elements) {
+            iptable.remove(e.ip);
+        }
+        REQUIRE(iptable.size() == 0);
+        REQUIRE(!(std::begin(iptable) != std::end(iptable)));
+    }
+}
+
+TEST_CASE_TEMPLATE("batch", IPTable, VectorIPTable, BTreeIPTable, CompactIPTable) {
+    const auto elements = create_skewed_element_list(20000);
+    std::mt19937 gen(2);
+    std::uniform_int_distribution<std::size_t> dist_index(0, elements.size() - 1);
+
+    IPTable iptable;
+    std::map<IPvX, Payload> reference;
+    for (int i = 0; i < 5000; ++i) {
+        const auto& e = elements[dist_index(gen)];
+        iptable.find_or_insert(e.ip).second = e.value;
+        reference[e.ip] = e.value;
+    }
+
+    // unsorted, with repetitions and ips already in the table
+    std::vector<typename IPTable::Element> batch;
+    for (int i = 0; i < 30000; ++i) {
+        auto e = elements[dist_index(gen)];
+        e.value = i;
+        batch.push_back(e);
+    }
+    std::map<IPvX, Payload> batch_reference;
+    for (const auto& e : batch) {
+        batch_reference[e.ip] = e.value;
+    }
+
+    const auto check = [&](const std::map<IPvX, Payload>& expected) {
+        REQUIRE(iptable.size() == expected.size());
+        std::size_t count = 0;
+        IPvX last = 0;
+        for (const auto& j : iptable) {
+            const auto it = expected.find(j.first);
+            REQUIRE(it != std::end(expected));
+            REQUIRE(it->second == j.second);
+            if (count > 0 && IPTable::get_bucket_index(last) == IPTable::get_bucket_index(j.first)) {
+                REQUIRE(last < j.first);
+            }
+            last = j.first;
+            ++count;
+        }
+        REQUIRE(count == expected.size());
+        for (const auto& e : elements) {
+            const auto* res = iptable.find(e.ip);
+            REQUIRE((res != nullptr) == (expected.count(e.ip) > 0));
+        }
+    };
+
+    SUBCASE("insert_batch") {
+        const auto size_before = reference.size();
+        for (const auto& e : batch_reference) {
+            reference[e.first] = e.second;
+        }
+        REQUIRE(iptable.insert_batch(batch) == reference.size() - size_before);
+        check(reference);
+
+        // table stays usable for single insertions and removals
+        for (int i = 0; i < 10000; ++i) {
+            const auto& e = elements[dist_index(gen)];
+            if (i % 2 == 0) {
+                iptable.find_or_insert(e.ip).second = e.value;
+                reference[e.ip] = e.value;
+            } else {
+                iptable.remove(e.ip);
+                reference.erase(e.ip);
+            }
+        }
+        check(reference);
+    }
+
+    SUBCASE("bulk_load") {
+        iptable.bulk_load(batch);
+        check(batch_reference);
+    }
+
+    SUBCASE("empty") {
+        iptable.insert_batch(std::vector<typename IPTable::Element>{});
+        check(reference);
+    }
+}
+
+TEST_CASE("flat") {
+    const auto elements = create_skewed_element_list(20000);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist_percent(0, 99);
+
+    regban::FlatIPTable<Payload> iptable;
+    std::map<IPvX, Payload> reference;
+    const auto check = [&]() {
+        REQUIRE(iptable.size() == reference.size());
+        for (const auto& e : elements) {
+            const auto* res = iptable.find(e.ip);
+            const auto it = reference.find(e.ip);
+            if (it == std::end(reference)) {
+                REQUIRE(res == nullptr);
+            } else {
+                REQUIRE(res != nullptr);
+                REQUIRE(*res == it->second);
+            }
+        }
+        std::size_t count = 0;
+        for (const auto& j : iptable) {
+            const auto it = reference.find(j.first);
+            REQUIRE(it != std::end(reference));
+            REQUIRE(it->second == j.second);
+            ++count;
+        }
+        REQUIRE(count == reference.size());
+    };
+
+    SUBCASE("mixed") {
+        // small working set so that removals often shift elements of long probe sequences
+        for (std::size_t n : {100, 1000, 20000}) {
+            std::uniform_int_distribution<std::size_t> dist_index(0, n - 1);
+            for (int i = 0; i < 50000; ++i) {
+                const auto& e = elements[dist_index(gen)];
+                if (dist_percent(gen) < 55) {
+                    const auto res = iptable.find_or_insert(e.ip);
+                    REQUIRE(res.first == (reference.count(e.ip) > 0));
+                    res.second = e.value;
+                    reference[e.ip] = e.value;
+                } else {
+                    iptable.remove(e.ip);
+                    reference.erase(e.ip);
+                }
+                REQUIRE(iptable.size() == reference.size());
+            }
+            check();
+        }
+    }
+
+    SUBCASE("reserved memory") {
+        regban::FlatIPTable<Payload> iptable2(elements.size());
+        const auto capacity = iptable2.slots.size();
+        for (const auto& e : elements) {
+            iptable2.find_or_insert(e.ip).second = e.value;
+            iptable.find_or_insert(e.ip).second = e.value;
+            reference[e.ip] = e.value;
+        }
+        REQUIRE(iptable2.slots.size() == capacity);
+        check();
+        for (const auto& e : elements) {
+            const auto* res = iptable2.find(e.ip);
+            REQUIRE(res != nullptr);
+            REQUIRE(*res == e.value);
+        }
+    }
+
+    SUBCASE("reserve") {
+        for (std::size_t i = 0; i < elements.size() / 2; ++i) {
+            iptable.find_or_insert(elements[i].ip).second = elements[i].value;
+            reference[elements[i].ip] = elements[i].value;
+        }
+        iptable.reserve(elements.size());
+        const auto capacity = iptable.slots.size();
+        check();
+        iptable.reserve(10);
+        REQUIRE(iptable.slots.size() == capacity);
+        for (const auto& e : elements) {
+            iptable.find_or_insert(e.ip).second = e.value;
+            reference[e.ip] = e.value;
+        }
+        REQUIRE(iptable.slots.size() == capacity);
+        check();
+    }
+
+    SUBCASE("remove all") {
+        for (const auto& e : elements) {
+            iptable.find_or_insert(e.ip).second = e.value;
+        }
+        for (const auto& e : elements) {
+            iptable.remove(e.ip);
+            REQUIRE(iptable.find(e.ip) == nullptr);
+        }
+        check();
+        REQUIRE(!(std::begin(iptable) != std::end(iptable)));
+    }
+
+    SUBCASE("evict") {
+        for (const auto& e : elements) {
+            iptable.find_or_insert(e.ip).second = e.value;
+            reference[e.ip] = e.value;
+        }
+        std::size_t hand = 0;
+        // never evicts protected (odd) elements, others only on second visit
+        std::map<IPvX, int> visits;
+        const auto pred = [&](IPvX ip, Payload& value) {
+            REQUIRE(reference.count(ip) > 0);
+            return (value & 1) == 0 && ++visits[ip] > 1;
+        };
+        std::size_t evicted = 0;
+        while (iptable.evict(hand, 2 * iptable.size(), pred)) {
+            REQUIRE(iptable.size() + ++evicted == elements.size());
+        }
+        for (auto it = std::begin(reference); it != std::end(reference);) {
+            if ((it->second & 1) == 0) {
+                REQUIRE(visits[it->first] == 2);
+                it = reference.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        check();
+        REQUIRE(!iptable.evict(hand, 10, [](IPvX, Payload&) { return false; }));
+    }
+}
+
+TEST_CASE_TEMPLATE("erase_if", IPTable, VectorIPTable, BTreeIPTable, CompactIPTable, regban::FlatIPTable<Payload>) {
+    const auto elements = create_skewed_element_list(20000);
+    IPTable iptable;
+    std::map<IPvX, Payload> reference;
+    for (const auto& e : elements) {
+        iptable.find_or_insert(e.ip).second = e.value;
+        reference[e.ip] = e.value;
+    }
+
+    for (int round = 0; round < 3; ++round) {
+        // remove about half of the remaining elements and modify the others
+        std::size_t visited = 0;
+        const auto removed = iptable.erase_if([&](IPvX ip, Payload& value) {
+            const auto it = reference.find(ip);
+            REQUIRE(it != std::end(reference));
+            REQUIRE(it->second == value);
+            ++visited;
+            if (((value >> round) & 1) == 0) {
+                return true;
+            }
+            value += 1;
+            return false;
+        });
+        std::size_t expected = 0;
+        for (auto it = std::begin(reference); it != std::end(reference);) {
+            if (((it->second >> round) & 1) == 0) {
+                it = reference.erase(it);
+                ++expected;
+            } else {
+                it->second += 1;
+                ++it;
+            }
+        }
+        REQUIRE(visited == reference.size() + removed);
+        REQUIRE(removed == expected);
+        REQUIRE(iptable.size() == reference.size());
+        for (const auto& e : elements) {
+            const auto* res = iptable.find(e.ip);
+            const auto it = reference.find(e.ip);
+            if (it == std::end(reference)) {
+                REQUIRE(res == nullptr);
+            } else {
+                REQUIRE(res != nullptr);
+                REQUIRE(*res == it->second);
+            }
+        }
+        std::size_t count = 0;
+        for (const auto& j : iptable) {
+            REQUIRE(reference.count(j.first) == 1);
+            ++count;
+        }
+        REQUIRE(count == reference.size());
+    }
+
+    SUBCASE("insert and remove afterwards") {
+        for (const auto& e : elements) {
+            iptable.find_or_insert(e.ip).second = e.value;
+        }
+        REQUIRE(iptable.size() == elements.size());
+        for (const auto& e : elements) {
+            iptable.remove(e.ip);
+        }
+        REQUIRE(iptable.size() == 0);
+    }
+
+    SUBCASE("remove all") {
+        REQUIRE(iptable.erase_if([](IPvX, Payload&) { return true; }) > 0);
+        REQUIRE(iptable.size() == 0);
+        REQUIRE(!(std::begin(iptable) != std::end(iptable)));
+    }
+}
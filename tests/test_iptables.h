@@ -3,6 +3,7 @@
 
 #include <limits>
 #include <random>
+#include <set>
 #include <vector>
 
 #include "IPTable.h"
@@ -18,7 +19,7 @@ static std::vector<regban::IPTable<Payload>::Element> create_element_list(std::s
     std::mt19937 gen(0);
     std::uniform_int_distribution<int> dist_bool(0, 1);
     std::uniform_int_distribution<IPvX::IPv4> dist_v4(0, std::numeric_limits<IPvX::IPv4>::max());
-    std::uniform_int_distribution<IPvX::Internal> dist_v6(0, std::numeric_limits<IPvX::Internal>::max());
+    std::uniform_int_distribution<std::uint64_t> dist_v6(0, std::numeric_limits<std::uint64_t>::max());
 
     for (int i = 0; i < N; ++i) {
         IPvX ip;
@@ -26,7 +27,7 @@ static std::vector<regban::IPTable<Payload>::Element> create_element_list(std::s
             ip = dist_v4(gen);
         } else {
             do {
-                ip = dist_v6(gen);
+                ip = static_cast<IPvX::Internal>(dist_v6(gen)) << 64 | dist_v6(gen);
             } while (!ip.is_ipv6());
         }
         res[i] = create_element(ip);
@@ -35,4 +36,36 @@ static std::vector<regban::IPTable<Payload>::Element> create_element_list(std::s
     return res;
 }
 
+// distinct ips, most of them within a few hot prefixes (as in a distributed attack), so that some buckets grow large
+static std::vector<regban::IPTable<Payload>::Element> create_skewed_element_list(std::size_t N) {
+    std::vector<regban::IPTable<Payload>::Element> res;
+    res.reserve(N);
+    std::set<IPvX> seen;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> dist_percent(0, 99);
+    std::uniform_int_distribution<IPvX::IPv4> dist_v4(0, std::numeric_limits<IPvX::IPv4>::max());
+    std::uniform_int_distribution<std::uint64_t> dist_v6(0, std::numeric_limits<std::uint64_t>::max());
+    const std::vector<IPvX::IPv4> hot_v4 = {0x0a000000, 0x55000000, 0xb9000000, 0xc6000000};  // /8 prefixes
+    const std::vector<std::uint64_t> hot_v6 = {0x20010db800000000, 0x2a0e000100000000};          // /32 prefixes
+
+    while (res.size() < N) {
+        const auto percent = dist_percent(gen);
+        IPvX ip;
+        if (percent < 60) {
+            ip = hot_v4[percent % hot_v4.size()] | (dist_v4(gen) & 0xffffff);
+        } else if (percent < 90) {
+            ip = static_cast<IPvX::Internal>(hot_v6[percent % hot_v6.size()] | (dist_v6(gen) & 0xffffffff)) << 64 | dist_v6(gen);
+        } else if (percent < 95) {
+            ip = dist_v4(gen);
+        } else {
+            ip = static_cast<IPvX::Internal>(dist_v6(gen) | (1UL << 63)) << 64 | dist_v6(gen);
+        }
+        if (ip != 0 && seen.insert(ip).second) {
+            res.push_back(create_element(ip));
+        }
+    }
+
+    return res;
+}
+
 #endif
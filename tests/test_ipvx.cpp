@@ -3,7 +3,12 @@
 #include "doctest.h"
 // make sure doctest comes before including tested classes
 
+#include <arpa/inet.h>
+
+#include <random>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 #include "IPvX.h"
 
@@ -15,6 +20,8 @@ std::string to_string(IPvX ip) {
     return ss.str();
 }
 
+static IPvX v6(std::uint64_t high, std::uint64_t low = 0) { return static_cast<IPvX::Internal>(high) << 64 | low; }
+
 TEST_CASE("ipv4") {
     SUBCASE("output") {
         {
@@ -42,7 +49,11 @@ TEST_CASE("ipv4") {
         CHECK(0x123 == IPvX::parse("0.0.1.35"));
         CHECK(0x12 == IPvX::parse("0.0.0.18"));
         CHECK(0x1 == IPvX::parse("0.0.0.1"));
-        CHECK(0x12345678 == IPvX::parse("18.52.86.120x"));
+        CHECK(0 == IPvX::parse("18.52.86.120x"));
+        CHECK(0 == IPvX::parse("018.52.86.120"));
+        CHECK(0 == IPvX::parse("18.52.86.256"));
+        CHECK(0 == IPvX::parse(" 18.52.86.120"));
+        CHECK(0 == IPvX::parse("+18.52.86.120"));
 
         CHECK(0 == IPvX::parse("18.52.86"));
         CHECK(0 == IPvX::parse("18.52.86a.1"));
@@ -53,7 +64,24 @@ TEST_CASE("ipv4") {
         CHECK(0 == IPvX::parse(""));
         CHECK(0 == IPvX::parse("18.52.86.120.30"));
         CHECK(0 == IPvX::parse("1800.52.86.120"));
-        // TODO CHECK(IPvX::parse("18.52..1") == 0);
+        CHECK(0 == IPvX::parse("18.52..1"));
+        CHECK(0 == IPvX::parse("18.52..86.1"));
+        CHECK(0x12345678 == IPvX::parse("18.52.86.120.30", 12));
+    }
+
+    SUBCASE("network") {
+        const IPvX ip = 0x12345678;
+        CHECK(!ip.is_ipv6());
+        CHECK(0x12345678 == ip.network(32));
+        CHECK(0x12345679 == ip.network_end(32));
+        CHECK(0x12345600 == ip.network(24));
+        CHECK(0x12345700 == ip.network_end(24));
+        CHECK(0x10000000 == ip.network(4));
+        CHECK(0x20000000 == ip.network_end(4));
+        CHECK(0x1fffffff == ip.network_last(4));
+        CHECK(0x123456ff == ip.network_last(24));
+        CHECK(0x12345678 == ip.network_last(32));
+        CHECK(0xffffffff == IPvX(0xffffff01).network_last(24));
     }
 }
 
@@ -61,53 +89,252 @@ TEST_CASE("ipv6") {
     SUBCASE("output") {
         {
             std::ostringstream ss;
-            ss << IPvX::Formatter(0x1234567890abcdef);
+            ss << IPvX::Formatter(v6(0x1234567890abcdef));
             CHECK(ss.str() == "1234:5678:90ab:cdef::");
         }
-        CHECK(to_string(0x1234567890abcdef) == "1234:5678:90ab:cdef::");
-        CHECK(to_string(0x1234567890abcde) == "123:4567:890a:bcde::");
-        CHECK(to_string(0x1234567890abcd) == "12:3456:7890:abcd::");
-        CHECK(to_string(0x1234567890abc) == "1:2345:6789:abc::");
-        CHECK(to_string(0x1234567890ab) == "0:1234:5678:90ab::");
-        CHECK(to_string(0x1234567890a) == "0:123:4567:890a::");
-        CHECK(to_string(0x1234567890) == "0:12:3456:7890::");
-        CHECK(to_string(0x123456789) == "0:1:2345:6789::");
-        CHECK(to_string(0x1234567890ab0000) == "1234:5678:90ab::");
-        CHECK(to_string(0x1234567800000000) == "1234:5678::");
-        CHECK(to_string(0x1234000000000000) == "1234::");
-        CHECK(to_string(0x1234567890ab0def) == "1234:5678:90ab:def::");
-        CHECK(to_string(0x1234567800abcdef) == "1234:5678:ab:cdef::");
-        CHECK(to_string(0x1234007890abcdef) == "1234:78:90ab:cdef::");
-        CHECK(to_string(0x1234000090abcdef) == "1234:0:90ab:cdef::");
-        CHECK(to_string(0x567890abcdef) == "0:5678:90ab:cdef::");
-        CHECK(to_string(0xfd00001100000000) == "fd00:11::");
+        CHECK(to_string(v6(0x1234567890abcdef)) == "1234:5678:90ab:cdef::");
+        CHECK(to_string(v6(0x1234567890abcde)) == "123:4567:890a:bcde::");
+        CHECK(to_string(v6(0x1234567890abcd)) == "12:3456:7890:abcd::");
+        CHECK(to_string(v6(0x1234567890abc)) == "1:2345:6789:abc::");
+        CHECK(to_string(v6(0x1234567890ab)) == "0:1234:5678:90ab::");
+        CHECK(to_string(v6(0x1234567890a)) == "0:123:4567:890a::");
+        CHECK(to_string(v6(0x1234567890)) == "0:12:3456:7890::");
+        CHECK(to_string(v6(0x123456789)) == "0:1:2345:6789::");
+        CHECK(to_string(v6(0x1234567890ab0000)) == "1234:5678:90ab::");
+        CHECK(to_string(v6(0x1234567800000000)) == "1234:5678::");
+        CHECK(to_string(v6(0x1234000000000000)) == "1234::");
+        CHECK(to_string(v6(0x1234567890ab0def)) == "1234:5678:90ab:def::");
+        CHECK(to_string(v6(0x1234567800abcdef)) == "1234:5678:ab:cdef::");
+        CHECK(to_string(v6(0x1234007890abcdef)) == "1234:78:90ab:cdef::");
+        CHECK(to_string(v6(0x1234000090abcdef)) == "1234:0:90ab:cdef::");
+        CHECK(to_string(v6(0x567890abcdef)) == "0:5678:90ab:cdef::");
+        CHECK(to_string(v6(0xfd00001100000000)) == "fd00:11::");
+        CHECK(to_string(v6(0xfd00001100000000, 1)) == "fd00:11::1");
+        CHECK(to_string(v6(0x20010db800000000, 0x0001000000000001)) == "2001:db8::1:0:0:1");
+        CHECK(to_string(v6(0x20010db800010000, 0x0000000000010001)) == "2001:db8:1::1:1");
+        CHECK(to_string(v6(0x20010db800000001, 0x0001000100010001)) == "2001:db8:0:1:1:1:1:1");
+        CHECK(to_string(v6(0x1234567890abcdef, 0x0001000200030004)) == "1234:5678:90ab:cdef:1:2:3:4");
+        CHECK(to_string(v6(0, 0x0001000000000000)) == "::1:0:0:0");
     }
 
     SUBCASE("parsing") {
-        CHECK(0x1234567890abcdef == IPvX::parse("1234:5678:90ab:cdef::"));
-        CHECK(0x1234567890abcde == IPvX::parse("123:4567:890a:bcde::"));
-        CHECK(0x1234567890abcd == IPvX::parse("12:3456:7890:abcd::"));
-        CHECK(0x1234567890abc == IPvX::parse("1:2345:6789:abc::"));
-        CHECK(0x1234567890ab == IPvX::parse("0:1234:5678:90ab::"));
-        CHECK(0x1234567890a == IPvX::parse("0:123:4567:890a::"));
-        CHECK(0x1234567890 == IPvX::parse("0:12:3456:7890::"));
-        CHECK(0x123456789 == IPvX::parse("0:1:2345:6789::"));
-        CHECK(0x1234567890ab0000 == IPvX::parse("1234:5678:90ab::"));
-        CHECK(0x1234567800000000 == IPvX::parse("1234:5678::"));
-        CHECK(0x1234000000000000 == IPvX::parse("1234::"));
-        CHECK(0x1234567890ab0def == IPvX::parse("1234:5678:90ab:def::"));
-        CHECK(0x1234567800abcdef == IPvX::parse("1234:5678:ab:cdef::"));
-        CHECK(0x1234007890abcdef == IPvX::parse("1234:78:90ab:cdef::"));
-        CHECK(0x1234000090abcdef == IPvX::parse("1234:0:90ab:cdef::"));
-        CHECK(0x567890abcdef == IPvX::parse("0:5678:90ab:cdef::"));
-
-        CHECK(0x1234567890abcdef == IPvX::parse("1234:5678:90ab:cdef::x"));
+        CHECK(v6(0x1234567890abcdef) == IPvX::parse("1234:5678:90ab:cdef::"));
+        CHECK(v6(0x1234567890abcde) == IPvX::parse("123:4567:890a:bcde::"));
+        CHECK(v6(0x1234567890abcd) == IPvX::parse("12:3456:7890:abcd::"));
+        CHECK(v6(0x1234567890abc) == IPvX::parse("1:2345:6789:abc::"));
+        CHECK(v6(0x1234567890ab) == IPvX::parse("0:1234:5678:90ab::"));
+        CHECK(v6(0x1234567890a) == IPvX::parse("0:123:4567:890a::"));
+        CHECK(v6(0x1234567890) == IPvX::parse("0:12:3456:7890::"));
+        CHECK(v6(0x123456789) == IPvX::parse("0:1:2345:6789::"));
+        CHECK(v6(0x1234567890ab0000) == IPvX::parse("1234:5678:90ab::"));
+        CHECK(v6(0x1234567800000000) == IPvX::parse("1234:5678::"));
+        CHECK(v6(0x1234000000000000) == IPvX::parse("1234::"));
+        CHECK(v6(0x1234567890ab0def) == IPvX::parse("1234:5678:90ab:def::"));
+        CHECK(v6(0x1234567800abcdef) == IPvX::parse("1234:5678:ab:cdef::"));
+        CHECK(v6(0x1234007890abcdef) == IPvX::parse("1234:78:90ab:cdef::"));
+        CHECK(v6(0x1234000090abcdef) == IPvX::parse("1234:0:90ab:cdef::"));
+        CHECK(v6(0x567890abcdef) == IPvX::parse("0:5678:90ab:cdef::"));
+
+        CHECK(0 == IPvX::parse("1234:5678:90ab:cdef::x"));
         CHECK(0 == IPvX::parse("x1234:5678:90ab:cdef::"));
         CHECK(0 == IPvX::parse("1234x:5678:90ab:cdef::"));
         CHECK(0 == IPvX::parse("1234:5678x:90ab:cdef::"));
         CHECK(0 == IPvX::parse("1234:5678:90abx:cdef::"));
         CHECK(0 == IPvX::parse("12345:5678:90ab::cdef::"));
-        CHECK(0xfd00001100000000 == IPvX::parse("fd00:11::1"));  // skipping second half of IPv6
-        // TODO CHECK(0 == IPvX::parse("1234:5678:90ab:cdef:"));
+        CHECK(v6(0xfd00001100000000, 1) == IPvX::parse("fd00:11::1"));
+        CHECK(v6(0xfd00001100000000, 1) == IPvX::parse("FD00:11::1"));
+        CHECK(v6(0x1234567800000000) == IPvX::parse("1234:5678::x", 11));
+        CHECK(0 == IPvX::parse("1234:5678::x", 9));
+        CHECK(0 == IPvX::parse("1234:5678:90ab:cdef:"));
+        CHECK(v6(0x1234567890abcdef, 0x0001000200030004) == IPvX::parse("1234:5678:90ab:cdef:1:2:3:4"));
+        CHECK(v6(0x1234567890abcdef, 0x0001000201020304) == IPvX::parse("1234:5678:90AB:CDEF:1:2:1.2.3.4"));
+        CHECK(v6(0x12340000000000ff) == IPvX::parse("1234::ff:0:0:0:0"));
+        CHECK(v6(0x1234000000000000, 0x01020304) == IPvX::parse("1234::1.2.3.4"));
+        CHECK(0 == IPvX::parse("1234:5678:90ab:cdef:1:2:3:4:5"));
+        CHECK(0 == IPvX::parse("1234:5678:90ab:cdef:1:2:3"));
+        CHECK(0 == IPvX::parse("1234::5678::"));
+        CHECK(0 == IPvX::parse("1234:::"));
+        CHECK(0 == IPvX::parse(":1234::"));
+        CHECK(0 == IPvX::parse("1234:5678:90ab:cdef:1:2:3::4"));
+        CHECK(0 == IPvX::parse("1234::1.2.3"));
+        CHECK(0 == IPvX::parse("1234::1.2.3.4:1"));
+        CHECK(0 == IPvX::parse("1234:1.2.3.4::"));
+    }
+
+    SUBCASE("reserved") {
+        // ipv4-mapped
+        CHECK(0x01020304 == IPvX::parse("::ffff:1.2.3.4"));
+        CHECK(0x01020304 == IPvX::parse("::FFFF:102:304"));
+        CHECK(0x01020304 == IPvX::parse("0:0:0:0:0:ffff:1.2.3.4"));
+        CHECK(!IPvX::parse("::ffff:1.2.3.4").is_ipv6());
+        CHECK(0 == IPvX::parse("::ffff:0.0.0.0"));
+        // ipv4-compatible
+        CHECK(0 == IPvX::parse("::1.2.3.4"));
+        CHECK(0 == IPvX::parse("::102:304"));
+        // loopback and unspecified
+        CHECK(0 == IPvX::parse("::1"));
+        CHECK(0 == IPvX::parse("::"));
+        // rest of ::/32
+        CHECK(0 == IPvX::parse("::1:0:0:0"));
+        CHECK(0 == IPvX::parse("0:0:1::"));
+        CHECK(0 == IPvX::parse("::ffff:0:1.2.3.4"));
+        CHECK(v6(0x0000000100000000) == IPvX::parse("0:1::"));
+        CHECK(v6(0x0001000000000000) == IPvX::parse("1::"));
+        CHECK(v6(0x0064ff9b00000000, 0x01020304) == IPvX::parse("64:ff9b::1.2.3.4"));
+    }
+
+    SUBCASE("network") {
+        const auto ip = v6(0x20010db812345678, 0x90abcdef12345678);
+        CHECK(ip.is_ipv6());
+        CHECK(ip == ip.network(128));
+        CHECK(v6(0x20010db812345678, 0x90abcdef12345679) == ip.network_end(128));
+        CHECK(v6(0x20010db812345678) == ip.network(64));
+        CHECK(v6(0x20010db812345679) == ip.network_end(64));
+        CHECK(v6(0x20010db812345600) == ip.network(56));
+        CHECK(v6(0x20010db812340000) == ip.network(48));
+        CHECK(v6(0x20010db812350000) == ip.network_end(48));
+        CHECK(v6(0x2000000000000000) == ip.network(3));
+        CHECK(v6(0x20010db812345678, 0xffffffffffffffff) == ip.network_last(64));
+        CHECK(ip == ip.network_last(128));
+        CHECK(~static_cast<IPvX::Internal>(0) == v6(0xffffffffffffffff, 1).network_last(64));
+
+        // short prefixes keep the address family
+        const auto low = IPvX::parse("0:1:ffff::1");
+        CHECK(v6(0x0000000100000000) == low.network(IPvX::MIN_PREFIX_LENGTH_V6));
+        CHECK(low.network(IPvX::MIN_PREFIX_LENGTH_V6).is_ipv6());
+        CHECK(IPvX::parse("2001:db8::1").network(IPvX::MIN_PREFIX_LENGTH_V6).is_ipv6());
+        CHECK(IPvX::parse("64:ff9b::1.2.3.4").network(IPvX::MIN_PREFIX_LENGTH_V6).is_ipv6());
+    }
+}
+
+// reference using inet_pton
+static IPvX reference_parse(const std::string& s) {
+    if (s.find(':') != std::string::npos) {
+        unsigned char addr[16];
+        if (inet_pton(AF_INET6, s.c_str(), addr) != 1) {
+            return 0;
+        }
+        IPvX::Internal res = 0;
+        for (int i = 0; i < 16; ++i) {
+            res = (res << 8) | addr[i];
+        }
+        if ((res >> IPvX::TOTAL_BIT_SIZE_V4) == 0xffff) {
+            return static_cast<IPvX::IPv4>(res);  // ipv4-mapped
+        }
+        return (res >> (IPvX::TOTAL_BIT_SIZE_V6 - IPvX::MIN_PREFIX_LENGTH_V6)) == 0 ? 0 : res;  // rest of ::/32 is rejected
+    }
+    in_addr addr;
+    if (inet_pton(AF_INET, s.c_str(), &addr) != 1) {
+        return 0;
+    }
+    return ntohl(addr.s_addr);
+}
+
+TEST_CASE("fuzz") {
+    std::mt19937_64 random(42);
+
+    SUBCASE("round trip") {
+        for (int i = 0; i < 10000; ++i) {
+            const IPvX v4 = (random() & 0xffffffff) | 1;
+            CHECK(v4 == IPvX::parse(to_string(v4).c_str()));
+            const auto ip = v6(random() | (1UL << 63), random());
+            CHECK(ip == IPvX::parse(to_string(ip).c_str()));
+            CHECK(ip.network(IPvX::MIN_PREFIX_LENGTH_V6 + random() % (IPvX::TOTAL_BIT_SIZE_V6 - IPvX::MIN_PREFIX_LENGTH_V6 + 1)).is_ipv6());
+            const auto zeros = v6((random() & 0xffff0000ffff0000) | (1UL << 62), random() & 0xffff00000000ffff);
+            CHECK(zeros == IPvX::parse(to_string(zeros).c_str()));
+        }
+    }
+
+    SUBCASE("ipv6 notations") {
+        for (int i = 0; i < 10000; ++i) {
+            std::vector<unsigned int> groups(8);
+            for (auto& group : groups) {
+                group = random() % 3 == 0 ? 0 : random() & 0xffff;
+            }
+            const bool embedded_v4 = random() % 4 == 0;
+            const auto group_count = embedded_v4 ? 6 : 8;
+            const int gap_begin = random() % (group_count + 1);
+            const int gap_end = random() % 2 == 0 ? gap_begin : gap_begin + random() % (group_count - gap_begin + 1);
+            std::ostringstream ss;
+            ss << std::hex;
+            if (random() % 2 == 0) {
+                ss << std::uppercase;
+            }
+            for (int g = 0; g < group_count; ++g) {
+                if (g >= gap_begin && g < gap_end) {
+                    if (g == gap_begin) {
+                        ss << (g == 0 ? "::" : ":");
+                    }
+                    continue;
+                }
+                if (random() % 4 == 0) {
+                    ss.width(4);
+                    ss.fill('0');
+                }
+                ss << (gap_begin == gap_end || gap_end < group_count || g < gap_begin ? groups[g] : 0);
+                if (g + 1 < group_count || embedded_v4) {
+                    ss << ':';
+                }
+            }
+            if (gap_end == group_count && gap_end > gap_begin && !embedded_v4) {
+                ss << ':';
+            }
+            if (embedded_v4) {
+                ss << std::dec << (groups[6] >> 8) << '.' << (groups[6] & 0xff) << '.' << (groups[7] >> 8) << '.' << (groups[7] & 0xff);
+            }
+            const auto s = ss.str();
+            INFO(s);
+            CHECK(reference_parse(s) == IPvX::parse(s.c_str()));
+        }
+    }
+
+    SUBCASE("garbage") {
+        const std::string alphabet = "0123456789abcdefABCDEF:.:.g ";
+        const std::vector<std::string> valid = {"1.2.3.4", "192.168.100.200", "1234:5678:90ab:cdef::", "fd00:11::1", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6:1.2.3.4"};
+        for (int i = 0; i < 100000; ++i) {
+            std::string s;
+            if (random() % 2 == 0) {
+                const auto length = random() % 47;
+                for (std::size_t j = 0; j < length; ++j) {
+                    s.push_back(alphabet[random() % alphabet.size()]);
+                }
+            } else {
+                s = valid[random() % valid.size()];
+                for (int j = random() % 3; j >= 0; --j) {
+                    const auto pos = random() % (s.size() + 1);
+                    switch (random() % 3) {
+                        case 0:
+                            s.insert(pos, 1, alphabet[random() % alphabet.size()]);
+                            break;
+                        case 1:
+                            if (pos < s.size()) {
+                                s.erase(pos, 1);
+                            }
+                            break;
+                        default:
+                            if (pos < s.size()) {
+                                s[pos] = alphabet[random() % alphabet.size()];
+                            }
+                            break;
+                    }
+                }
+            }
+            INFO(s);
+            CHECK(reference_parse(s) == IPvX::parse(s.data(), s.size()));
+        }
+    }
+
+    SUBCASE("parse_many") {
+        const std::vector<std::string> strings = {"1.2.3.4", "x", "1234:5678::", "1.2.3.4.5"};
+        std::vector<std::pair<const char*, std::size_t>> input;
+        for (const auto& s : strings) {
+            input.emplace_back(s.data(), s.size());
+        }
+        std::vector<IPvX> output(strings.size());
+        CHECK(2 == IPvX::parse_many(std::begin(input), std::end(input), std::begin(output)));
+        CHECK(0x01020304 == output[0]);
+        CHECK(0 == output[1]);
+        CHECK(v6(0x1234567800000000) == output[2]);
+        CHECK(0 == output[3]);
     }
 }
@@ -0,0 +1,179 @@
+#define DOCTEST_CONFIG_SUPER_FAST_ASSERTS
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+// make sure doctest comes before including tested classes
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "LineBuffer.h"
+#include "LogFile.h"
+
+using regban::LineBuffer;
+using regban::LogFile;
+
+static std::vector<std::string> feed(LineBuffer& buffer, const std::string& s) {
+    std::vector<std::string> lines;
+    std::memcpy(buffer.prepare(s.size()), s.data(), s.size());
+    buffer.commit(s.size(), [&](const char* begin, const char* end) { lines.emplace_back(begin, end); });
+    return lines;
+}
+
+TEST_CASE("lines") {
+    LineBuffer buffer(10);
+
+    SUBCASE("complete") {
+        const auto lines = feed(buffer, "abc\ndef\r\n\nghi\n");
+        REQUIRE(lines.size() == 4);
+        CHECK(lines[0] == "abc");
+        CHECK(lines[1] == "def");
+        CHECK(lines[2] == "");
+        CHECK(lines[3] == "ghi");
+        CHECK(buffer.pending() == 0);
+    }
+
+    SUBCASE("partial") {
+        auto lines = feed(buffer, "abc\nde");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "abc");
+        CHECK(buffer.pending() == 2);
+        lines = feed(buffer, "f");
+        CHECK(lines.empty());
+        lines = feed(buffer, "g\nh");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "defg");
+        CHECK(buffer.pending() == 1);
+    }
+
+    SUBCASE("reset") {
+        auto lines = feed(buffer, "abc\nde");
+        CHECK(buffer.pending() == 2);
+        buffer.reset();
+        CHECK(buffer.pending() == 0);
+        lines = feed(buffer, "fg\n");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "fg");
+    }
+
+    SUBCASE("maximum length") {
+        const auto lines = feed(buffer, "0123456789\n");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "0123456789");
+        CHECK(buffer.skipped_lines() == 0);
+    }
+}
+
+TEST_CASE("overlong") {
+    SUBCASE("skip") {
+        LineBuffer buffer(4, LineBuffer::OverlongPolicy::SKIP);
+        auto lines = feed(buffer, "abcdefgh\nij\n");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "ij");
+        CHECK(buffer.skipped_lines() == 1);
+
+        lines = feed(buffer, "abcde");
+        CHECK(lines.empty());
+        CHECK(buffer.pending() == 0);
+        lines = feed(buffer, "fgh");
+        CHECK(lines.empty());
+        lines = feed(buffer, "ijk\nlm\n");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "lm");
+        CHECK(buffer.skipped_lines() == 2);
+        CHECK(buffer.truncated_lines() == 0);
+    }
+
+    SUBCASE("truncate") {
+        LineBuffer buffer(4, LineBuffer::OverlongPolicy::TRUNCATE);
+        auto lines = feed(buffer, "abcdefgh\nij\nklmnop");
+        REQUIRE(lines.size() == 3);
+        CHECK(lines[0] == "abcd");
+        CHECK(lines[1] == "ij");
+        CHECK(lines[2] == "klmn");
+        lines = feed(buffer, "qr\nst\n");
+        REQUIRE(lines.size() == 1);
+        CHECK(lines[0] == "st");
+        CHECK(buffer.truncated_lines() == 2);
+        CHECK(buffer.skipped_lines() == 0);
+    }
+}
+
+TEST_CASE("read") {
+    int p[2];
+    REQUIRE(pipe2(p, O_NONBLOCK) == 0);
+    LineBuffer buffer;
+    std::vector<std::string> lines;
+    const auto callback = [&](const char* begin, const char* end) { lines.emplace_back(begin, end); };
+
+    std::string long_line(3 * LineBuffer::DEFAULT_MAX_LINE_LENGTH / 4, 'x');
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(write(p[1], long_line.data(), long_line.size()) == static_cast<ssize_t>(long_line.size()));
+        REQUIRE(write(p[1], "\n", 1) == 1);
+    }
+    auto res = buffer.read_from(p[0], callback);
+    CHECK(res.bytes == 10 * (long_line.size() + 1));
+    CHECK(!res.eof);
+    REQUIRE(lines.size() == 10);
+    CHECK(lines[9] == long_line);
+
+    REQUIRE(write(p[1], "abc", 3) == 3);
+    close(p[1]);
+    res = buffer.read_from(p[0], callback);
+    CHECK(res.bytes == 3);
+    CHECK(res.eof);
+    CHECK(lines.size() == 10);
+    CHECK(buffer.pending() == 3);
+    close(p[0]);
+}
+
+static void append(const std::string& filename, const std::string& s) {
+    auto* f = std::fopen(filename.c_str(), "a");
+    REQUIRE(f != nullptr);
+    REQUIRE(std::fwrite(s.data(), 1, s.size(), f) == s.size());
+    std::fclose(f);
+}
+
+TEST_CASE("logfile") {
+    char dir[] = "/tmp/test_linebuffer.XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    const std::string filename = std::string(dir) + "/log";
+    append(filename, "old\n");
+    LogFile logfile(filename);
+    LineBuffer buffer;
+    std::vector<std::string> lines;
+    const auto callback = [&](const char* begin, const char* end) { lines.emplace_back(begin, end); };
+
+    append(filename, "abc\nunterminated");
+    logfile.check(buffer, callback);
+    REQUIRE(lines.size() == 1);
+    CHECK(lines[0] == "abc");
+    CHECK(buffer.pending() == 12);
+
+    SUBCASE("rotation") {
+        REQUIRE(std::rename(filename.c_str(), (filename + ".1").c_str()) == 0);
+        append(filename, "def\n");
+        logfile.check(buffer, callback);
+        REQUIRE(lines.size() == 2);
+        CHECK(lines[1] == "def");
+        CHECK(buffer.pending() == 0);
+        CHECK(logfile.position().second == 4);
+        std::remove((filename + ".1").c_str());
+    }
+
+    SUBCASE("truncation") {
+        REQUIRE(truncate(filename.c_str(), 0) == 0);
+        append(filename, "de\n");
+        logfile.check(buffer, callback);
+        REQUIRE(lines.size() == 2);
+        CHECK(lines[1] == "de");
+        CHECK(buffer.pending() == 0);
+    }
+
+    std::remove(filename.c_str());
+    rmdir(dir);
+}
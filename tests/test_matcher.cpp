@@ -0,0 +1,143 @@
+#define DOCTEST_CONFIG_SUPER_FAST_ASSERTS
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+// make sure doctest comes before including tested classes
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "PatternMatcher.h"
+
+using regban::PatternMatcher;
+
+// (pattern index, capture) for each matching pattern
+static std::vector<std::pair<std::size_t, std::string>> match(const PatternMatcher& matcher, const std::string& line) {
+    std::vector<std::pair<std::size_t, std::string>> res;
+    matcher.match(line.data(), line.data() + line.size(),
+                  [&](std::size_t index, const char* begin, const char* end) { res.emplace_back(index, std::string(begin, end)); });
+    return res;
+}
+
+static std::vector<std::pair<std::size_t, std::string>> match_regex(const std::vector<std::regex>& regexes, const std::string& line) {
+    std::vector<std::pair<std::size_t, std::string>> res;
+    for (std::size_t i = 0; i < regexes.size(); ++i) {
+        std::smatch m;
+        if (std::regex_match(line, m, regexes[i])) {
+            res.emplace_back(i, m[1].str());
+        }
+    }
+    return res;
+}
+
+static const std::vector<std::string> patterns = {
+    ".* Invalid user .* from ([0-9a-f:\\.]+).*",
+    ".*Failed password for .* from ([0-9a-f:\\.]+) port \\d+ ssh2",
+    "([0-9a-f:\\.]+) - - \\[.*\\] \"(?:GET|POST) /wp-login\\.php.*",
+    "(.*?)(?:ab)+c?",
+    "x{2,3}(y*)z{2}",
+    "[^a-c\\]]*(a|ab|abc)[\\w-]+\\s?",
+    "\\x41(\\d{1,3}).",
+};
+
+static const std::vector<std::string> lines = {
+    "",
+    "Jan  1 00:00:00 host sshd[123]: Invalid user admin from 192.0.2.1 port 4711",
+    "Jan  1 00:00:00 host sshd[123]: Invalid user admin from 2001:db8::1",
+    "Jan  1 00:00:00 host sshd[123]: Invalid user from from 192.0.2.1 from 192.0.2.2",
+    "Jan  1 00:00:00 host sshd[123]: Failed password for root from 192.0.2.3 port 22 ssh2",
+    "Jan  1 00:00:00 host sshd[123]: Failed password for root from 192.0.2.3 port 22 ssh2 ",
+    "Jan  1 00:00:00 host sshd[123]: Accepted publickey for root from 192.0.2.3 port 22 ssh2",
+    "192.0.2.4 - - [01/Jan/2000:00:00:00 +0000] \"POST /wp-login.php HTTP/1.1\" 200 123",
+    "192.0.2.4 - - [01/Jan/2000:00:00:00 +0000] \"PUT /wp-login.php HTTP/1.1\" 200 123",
+    "192.0.2.4 - - [01/Jan/2000:00:00:00 +0000] \"GET /wp-loginXphp HTTP/1.1\" 200 123",
+    "ab",
+    "xababc",
+    "ababab",
+    "xxyyzz",
+    "xxxzz",
+    "xxxxzz",
+    "xyzz",
+    "dd]abc-x ",
+    "ddabcabc",
+    "]abc",
+    "A123x",
+    "A1234x",
+    "A\n",
+    "A1\r",
+    "A1\xff",
+};
+
+TEST_CASE("std::regex equivalence") {
+    PatternMatcher matcher;
+    std::vector<std::regex> regexes;
+    for (const auto& p : patterns) {
+        CHECK(matcher.add(p) == regexes.size());
+        regexes.emplace_back(p);
+    }
+
+    SUBCASE("dfa") {
+        REQUIRE(matcher.compile());
+        for (const auto& line : lines) {
+            INFO(line);
+            CHECK(match(matcher, line) == match_regex(regexes, line));
+        }
+    }
+
+    SUBCASE("no dfa") {
+        // without compile() all patterns are run through the VM
+        for (const auto& line : lines) {
+            INFO(line);
+            CHECK(match(matcher, line) == match_regex(regexes, line));
+        }
+    }
+}
+
+TEST_CASE("unsupported") {
+    PatternMatcher matcher;
+    for (const auto& p : {"(a)\\1", "(?=a)(a)", "\\b(a)", "a^(b)", "[[:alpha:]](a)", "(a", "a)(b)", "(a{2000})", "\\q(a)"}) {
+        INFO(p);
+        CHECK_THROWS_AS(matcher.add(p), PatternMatcher::Unsupported);
+    }
+    CHECK_THROWS_AS(matcher.add("abc"), std::runtime_error);
+    CHECK_THROWS_AS(matcher.add("(a)(b)"), std::runtime_error);
+    CHECK(matcher.size() == 0);
+    CHECK(matcher.add("^(a)$") == 0);
+    CHECK(matcher.compile());
+    CHECK(match(matcher, "a").size() == 1);
+}
+
+TEST_CASE("prefilter") {
+    PatternMatcher matcher;
+    matcher.add(".* Invalid user .* from ([0-9a-f:\\.]+).*");
+    matcher.add("(?:GET|POST) /(.*)");
+    matcher.add("x{2}(?:abc)+(y)z");
+    matcher.add("a([0-9a-f:\\.]+)");
+    matcher.compile();
+    CHECK(matcher.literal(0) == " Invalid user ");
+    CHECK(matcher.literal(1) == "");
+    CHECK(matcher.literal(2) == "abc");
+    CHECK(matcher.literal(3) == "");
+
+    const std::string long_line(100, 'x');  // for SIMD scan
+    const std::vector<std::string> prefilter_lines = {
+        "Invalid user root from 1.2.3.4",
+        " Invalid user root from 1.2.3.4",
+        long_line + " Invalid user root from 1.2.3.4",
+        long_line + " Invalid user",
+        long_line + " Invalid use",
+        long_line + " Invalid user root",
+        long_line + "xxabcyz",
+        "abc",
+    };
+    for (const auto& line : prefilter_lines) {
+        match(matcher, line);
+    }
+    CHECK(matcher.candidates(0) == 3);
+    CHECK(matcher.matches(0) == 2);
+    CHECK(matcher.candidates(1) == 8);
+    CHECK(matcher.matches(1) == 0);
+    CHECK(matcher.candidates(2) == 2);
+    CHECK(matcher.matches(2) == 0);
+    CHECK(matcher.matches(3) == 1);
+}
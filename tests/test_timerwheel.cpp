@@ -0,0 +1,115 @@
+#define DOCTEST_CONFIG_SUPER_FAST_ASSERTS
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+// make sure doctest comes before including tested classes
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "TimerWheel.h"
+
+using Wheel = regban::TimerWheel<unsigned int>;
+using Tick = Wheel::Tick;
+
+TEST_CASE("single") {
+    Wheel wheel(1000);
+
+    SUBCASE("due") {
+        CHECK(wheel.schedule(1, 1005) == 1005);
+        std::vector<Tick> fired;
+        CHECK(wheel.advance(1004, [&](unsigned int, Tick) { fired.push_back(wheel.now()); }) == 0);
+        CHECK(wheel.size() == 1);
+        CHECK(wheel.advance(1005, [&](unsigned int key, Tick tick) {
+            CHECK(key == 1);
+            CHECK(tick == 1005);
+            fired.push_back(wheel.now());
+        }) == 1);
+        CHECK(fired == std::vector<Tick>{1005});
+        CHECK(wheel.size() == 0);
+    }
+
+    SUBCASE("past") {
+        CHECK(wheel.schedule(1, 10) == 1001);
+        CHECK(wheel.advance(1001, [](unsigned int, Tick) {}) == 1);
+    }
+
+    SUBCASE("overflow") {
+        const Tick tick = 1000 + (Tick(1) << 30) + 17;
+        wheel.schedule(1, tick);
+        CHECK(wheel.advance(tick - 1, [](unsigned int, Tick) {}) == 0);
+        CHECK(wheel.advance(tick, [](unsigned int, Tick) {}) == 1);
+    }
+
+    SUBCASE("clear") {
+        wheel.schedule(1, 1001);
+        wheel.schedule(2, 5000);
+        wheel.schedule(3, 1000 + (Tick(1) << 30));
+        wheel.clear();
+        CHECK(wheel.size() == 0);
+        CHECK(wheel.advance(1000 + (Tick(1) << 31), [](unsigned int, Tick) {}) == 0);
+    }
+
+    SUBCASE("reschedule") {
+        wheel.schedule(1, 1001);
+        std::size_t count = 0;
+        wheel.advance(1500, [&](unsigned int key, Tick tick) {
+            ++count;
+            if (count < 10) {
+                wheel.schedule(key, tick + 50);
+            }
+        });
+        CHECK(count == 10);
+        CHECK(wheel.size() == 0);
+    }
+}
+
+TEST_CASE("random") {
+    std::mt19937_64 gen(42);
+    const Tick start = 1600000000;
+    Wheel wheel(start);
+    std::multiset<std::pair<Tick, unsigned int>> reference;
+    Tick now = start;
+
+    for (unsigned int round = 0; round < 2000; ++round) {
+        const auto n = gen() % 50;
+        for (unsigned int i = 0; i < n; ++i) {
+            Tick delta;
+            switch (gen() % 4) {
+                case 0:
+                    delta = gen() % 64;
+                    break;
+                case 1:
+                    delta = gen() % 5000;
+                    break;
+                case 2:
+                    delta = gen() % 500000;
+                    break;
+                default:
+                    delta = gen() % (Tick(1) << 26);
+                    break;
+            }
+            const auto key = static_cast<unsigned int>(gen());
+            const auto tick = wheel.schedule(key, now + delta);
+            CHECK(tick == std::max(now + delta, now + 1));
+            reference.emplace(tick, key);
+        }
+        CHECK(wheel.size() == reference.size());
+
+        now += (gen() % 8 == 0) ? gen() % (Tick(1) << 22) : gen() % 100;
+        std::multiset<std::pair<Tick, unsigned int>> fired;
+        const auto due = wheel.advance(now, [&](unsigned int key, Tick tick) {
+            CHECK(tick == wheel.now());
+            fired.emplace(tick, key);
+        });
+        CHECK(wheel.now() == now);
+        const auto end = reference.upper_bound({now, std::numeric_limits<unsigned int>::max()});
+        REQUIRE(due == static_cast<std::size_t>(std::distance(std::begin(reference), end)));
+        CHECK(fired == std::multiset<std::pair<Tick, unsigned int>>(std::begin(reference), end));
+        reference.erase(std::begin(reference), end);
+    }
+}